@@ -6,24 +6,22 @@
 #include <random>
 #include <fcntl.h>
 
-static VM::Value* WriteOutput(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value WriteOutput(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	for (size_t i = 0; i < argc; ++i)
 	{
-		std::wstring s;
-		argv[i]->AsString(s);
-		std::wcout << s;
+		argv[i].VisitString([](const wchar_t* s, size_t length) { std::wcout.write(s, length); });
 	}
 	fflush(stdout);
 	return context->GC().NewBooleanValue(false);
 }
 
-static VM::Value* ReadInput(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ReadInput(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	for (size_t i = 0; i < argc; ++i)
 	{
 		std::wstring s;
-		argv[i]->AsString(s);
+		argv[i].AsString(s);
 		std::wcout << s;
 	}
 
@@ -32,76 +30,76 @@ static VM::Value* ReadInput(VM::Engine* context, size_t argc, VM::Value** argv)
 	return context->GC().NewStringValue(v);
 }
 
-static VM::Value* ValueToInteger(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ValueToInteger(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
-		return context->GC().NewIntegerValue(argv[0]->AsInteger());
+		return context->GC().NewIntegerValue(argv[0].AsInteger());
 	return context->GC().NewIntegerValue(0);
 }
 
-static VM::Value* ValueToNumber(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ValueToNumber(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
-		return context->GC().NewRealValue(argv[0]->AsReal());
+		return context->GC().NewRealValue(argv[0].AsReal());
 	return context->GC().NewRealValue(0.0);
 }
 
-static VM::Value* ValueToString(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ValueToString(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 	{
 		std::wstring s;
-		argv[0]->AsString(s);
+		argv[0].AsString(s);
 		return context->GC().NewStringValue(s);
 	}
 	return context->GC().NewStringValue(nullptr, 0);
 }
 
-static VM::Value* ValueFloor(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ValueFloor(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
-		return context->GC().NewIntegerValue(static_cast<int64_t>(std::floor(argv[0]->AsReal())));
+		return context->GC().NewIntegerValue(static_cast<int64_t>(std::floor(argv[0].AsReal())));
 	return context->GC().NewIntegerValue(0);
 }
 
-static VM::Value* ValueCeiling(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ValueCeiling(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
-		return context->GC().NewIntegerValue(static_cast<int64_t>(std::ceil(argv[0]->AsReal())));
+		return context->GC().NewIntegerValue(static_cast<int64_t>(std::ceil(argv[0].AsReal())));
 	return context->GC().NewIntegerValue(0);
 }
 
-static VM::Value* GetArrayRow(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value GetArrayRow(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 	{
-		return context->GC().NewIntegerValue(static_cast<uint64_t>(argv[0]->GetRow()));
+		return context->GC().NewIntegerValue(static_cast<uint64_t>(argv[0].GetRow()));
 	}
 	return context->GC().NewIntegerValue(0);
 }
 
-static VM::Value* GetArrayCol(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value GetArrayCol(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 	{
-		return context->GC().NewIntegerValue(static_cast<uint64_t>(argv[0]->GetCol()));
+		return context->GC().NewIntegerValue(static_cast<uint64_t>(argv[0].GetCol()));
 	}
 	return context->GC().NewIntegerValue(0);
 }
 
-static VM::Value* XSetConsoleTitle(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value XSetConsoleTitle(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 		return argv[0];
 	return context->GC().NewStringValue(L"", -1);
 }
 
-static VM::Value* SetConsoleBackgroundColor(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value SetConsoleBackgroundColor(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 	{
 		std::wstring colorCode;
-		auto color = argv[0]->AsString();
+		auto color = argv[0].AsString();
 		if (color == L"Black")
 			colorCode = L"\033[40m";
 		else if (color == L"DarkBlue")
@@ -139,12 +137,12 @@ static VM::Value* SetConsoleBackgroundColor(VM::Engine* context, size_t argc, VM
 	return context->GC().NewStringValue(nullptr, 0);
 }
 
-static VM::Value* SetConsoleForegroundColor(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value SetConsoleForegroundColor(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc > 0)
 	{
 		std::wstring colorCode;
-		auto color = argv[0]->AsString();
+		auto color = argv[0].AsString();
 		if (color == L"Black")
 			colorCode = L"\033[30m";
 		else if (color == L"DarkBlue")
@@ -182,14 +180,14 @@ static VM::Value* SetConsoleForegroundColor(VM::Engine* context, size_t argc, VM
 	return context->GC().NewStringValue(nullptr, 0);
 }
 
-static VM::Value* XSetConsoleCursorPosition(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value XSetConsoleCursorPosition(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc == 2)
 	{
 		std::wstring code;
 		code = L"\033[";
-		auto x = (uint16_t)argv[0]->AsInteger();
-		auto y = (uint16_t)argv[1]->AsInteger();
+		auto x = (uint16_t)argv[0].AsInteger();
+		auto y = (uint16_t)argv[1].AsInteger();
 		code += std::to_wstring(y);
 		code += L";";
 		code += std::to_wstring(x);
@@ -200,7 +198,7 @@ static VM::Value* XSetConsoleCursorPosition(VM::Engine* context, size_t argc, VM
 	return context->GC().NewBooleanValue(true);
 }
 
-static VM::Value* GetNewLine(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value GetNewLine(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	return context->GC().NewStringValue(L"\r\n");
 }
@@ -373,37 +371,37 @@ static const wchar_t* scanKeyboard()
 }
 
 
-static VM::Value* ReadInputKey(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ReadInputKey(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	std::wstring key = scanKeyboard();
 	return context->GC().NewStringValue(key);
 }
 
-static VM::Value* ReadGVar(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ReadGVar(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc >= 1)
-		return context->GetGlobalVariable(argv[0]->AsString());
+		return context->GetGlobalVariable(argv[0]);
 	return context->GC().NewBooleanValue(false);
 }
 
-static VM::Value* WriteGVar(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value WriteGVar(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	if (argc >= 2)
 	{
-		context->SetGlobalVariable(argv[0]->AsString(), argv[1]);
+		context->SetGlobalVariable(argv[0], argv[1]);
 		return argv[1];
 	}
 	return context->GC().NewBooleanValue(false);
 }
 
-static VM::Value* ReadTimeMS(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value ReadTimeMS(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	auto t = std::chrono::system_clock::now().time_since_epoch();
 	auto mil = std::chrono::duration_cast<std::chrono::milliseconds>(t);
 	return context->GC().NewIntegerValue(mil.count());
 }
 
-static VM::Value* GetRandom(VM::Engine* context, size_t argc, VM::Value** argv)
+static VM::Value GetRandom(VM::Engine* context, size_t argc, VM::Value* argv)
 {
 	static std::default_random_engine e(
 		static_cast<unsigned int>
@@ -420,28 +418,28 @@ static VM::Value* GetRandom(VM::Engine* context, size_t argc, VM::Value** argv)
 	}
 	else if (argc == 1)
 	{
-		if (argv[0]->Is(VM::Value::Integer))
+		if (argv[0].Is(VM::Value::Integer))
 		{
-			std::uniform_int_distribution<int64_t> u(0, argv[0]->AsInteger());
+			std::uniform_int_distribution<int64_t> u(0, argv[0].AsInteger());
 			auto n = u(e);
 			return context->GC().NewIntegerValue(n);
 		}
 		else
 		{
-			std::uniform_real_distribution<double> u(0, argv[0]->AsReal());
+			std::uniform_real_distribution<double> u(0, argv[0].AsReal());
 			return context->GC().NewRealValue(u(e));
 		}
 	}
 	else if (argc >= 2)
 	{
-		if (argv[0]->Is(VM::Value::Integer))
+		if (argv[0].Is(VM::Value::Integer))
 		{
-			std::uniform_int_distribution<int64_t> u(argv[0]->AsInteger(), argv[1]->AsInteger());
+			std::uniform_int_distribution<int64_t> u(argv[0].AsInteger(), argv[1].AsInteger());
 			return context->GC().NewIntegerValue(u(e));
 		}
 		else
 		{
-			std::uniform_real_distribution<double> u(argv[0]->AsReal(), argv[1]->AsReal());
+			std::uniform_real_distribution<double> u(argv[0].AsReal(), argv[1].AsReal());
 			return context->GC().NewRealValue(u(e));
 		}
 	}
@@ -2,15 +2,30 @@
 //
 
 #include "pch.h"
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <Windows.h>
 #include <tchar.h>
 #include "../VM/VM.h"
+#include "../VM/AOT.h"
+#include "../VM/HeapSnapshot.h"
 #include "HostCalls.hpp"
 
 static void BindHostCall(VM::Engine& engine);
+static void ConfigureGC(VM::Engine& engine);
+static void PrintGCStats(VM::Engine& engine);
+static void PrintQuickeningStats(VM::Engine& engine);
+static void PrintOpcodeNGrams(VM::Engine& engine);
+static void ConfigureHeapSnapshot(VM::Engine& engine);
+static bool WriteHeapSnapshot(VM::Engine& engine);
+static int SummarizeHeapSnapshot(const char* fileName);
+#ifdef BYTE_CODE_VM_NATIVE
+//由 AOT 翻译器生成的源文件定义
+extern const VM::NativeProgram CNPL_NATIVE_PROGRAM;
+#endif
 
 int _tmain(int argc,TCHAR* args[])
 {
@@ -18,7 +33,13 @@ int _tmain(int argc,TCHAR* args[])
 	std::fstream in;
 	std::locale::global(std::locale(""));
 	std::wcout.imbue(std::locale(""));
-#ifdef BYTE_CODE_VM_LOADER
+	//设置 CNPL_HEAP_SUMMARY 时只汇总已有的堆快照文件，不执行程序
+	auto heapSummary = getenv("CNPL_HEAP_SUMMARY");
+	if (heapSummary != nullptr)
+		return SummarizeHeapSnapshot(heapSummary);
+#ifdef BYTE_CODE_VM_NATIVE
+	//本机程序不读取字节码
+#elif defined(BYTE_CODE_VM_LOADER)
 	wchar_t moduleName[MAX_PATH] = { 0 };
 	GetModuleFileNameW(NULL, moduleName, MAX_PATH);
 #else
@@ -29,35 +50,209 @@ int _tmain(int argc,TCHAR* args[])
 	}
 	std::wstring moduleName = args[1];
 #endif
+#ifndef BYTE_CODE_VM_NATIVE
 	in.open(moduleName, std::ios::binary | std::ios::in);
-	if (in.good())
-	{
+	if (!in.good())
+		return result;
 #ifdef BYTE_CODE_VM_LOADER
-		uint64_t offset = 0;
-		in.seekg(0, std::ios::end);
-		in.seekg(-static_cast<int64_t>(sizeof(offset)), std::ios::cur);
-		in.read((char*)(&offset), sizeof(offset));
-		in.seekg(-static_cast<int64_t>(offset + sizeof(offset)), std::ios::end);
+	uint64_t offset = 0;
+	in.seekg(0, std::ios::end);
+	in.seekg(-static_cast<int64_t>(sizeof(offset)), std::ios::cur);
+	in.read((char*)(&offset), sizeof(offset));
+	in.seekg(-static_cast<int64_t>(offset + sizeof(offset)), std::ios::end);
 #endif
-		try
+#endif
+	try
+	{
+		VM::Engine engine;
+		BindHostCall(engine);
+		ConfigureGC(engine);
+#ifdef BYTE_CODE_VM_NATIVE
+		engine.LoadProgram(CNPL_NATIVE_PROGRAM);
+#else
+		engine.SetProfiling(getenv("CNPL_OPCODE_PROFILE") != nullptr);
+		engine.SetJIT(getenv("CNPL_NO_JIT") == nullptr);
+		engine.SetAllocationSites(getenv("CNPL_ALLOCATION_SITES") != nullptr);
+		engine.LoadProgram(in);
+		//设置 CNPL_AOT_OUTPUT 时只把字节码翻译为 C++ 源文件，不执行
+		auto aotOutput = getenv("CNPL_AOT_OUTPUT");
+		if (aotOutput != nullptr)
 		{
-			VM::Engine engine;
-			BindHostCall(engine);
-			engine.LoadProgram(in);
-			auto commandLineArgs = engine.GC().NewArrayValue(argc, 1);
-			for (int i = 0; i < argc; i++)
-				commandLineArgs->SetValue(i, 0, engine.GC().NewStringValue(args[i]));
-			engine.SetGlobalVariable(L"命令行参数", commandLineArgs);
-			result = engine.Run();
+			std::ofstream out(aotOutput, std::ios::binary | std::ios::out);
+			VM::AOT::Translate(engine, out);
+			in.close();
+			return out.good() ? 0 : result;
 		}
-		catch (VM::Exception& ex)
+#endif
+		auto commandLineArgs = engine.GC().NewArrayValue(argc, 1);
+		for (int i = 0; i < argc; i++)
+			commandLineArgs.SetValue(i, 0, engine.GC().NewStringValue(args[i]));
+		engine.SetGlobalVariable(L"命令行参数", commandLineArgs);
+		ConfigureHeapSnapshot(engine);
+		result = engine.Run();
+		//没有设置 CNPL_HEAP_SNAPSHOT_MB 时在程序结束后写出快照
+		if (getenv("CNPL_HEAP_SNAPSHOT") != nullptr && getenv("CNPL_HEAP_SNAPSHOT_MB") == nullptr)
+			WriteHeapSnapshot(engine);
+		if (getenv("CNPL_GC_STATS") != nullptr)
+			PrintGCStats(engine);
+		if (getenv("CNPL_QUICKENING_STATS") != nullptr)
+			PrintQuickeningStats(engine);
+		if (getenv("CNPL_OPCODE_PROFILE") != nullptr)
+			PrintOpcodeNGrams(engine);
+	}
+	catch (VM::Exception& ex)
+	{
+		std::cout << ex.what() << std::endl;
+		result = ex.ErrorCode();
+	}
+	in.close();
+	return result;
+}
+
+//GC 配置均可由环境变量覆盖，命令行参数全部交给目标程序
+static void ConfigureGC(VM::Engine& engine)
+{
+	auto config = engine.GC().GetConfig();
+	//CNPL_GC_NURSERY_KB 指定新生代大小（KB），也是两次回收之间允许分配的内存量
+	auto nursery = getenv("CNPL_GC_NURSERY_KB");
+	if (nursery != nullptr)
+		config.nurseryBytes = static_cast<size_t>(strtoul(nursery, nullptr, 10)) * 1024;
+	//CNPL_GC_GENERATION_LIMITS 指定 1~3 代触发回收的对象数，用逗号分开，例如 65536,131072,524288
+	auto limits = getenv("CNPL_GC_GENERATION_LIMITS");
+	if (limits != nullptr)
+	{
+		char* p = limits;
+		for (int g = 1; g < 4 && *p != '\0'; ++g)
 		{
-			std::cout << ex.what() << std::endl;
-			result = ex.ErrorCode();
+			config.generationLimits[g] = static_cast<size_t>(strtoul(p, &p, 10));
+			if (*p == ',')
+				++p;
 		}
-		in.close();
 	}
-	return result;
+	//CNPL_GC_MAX_HEAP_MB 指定堆占用上限（MB），回收后仍超过时程序报错退出
+	auto maxHeap = getenv("CNPL_GC_MAX_HEAP_MB");
+	if (maxHeap != nullptr)
+		config.maxHeapBytes = static_cast<size_t>(strtoul(maxHeap, nullptr, 10)) * 1024 * 1024;
+	//CNPL_GC_POLICY 为 full 时每次回收都回收全部老年代
+	auto policy = getenv("CNPL_GC_POLICY");
+	if (policy != nullptr)
+		config.policy = std::string(policy) == "full" ? VM::GCFull : VM::GCGenerational;
+	//CNPL_GC_MARK_THREADS 指定老年代回收时的标记线程数，默认为 CPU 核数
+	auto markThreads = getenv("CNPL_GC_MARK_THREADS");
+	if (markThreads != nullptr)
+		config.markThreads = static_cast<size_t>(strtoul(markThreads, nullptr, 10));
+	//CNPL_GC_SLICE_US 指定老年代增量标记每段的最长耗时（微秒），不设置时老年代回收一次完成
+	auto sliceBudget = getenv("CNPL_GC_SLICE_US");
+	if (sliceBudget != nullptr)
+		config.incrementalBudget = static_cast<size_t>(strtoul(sliceBudget, nullptr, 10));
+	//CNPL_GC_PAUSE_TARGET_US 指定自适应调节的目标停顿（微秒），为 0 时不调节；CNPL_GC_TIME_PERCENT 指定回收耗时占比的目标
+	auto pauseTarget = getenv("CNPL_GC_PAUSE_TARGET_US");
+	if (pauseTarget != nullptr)
+		config.pauseTargetMicroseconds = static_cast<size_t>(strtoul(pauseTarget, nullptr, 10));
+	auto timePercent = getenv("CNPL_GC_TIME_PERCENT");
+	if (timePercent != nullptr)
+		config.gcTimePercent = static_cast<size_t>(strtoul(timePercent, nullptr, 10));
+	engine.GC().SetConfig(config);
+}
+
+static void PrintGCStats(VM::Engine& engine)
+{
+	auto stats = engine.GC().Stats();
+	fprintf(stderr, "collections: %llu %llu %llu %llu, incremental slices: %llu\n",
+		static_cast<unsigned long long>(stats.collections[0]),
+		static_cast<unsigned long long>(stats.collections[1]),
+		static_cast<unsigned long long>(stats.collections[2]),
+		static_cast<unsigned long long>(stats.collections[3]),
+		static_cast<unsigned long long>(stats.incrementalSlices));
+	fprintf(stderr, "allocated: %llu freed: %llu heap: %zu peak: %zu nursery: %zu/%zu\n",
+		static_cast<unsigned long long>(stats.allocatedBytes),
+		static_cast<unsigned long long>(stats.freedBytes),
+		stats.heapBytes,
+		stats.peakHeapBytes,
+		stats.nurseryBytes,
+		stats.nurseryCapacity);
+	fprintf(stderr, "pauses: %llu total: %lluus max: %lluus\n",
+		static_cast<unsigned long long>(stats.pauses),
+		static_cast<unsigned long long>(stats.totalPauseMicroseconds),
+		static_cast<unsigned long long>(stats.maxPauseMicroseconds));
+	for (int g = 0; g < 4; ++g)
+		fprintf(stderr, "generation %d: %zu objects %zu bytes\n", g, stats.objects[g], stats.bytes[g]);
+	for (size_t i = 0; i < VM::GC_HISTOGRAM_BUCKETS; ++i)
+	{
+		if (stats.histogramObjects[i] == 0)
+			continue;
+		if (i + 1 < VM::GC_HISTOGRAM_BUCKETS)
+			fprintf(stderr, "%12zu: %zu objects %zu bytes\n", static_cast<size_t>(16) << i, stats.histogramObjects[i], stats.histogramBytes[i]);
+		else
+			fprintf(stderr, "%11zu+: %zu objects %zu bytes\n", static_cast<size_t>(16) << (i - 1), stats.histogramObjects[i], stats.histogramBytes[i]);
+	}
+}
+
+//CNPL_HEAP_SNAPSHOT_MB 为堆占用达到多少 MB 时在运行中途写出快照
+static void ConfigureHeapSnapshot(VM::Engine& engine)
+{
+	if (getenv("CNPL_HEAP_SNAPSHOT") == nullptr)
+		return;
+	auto threshold = getenv("CNPL_HEAP_SNAPSHOT_MB");
+	if (threshold != nullptr)
+		engine.GC().SetHeapWatch(static_cast<size_t>(strtoull(threshold, nullptr, 10)) * 1024 * 1024, [](VM::Engine* context) { WriteHeapSnapshot(*context); });
+}
+
+static bool WriteHeapSnapshot(VM::Engine& engine)
+{
+	auto fileName = getenv("CNPL_HEAP_SNAPSHOT");
+	std::ofstream out(fileName, std::ios::binary | std::ios::out);
+	VM::HeapSnapshot::Write(engine, out);
+	if (!out.good())
+	{
+		fprintf(stderr, "can not write heap snapshot: %s\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+static int SummarizeHeapSnapshot(const char* fileName)
+{
+	std::ifstream in(fileName, std::ios::binary | std::ios::in);
+	if (!in.good())
+	{
+		std::cout << "can not open heap snapshot." << std::endl;
+		return 32;
+	}
+	try
+	{
+		VM::HeapSnapshot::Summarize(in, std::cout);
+	}
+	catch (VM::Exception& ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return ex.ErrorCode();
+	}
+	return 0;
+}
+
+static void PrintQuickeningStats(VM::Engine& engine)
+{
+	for (auto& site : engine.GetQuickeningStats())
+	{
+		fprintf(stderr, "%8zu %-10s -> %-10s quickened:%u deoptimized:%u\n",
+			site.index,
+			VM::GetInstructionName(site.generic),
+			VM::GetInstructionName(site.current),
+			site.quickened,
+			site.deoptimized);
+	}
+}
+
+static void PrintOpcodeNGrams(VM::Engine& engine)
+{
+	for (auto& gram : engine.GetOpcodeNGrams())
+	{
+		fprintf(stderr, "%12llu ", static_cast<unsigned long long>(gram.count));
+		for (size_t i = 0; i < gram.length; ++i)
+			fprintf(stderr, " %s", VM::GetInstructionName(gram.ops[i]));
+		fprintf(stderr, "\n");
+	}
 }
 
 static void BindHostCall(VM::Engine& engine)
@@ -77,8 +272,9 @@ static void BindHostCall(VM::Engine& engine)
 	engine.AppendHostCall(&SetConsoleForegroundColor);
 	engine.AppendHostCall(&XSetConsoleCursorPosition);
 	engine.AppendHostCall(&ReadInputKey);
-	engine.AppendHostCall(&ReadGVar);
-	engine.AppendHostCall(&WriteGVar);
+	auto readGVar = engine.AppendHostCall(&ReadGVar);
+	auto writeGVar = engine.AppendHostCall(&WriteGVar);
+	engine.SetGlobalVariableHostCalls(readGVar, writeGVar);
 	engine.AppendHostCall(&ReadTimeMS);
 	engine.AppendHostCall(&GetNewLine);
 }
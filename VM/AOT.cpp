@@ -0,0 +1,466 @@
+#include "AOT.h"
+#include <set>
+#include <cmath>
+#include <cstdio>
+#include <cinttypes>
+
+namespace VM
+{
+	namespace
+	{
+		void Write7BitInt(std::string& out, uint64_t value)
+		{
+			do
+			{
+				uint8_t ch = static_cast<uint8_t>(value & 0x7F);
+				value >>= 7;
+				if (value != 0)
+					ch |= 0x80;
+				out.push_back(static_cast<char>(ch));
+			} while (value != 0);
+		}
+
+		//按字节码文件的常量格式写出，本机程序加载时仍由 Engine::ReadValue 解析
+		void WriteValue(std::string& out, const Value& value)
+		{
+			out.push_back(static_cast<char>(value.GetType()));
+			out.push_back(0);
+			switch (value.GetType())
+			{
+			case Value::Integer:
+				Write7BitInt(out, static_cast<uint64_t>(value.AsInteger()));
+				break;
+			case Value::Real:
+			{
+				double d = value.AsReal();
+				out.append(reinterpret_cast<const char*>(&d), sizeof(d));
+			}
+			break;
+			case Value::String:
+			{
+				std::string utf8;
+				value.AsUTF8(utf8);
+				Write7BitInt(out, utf8.size());
+				out.append(utf8);
+			}
+			break;
+			case Value::Boolean:
+				out.push_back(0);
+				out.push_back(value.AsBoolean() ? static_cast<char>(0xFF) : 0);
+				break;
+			case Value::Array:
+			{
+				Write7BitInt(out, value.GetRow());
+				Write7BitInt(out, value.GetCol());
+				for (size_t r = 0; r < value.GetRow(); ++r)
+				{
+					for (size_t c = 0; c < value.GetCol(); ++c)
+						WriteValue(out, value.GetValue(r, c));
+				}
+			}
+			break;
+			default:
+				throw Exception(10002, "Data type is not supported.");
+			}
+		}
+
+		//整数、实数、逻辑常量写成字面量，C++ 编译器可据此省去类型判断；其余常量仍从常量表读取
+		std::string ConstantExpression(const std::vector<Value>& constants, size_t index)
+		{
+			if (index >= constants.size())
+				throw Exception(10004, "Constant index out of bounds.");
+			auto& value = constants[index];
+			char buffer[64];
+			switch (value.GetType())
+			{
+			case Value::Integer:
+			{
+				auto v = value.AsInteger();
+				if (v == INT64_MIN)
+					return "AOT::Integer(INT64_MIN)";
+				snprintf(buffer, sizeof(buffer), "AOT::Integer(INT64_C(%" PRId64 "))", v);
+				return buffer;
+			}
+			case Value::Real:
+			{
+				auto v = value.AsReal();
+				if (!std::isfinite(v))
+					break;
+				snprintf(buffer, sizeof(buffer), "%.17g", v);
+				std::string s = buffer;
+				//保证字面量为 double 类型
+				if (s.find_first_of(".e") == std::string::npos)
+					s.append(".0");
+				return "AOT::Real(" + s + ")";
+			}
+			case Value::Boolean:
+				return value.AsBoolean() ? "AOT::Boolean(true)" : "AOT::Boolean(false)";
+			default:
+				break;
+			}
+			return "AOT::Constant(e, " + std::to_string(index) + ")";
+		}
+
+		//把一个字节码函数翻译成 C++ 函数。
+		//  每个基本块内模拟计算栈：变量、常量只记录为表达式，运算结果保存在 C++ 局部变量中，
+		//  只有遇到跳转目标、未建模的指令或可能触发 GC 的运算时才真正压入 Engine 的计算栈。
+		//  局部变量不是 GC 根，因此可能触发 GC 的运算前先把栈中其它计算结果压入计算栈，运算本身的操作数由慢速路径负责压栈。
+		class FunctionWriter
+		{
+		public:
+			FunctionWriter(std::ostream& out, const std::vector<InstructionID>& opcodes, const std::vector<size_t>& tags, const std::vector<Value>& constants) :
+				mOut(out),
+				mOpcodes(opcodes),
+				mTags(tags),
+				mConstants(constants),
+				mCount(opcodes.size()),
+				mBlockOpen(false),
+				mTemporaries(0)
+			{
+			}
+		public:
+			void Write(size_t entry)
+			{
+				Collect(entry);
+				mOut << "\n\tvoid F" << entry << "(Engine* e)\n\t{\n";
+				mBlockOpen = false;
+				mTemporaries = 0;
+				mStack.clear();
+				size_t i = 0;
+				while (i < mCount)
+				{
+					if (!mBody[i])
+					{
+						++i;
+						continue;
+					}
+					if (mLabels[i])
+					{
+						Flush(0);
+						CloseBlock();
+						mOut << "\tL" << i << ":\n";
+					}
+					i += Translate(i);
+				}
+				Flush(0);
+				CloseBlock();
+				//执行到程序末尾：入口函数直接返回，其它函数与解释器一样结束整个程序
+				auto fallsOff = mCount == 0 || (mBody[mCount - 1] && mOpcodes[mCount - 1] != InstructionID::JMP && mOpcodes[mCount - 1] != InstructionID::RET);
+				if (mHaltLabel)
+					mOut << "\tHALT:\n";
+				if (mHaltLabel || fallsOff)
+					mOut << (entry == 0 ? "\t\treturn;\n" : "\t\tAOT::Halt();\n");
+				mOut << "\t}\n";
+			}
+		private:
+			static const size_t NO_SLOT = static_cast<size_t>(-1);
+			typedef struct
+			{
+				std::string expr;
+				size_t slot;		//LD 得到的表达式对应的变量，变量被改写前须先求值
+				bool computed;		//运算结果，可能引用堆对象
+			}Operand;
+		private:
+			//沿跳转与顺序执行收集函数体，CALL 不跟随；按地址顺序输出，顺序执行的下一条总是紧跟在后面
+			void Collect(size_t entry)
+			{
+				mBody.assign(mCount, false);
+				mLabels.assign(mCount, false);
+				mHaltLabel = false;
+				std::vector<size_t> pending = { entry };
+				while (!pending.empty())
+				{
+					auto i = pending.back();
+					pending.pop_back();
+					if (i >= mCount || mBody[i])
+						continue;
+					mBody[i] = true;
+					auto op = mOpcodes[i];
+					if (op == InstructionID::JMP || op == InstructionID::JMPC || op == InstructionID::JMPN)
+					{
+						if (mTags[i] < mCount)
+						{
+							mLabels[mTags[i]] = true;
+							pending.push_back(mTags[i]);
+						}
+						else
+						{
+							mHaltLabel = true;
+						}
+					}
+					if (op != InstructionID::JMP && op != InstructionID::RET)
+						pending.push_back(i + 1);
+				}
+			}
+
+			//翻译第 i 条指令，返回实际处理的条数（比较后紧跟条件跳转时合并为一条 if）
+			size_t Translate(size_t i)
+			{
+				auto tag = mTags[i];
+				switch (mOpcodes[i])
+				{
+				case InstructionID::NOOP:
+					return 1;
+				case InstructionID::LD:
+					mStack.push_back({ "AOT::Local(e, " + std::to_string(tag) + ")", tag, false });
+					return 1;
+				case InstructionID::LC:
+					mStack.push_back({ ConstantExpression(mConstants, tag), NO_SLOT, false });
+					return 1;
+				case InstructionID::PUSH:
+					mStack.push_back({ "AOT::Boolean(false)", NO_SLOT, false });
+					return 1;
+				case InstructionID::POP:
+					if (mStack.empty())
+						Statement("AOT::POP(e);");
+					else
+						mStack.pop_back();
+					return 1;
+				case InstructionID::SD:
+				{
+					if (mStack.empty())
+					{
+						Statement("AOT::SD(e, " + std::to_string(tag) + ");");
+						return 1;
+					}
+					auto v = Pop();
+					for (auto& o : mStack)
+					{
+						if (o.slot == tag)
+							o = Temporary(o.expr);
+					}
+					Statement("AOT::Store(e, " + std::to_string(tag) + ", " + v.expr + ");");
+					return 1;
+				}
+				case InstructionID::ADD:
+				case InstructionID::SUB:
+				case InstructionID::MUL:
+				case InstructionID::DIV:
+				case InstructionID::LT:
+				case InstructionID::GT:
+				case InstructionID::EQ:
+				case InstructionID::NE:
+				{
+					auto name = GetInstructionName(mOpcodes[i]);
+					if (mStack.size() < 2)
+					{
+						Flush(0);
+						Statement(std::string("AOT::") + name + "(e);");
+						return 1;
+					}
+					//GC 安全点中只有 ADD/SUB 可能出现在这里（字符串拼接）
+					if (mOpcodes[i] == InstructionID::ADD || mOpcodes[i] == InstructionID::SUB)
+						Protect(2);
+					auto b = Pop();
+					auto a = Pop();
+					auto expr = std::string("AOT::") + name + "(e, " + a.expr + ", " + b.expr + ")";
+					auto op = mOpcodes[i];
+					if (op == InstructionID::ADD || op == InstructionID::SUB || op == InstructionID::MUL || op == InstructionID::DIV)
+					{
+						mStack.push_back(Temporary(expr));
+						return 1;
+					}
+					if (i + 1 < mCount && !mLabels[i + 1] && (mOpcodes[i + 1] == InstructionID::JMPN || mOpcodes[i + 1] == InstructionID::JMPC))
+					{
+						Flush(0);
+						Statement(std::string("if (") + (mOpcodes[i + 1] == InstructionID::JMPN ? "!" : "") + expr + ") goto " + Target(i + 1) + ";");
+						return 2;
+					}
+					mStack.push_back(Temporary("AOT::Boolean(" + expr + ")"));
+					return 1;
+				}
+				case InstructionID::ARRAYREAD:
+				{
+					if (mStack.size() < 2)
+					{
+						Flush(0);
+						Statement("AOT::ARRAYREAD(e, " + std::to_string(tag) + ");");
+						return 1;
+					}
+					auto c = Pop();
+					auto r = Pop();
+					mStack.push_back(Temporary("AOT::ARRAYREAD(e, " + std::to_string(tag) + ", " + r.expr + ", " + c.expr + ")"));
+					return 1;
+				}
+				case InstructionID::ARRAYWRITE:
+				{
+					if (mStack.size() < 3)
+					{
+						Flush(0);
+						Statement("AOT::ARRAYWRITE(e, " + std::to_string(tag) + ");");
+						return 1;
+					}
+					auto v = Pop();
+					auto c = Pop();
+					auto r = Pop();
+					Statement("AOT::ARRAYWRITE(e, " + std::to_string(tag) + ", " + r.expr + ", " + c.expr + ", " + v.expr + ");");
+					return 1;
+				}
+				case InstructionID::JMPC:
+				case InstructionID::JMPN:
+				{
+					auto negate = mOpcodes[i] == InstructionID::JMPN ? "!" : "";
+					if (mStack.empty())
+					{
+						Statement(std::string("if (") + negate + "AOT::Test(e)) goto " + Target(i) + ";");
+						return 1;
+					}
+					auto v = Pop();
+					Flush(0);
+					Statement(std::string("if (") + negate + "AOT::Test(" + v.expr + ")) goto " + Target(i) + ";");
+					return 1;
+				}
+				default:
+					break;
+				}
+
+				//其余指令直接操作计算栈，先把模拟的栈内容全部压入
+				Flush(0);
+				switch (mOpcodes[i])
+				{
+				case InstructionID::AND: Statement("AOT::AND(e);"); break;
+				case InstructionID::ALLOCDSTK: Statement("AOT::ALLOCDSTK(e, " + std::to_string(tag) + ");"); break;
+				case InstructionID::ARRAYMAKE: Statement("AOT::ARRAYMAKE(e);"); break;
+				case InstructionID::CALL:
+					if (tag < mCount)
+						Statement("AOT::Call(e, &F" + std::to_string(tag) + ");");
+					else
+						Statement("AOT::Halt();");
+					break;
+				case InstructionID::CALLSYS: Statement("AOT::CALLSYS(e, " + std::to_string(tag) + ");"); break;
+				case InstructionID::JMP: Statement("goto " + Target(i) + ";"); break;
+				case InstructionID::MOD: Statement("AOT::MOD(e);"); break;
+				case InstructionID::NOT: Statement("AOT::NOT(e);"); break;
+				case InstructionID::OR: Statement("AOT::OR(e);"); break;
+				case InstructionID::RET:
+					Statement("AOT::Return(e);");
+					Statement("return;");
+					break;
+				default:
+					throw Exception(10003, "Unrecognized instruction.");
+				}
+				return 1;
+			}
+
+			std::string Target(size_t i) const
+			{
+				return mTags[i] < mCount ? "L" + std::to_string(mTags[i]) : std::string("HALT");
+			}
+			Operand Pop(void)
+			{
+				auto r = mStack.back();
+				mStack.pop_back();
+				return r;
+			}
+			Operand Temporary(const std::string& expr)
+			{
+				auto name = "t" + std::to_string(mTemporaries++);
+				Statement("const Value " + name + " = " + expr + ";");
+				return{ name, NO_SLOT, true };
+			}
+			//压入计算栈，只保留栈顶 keep 项
+			void Flush(size_t keep)
+			{
+				if (mStack.size() <= keep)
+					return;
+				auto n = mStack.size() - keep;
+				for (size_t k = 0; k < n; ++k)
+					Statement("AOT::Push(e, " + mStack[k].expr + ");");
+				mStack.erase(mStack.begin(), mStack.begin() + n);
+			}
+			//即将消耗栈顶 count 项且可能触发 GC：其下的计算结果须先压入计算栈
+			void Protect(size_t count)
+			{
+				for (size_t k = 0; k + count < mStack.size(); ++k)
+				{
+					if (mStack[k].computed)
+					{
+						Flush(count);
+						return;
+					}
+				}
+			}
+			//基本块包在花括号内，goto 不会跳过局部变量的初始化
+			void Statement(const std::string& s)
+			{
+				if (!mBlockOpen)
+				{
+					mOut << "\t\t{\n";
+					mBlockOpen = true;
+				}
+				mOut << "\t\t\t" << s << "\n";
+			}
+			void CloseBlock(void)
+			{
+				if (mBlockOpen)
+					mOut << "\t\t}\n";
+				mBlockOpen = false;
+			}
+		private:
+			std::ostream& mOut;
+			const std::vector<InstructionID>& mOpcodes;
+			const std::vector<size_t>& mTags;
+			const std::vector<Value>& mConstants;
+			size_t mCount;
+			std::vector<bool> mBody;
+			std::vector<bool> mLabels;
+			bool mHaltLabel;
+			std::vector<Operand> mStack;
+			bool mBlockOpen;
+			size_t mTemporaries;
+		};
+	}
+
+	void AOT::Translate(const Engine& engine, std::ostream& out)
+	{
+		auto count = engine.mInstructionCount;
+		std::vector<InstructionID> opcodes(engine.mOpcodes.begin(), engine.mOpcodes.begin() + count);
+		std::vector<size_t> tags(count);
+		for (size_t i = 0; i < count; ++i)
+			tags[i] = engine.mInstructions[i].tag;
+
+		//函数入口：程序入口 0 与所有 CALL 目标
+		std::set<size_t> functions = { 0 };
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (opcodes[i] == InstructionID::CALL && tags[i] < count)
+				functions.insert(tags[i]);
+		}
+
+		std::string constants;
+		for (auto& v : engine.mConstants)
+			WriteValue(constants, v);
+
+		out << "//由 cnpl AOT 翻译器根据字节码生成，请勿手工修改\n";
+		//与加载器的引用方式相同，生成的源文件放在加载器目录下即可编译，无需额外的头文件搜索路径
+		out << "#include \"../VM/AOT.h\"\n\n";
+		out << "namespace\n{\n";
+		out << "\tusing VM::AOT;\n";
+		out << "\tusing VM::Engine;\n";
+		out << "\tusing VM::Value;\n\n";
+		out << "\tconst uint8_t CONSTANTS[] =\n\t{";
+		for (size_t i = 0; i < constants.size(); ++i)
+		{
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "0x%02X,", static_cast<uint8_t>(constants[i]));
+			out << ((i % 16) == 0 ? "\n\t\t" : " ") << buffer;
+		}
+		if (constants.empty())
+			out << "\n\t\t0x00";
+		out << "\n\t};\n\n";
+		for (auto f : functions)
+			out << "\tvoid F" << f << "(Engine* e);\n";
+
+		FunctionWriter writer(out, opcodes, tags, engine.mConstants);
+		for (auto f : functions)
+			writer.Write(f);
+
+		out << "}\n\n";
+		out << "extern const VM::NativeProgram CNPL_NATIVE_PROGRAM =\n{\n";
+		out << "\tCONSTANTS,\n";
+		out << "\t" << constants.size() << ",\n";
+		out << "\t" << engine.mConstants.size() << ",\n";
+		out << "\t&F0\n";
+		out << "};\n";
+	}
+}
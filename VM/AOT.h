@@ -0,0 +1,383 @@
+#pragma once
+#include "VM.h"
+
+namespace VM
+{
+	//AOT 翻译器（字节码 -> C++）及翻译结果使用的运行时
+	//  Translate 把已加载程序中的每个函数（入口 0 与所有 CALL 目标）翻译成一个 C++ 函数，跳转翻译为 goto，
+	//  CALL 翻译为直接调用，整数/实数/逻辑常量直接写成字面量。
+	//  计算栈、数据栈仍使用 Engine 的存储，宿主函数、GC 与解释器看到的运行时状态完全相同。
+	//  生成的源文件放在加载器目录下（以 "../VM/AOT.h" 引用本文件），与 VM 目录下的源文件以及定义了 BYTE_CODE_VM_NATIVE 的加载器
+	//  一同编译，即得到不含字节码的本机程序，步骤见 README.md。
+	class AOT
+	{
+	public:
+		//engine 须已通过 LoadProgram 加载字节码
+		static void Translate(const Engine& engine, std::ostream& out);
+	public:
+		//本机程序执行到程序末尾（对应解释器的 HALT）时抛出，由 Engine::Run 捕获
+		struct HaltSignal
+		{
+		};
+	public:
+		//以下供生成的代码调用，快速路径内联，其余情况转到 Engine 的通用实现
+		static void Push(Engine* e, const Value& value)
+		{
+			if (e->mCALCTop == e->mCALCLimit)
+				e->CALCStackGrow();
+			*e->mCALCTop++ = value;
+		}
+		static Value Integer(int64_t value)
+		{
+			Value r;
+			r.mType = Value::Integer;
+			r.mValue.iValue = value;
+			return r;
+		}
+		static Value Real(double value)
+		{
+			Value r;
+			r.mType = Value::Real;
+			r.mValue.dValue = value;
+			return r;
+		}
+		static Value Boolean(bool value)
+		{
+			Value r;
+			r.mValue.bValue = value;
+			return r;
+		}
+		static const Value& Constant(Engine* e, size_t index)
+		{
+			return e->mConstants[index];
+		}
+		static const Value& Local(Engine* e, size_t index)
+		{
+			return e->mDATAStack[e->mDATABase + index];
+		}
+		static void Store(Engine* e, size_t index, const Value& value)
+		{
+			e->mDATAStack[e->mDATABase + index] = value;
+		}
+		static void SD(Engine* e, size_t index)
+		{
+			Store(e, index, *--e->mCALCTop);
+		}
+		static void POP(Engine* e)
+		{
+			--e->mCALCTop;
+		}
+		static void ALLOCDSTK(Engine* e, size_t size)
+		{
+			e->DATAStackAlloc(size);
+		}
+		static void ADD(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				a.mValue.iValue += b.mValue.iValue;
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				a.mValue.dValue += b.mValue.dValue;
+			else
+				return e->InstructionADD(0);
+			--e->mCALCTop;
+		}
+		static void SUB(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				a.mValue.iValue -= b.mValue.iValue;
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				a.mValue.dValue -= b.mValue.dValue;
+			else
+				return e->InstructionSUB(0);
+			--e->mCALCTop;
+		}
+		static void MUL(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				a.mValue.iValue *= b.mValue.iValue;
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				a.mValue.dValue *= b.mValue.dValue;
+			else
+				return e->InstructionMUL(0);
+			--e->mCALCTop;
+		}
+		static void DIV(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				a.mValue.dValue /= b.mValue.dValue;
+			else
+				return e->InstructionDIV(0);
+			--e->mCALCTop;
+		}
+		//操作数直接来自变量或常量的运算：结果写入变量或直接用于跳转，不经过计算栈
+		static Value ADD(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return Integer(a.mValue.iValue + b.mValue.iValue);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return Real(a.mValue.dValue + b.mValue.dValue);
+			return Binary(e, &Engine::InstructionADD, a, b);
+		}
+		static Value SUB(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return Integer(a.mValue.iValue - b.mValue.iValue);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return Real(a.mValue.dValue - b.mValue.dValue);
+			return Binary(e, &Engine::InstructionSUB, a, b);
+		}
+		static Value MUL(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return Integer(a.mValue.iValue * b.mValue.iValue);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return Real(a.mValue.dValue * b.mValue.dValue);
+			return Binary(e, &Engine::InstructionMUL, a, b);
+		}
+		static Value DIV(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return Real(a.mValue.dValue / b.mValue.dValue);
+			return Binary(e, &Engine::InstructionDIV, a, b);
+		}
+		//整数的大小比较与解释器、JIT 一致，按实数比较（超过 2^53 时结果与按整数比较不同）
+		static bool LT(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return static_cast<double>(a.mValue.iValue) < static_cast<double>(b.mValue.iValue);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return a.mValue.dValue < b.mValue.dValue;
+			return Compare(e, &Engine::InstructionLT, a, b);
+		}
+		static bool GT(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return static_cast<double>(a.mValue.iValue) > static_cast<double>(b.mValue.iValue);
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return a.mValue.dValue > b.mValue.dValue;
+			return Compare(e, &Engine::InstructionGT, a, b);
+		}
+		static bool EQ(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return a.mValue.iValue == b.mValue.iValue;
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return a.mValue.dValue == b.mValue.dValue;
+			return Compare(e, &Engine::InstructionEQ, a, b);
+		}
+		static bool NE(Engine* e, const Value& a, const Value& b)
+		{
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				return a.mValue.iValue != b.mValue.iValue;
+			if (a.Is(Value::Real) && b.Is(Value::Real))
+				return a.mValue.dValue != b.mValue.dValue;
+			return Compare(e, &Engine::InstructionNE, a, b);
+		}
+		static void MOD(Engine* e)
+		{
+			e->InstructionMOD(0);
+		}
+		static void LT(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				SetBoolean(a, static_cast<double>(a.mValue.iValue) < static_cast<double>(b.mValue.iValue));
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				SetBoolean(a, a.mValue.dValue < b.mValue.dValue);
+			else
+				return e->InstructionLT(0);
+			--e->mCALCTop;
+		}
+		static void GT(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				SetBoolean(a, static_cast<double>(a.mValue.iValue) > static_cast<double>(b.mValue.iValue));
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				SetBoolean(a, a.mValue.dValue > b.mValue.dValue);
+			else
+				return e->InstructionGT(0);
+			--e->mCALCTop;
+		}
+		static void EQ(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				SetBoolean(a, a.mValue.iValue == b.mValue.iValue);
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				SetBoolean(a, a.mValue.dValue == b.mValue.dValue);
+			else
+				return e->InstructionEQ(0);
+			--e->mCALCTop;
+		}
+		static void NE(Engine* e)
+		{
+			auto& b = e->mCALCTop[-1];
+			auto& a = *(&b - 1);
+			if (a.Is(Value::Integer) && b.Is(Value::Integer))
+				SetBoolean(a, a.mValue.iValue != b.mValue.iValue);
+			else if (a.Is(Value::Real) && b.Is(Value::Real))
+				SetBoolean(a, a.mValue.dValue != b.mValue.dValue);
+			else
+				return e->InstructionNE(0);
+			--e->mCALCTop;
+		}
+		static void AND(Engine* e)
+		{
+			e->InstructionAND(0);
+		}
+		static void OR(Engine* e)
+		{
+			e->InstructionOR(0);
+		}
+		static void NOT(Engine* e)
+		{
+			e->InstructionNOT(0);
+		}
+		//JMPC/JMPN 的条件
+		static bool Test(Engine* e)
+		{
+			auto& a = *--e->mCALCTop;
+			if (a.Is(Value::Boolean))
+				return a.mValue.bValue;
+			return a.AsBoolean();
+		}
+		static bool Test(const Value& a)
+		{
+			if (a.Is(Value::Boolean))
+				return a.mValue.bValue;
+			return a.AsBoolean();
+		}
+		static void ARRAYMAKE(Engine* e)
+		{
+			e->InstructionARRAYMAKE(0);
+		}
+		static void ARRAYREAD(Engine* e, size_t index)
+		{
+			auto& d = e->mDATAStack[e->mDATABase + index];
+			auto& c = e->mCALCTop[-1];
+			auto& r = *(&c - 1);
+			if (d.Is(Value::Array) && r.Is(Value::Integer) && c.Is(Value::Integer))
+			{
+				auto& a = d.mValue.hValue->mValue.aValue;
+				auto ri = static_cast<size_t>(r.mValue.iValue);
+				auto ci = static_cast<size_t>(c.mValue.iValue);
+				if (ri < a.row && ci < a.col)
+				{
+					r = Value::Element(a.data[ri * a.col + ci]);
+					--e->mCALCTop;
+					return;
+				}
+			}
+			e->InstructionARRAYREAD(index);
+		}
+		static Value ARRAYREAD(Engine* e, size_t index, const Value& r, const Value& c)
+		{
+			auto& d = e->mDATAStack[e->mDATABase + index];
+			if (d.Is(Value::Array) && r.Is(Value::Integer) && c.Is(Value::Integer))
+			{
+				auto& a = d.mValue.hValue->mValue.aValue;
+				auto ri = static_cast<size_t>(r.mValue.iValue);
+				auto ci = static_cast<size_t>(c.mValue.iValue);
+				if (ri < a.row && ci < a.col)
+					return Value::Element(a.data[ri * a.col + ci]);
+			}
+			Push(e, r);
+			Push(e, c);
+			e->InstructionARRAYREAD(index);
+			return *--e->mCALCTop;
+		}
+		static void ARRAYWRITE(Engine* e, size_t index)
+		{
+			auto& d = e->mDATAStack[e->mDATABase + index];
+			auto& v = e->mCALCTop[-1];
+			auto& c = *(&v - 1);
+			auto& r = *(&v - 2);
+			//老代阵列写入堆对象时需要写屏障，交给通用实现
+			if (d.Is(Value::Array) && r.Is(Value::Integer) && c.Is(Value::Integer) && (d.mValue.hValue->mGeneration == 0 || !v.IsHeapValue()))
+			{
+				auto& a = d.mValue.hValue->mValue.aValue;
+				auto ri = static_cast<size_t>(r.mValue.iValue);
+				auto ci = static_cast<size_t>(c.mValue.iValue);
+				if (ri < a.row && ci < a.col)
+				{
+					a.data[ri * a.col + ci] = v;
+					e->mCALCTop -= 3;
+					return;
+				}
+			}
+			e->InstructionARRAYWRITE(index);
+		}
+		static void ARRAYWRITE(Engine* e, size_t index, const Value& r, const Value& c, const Value& v)
+		{
+			auto& d = e->mDATAStack[e->mDATABase + index];
+			if (d.Is(Value::Array) && r.Is(Value::Integer) && c.Is(Value::Integer) && (d.mValue.hValue->mGeneration == 0 || !v.IsHeapValue()))
+			{
+				auto& a = d.mValue.hValue->mValue.aValue;
+				auto ri = static_cast<size_t>(r.mValue.iValue);
+				auto ci = static_cast<size_t>(c.mValue.iValue);
+				if (ri < a.row && ci < a.col)
+				{
+					a.data[ri * a.col + ci] = v;
+					return;
+				}
+			}
+			Push(e, r);
+			Push(e, c);
+			Push(e, v);
+			e->InstructionARRAYWRITE(index);
+		}
+		static void CALLSYS(Engine* e, size_t tag)
+		{
+			e->InstructionCALLSYS(tag);
+		}
+		//数据栈帧由被调函数的 ALLOCDSTK 建立，返回后恢复调用者的栈帧
+		static void Call(Engine* e, PFN_NATIVE_FUNCTION function)
+		{
+			auto base = e->mDATABase;
+			function(e);
+			e->mDATABase = base;
+			if (base < e->mDATAWatermark)
+				e->mDATAWatermark = base;
+		}
+		static void Return(Engine* e)
+		{
+			e->mDATAStack.resize(e->mDATABase);
+		}
+		[[noreturn]] static void Halt(void)
+		{
+			throw HaltSignal();
+		}
+	private:
+		static void SetBoolean(Value& value, bool b)
+		{
+			value = Boolean(b);
+		}
+		//类型不符时把操作数压入计算栈，交给通用实现；结果在 GC 检查时仍在计算栈上
+		static Value Binary(Engine* e, void (Engine::*op)(size_t), const Value& a, const Value& b)
+		{
+			Push(e, a);
+			Push(e, b);
+			(e->*op)(0);
+			return *--e->mCALCTop;
+		}
+		static bool Compare(Engine* e, void (Engine::*op)(size_t), const Value& a, const Value& b)
+		{
+			Push(e, a);
+			Push(e, b);
+			(e->*op)(0);
+			return Test(e);
+		}
+	};
+}
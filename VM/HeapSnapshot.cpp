@@ -0,0 +1,389 @@
+#include "HeapSnapshot.h"
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <algorithm>
+
+namespace VM
+{
+	namespace
+	{
+		const char SNAPSHOT_MAGIC[8] = { 'C', 'N', 'P', 'L', 'H', 'E', 'A', 'P' };
+		const uint32_t SNAPSHOT_VERSION = 1;
+
+		template<typename T>
+		void WriteNumber(std::ostream& out, T value)
+		{
+			out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		template<typename T>
+		T ReadNumber(std::istream& in)
+		{
+			T value;
+			if (!in.read(reinterpret_cast<char*>(&value), sizeof(value)))
+				throw Exception(10001, "File is not in the correct format.");
+			return value;
+		}
+
+		//个数来自文件，先确认剩余内容足够，避免损坏的文件导致巨大的分配
+		size_t ReadCount(std::istream& in, size_t itemSize)
+		{
+			auto count = ReadNumber<uint64_t>(in);
+			auto position = in.tellg();
+			in.seekg(0, std::ios::end);
+			auto end = in.tellg();
+			in.seekg(position);
+			if (position < 0 || end < position || count > static_cast<uint64_t>(end - position) / itemSize)
+				throw Exception(10001, "File is not in the correct format.");
+			return static_cast<size_t>(count);
+		}
+
+		struct SnapshotObject
+		{
+			uint8_t type;
+			uint8_t gen;
+			uint32_t site;
+			uint64_t size;
+			uint64_t a;
+			uint64_t b;
+		};
+
+		struct SnapshotRoot
+		{
+			uint8_t kind;
+			uint32_t obj;
+			uint32_t index;
+			std::string name;
+		};
+
+		const char* TypeName(uint8_t type)
+		{
+			switch (type)
+			{
+			case Value::String:
+				return "string";
+			case Value::Array:
+				return "array";
+			default:
+				return "unknown";
+			}
+		}
+
+		const char* RootName(uint8_t kind)
+		{
+			switch (kind)
+			{
+			case HeapSnapshot::RootCalcStack:
+				return "calc-stack";
+			case HeapSnapshot::RootDataStack:
+				return "data-stack";
+			case HeapSnapshot::RootCallParameter:
+				return "call-parameter";
+			case HeapSnapshot::RootGlobal:
+				return "global";
+			case HeapSnapshot::RootConstant:
+				return "constant";
+			default:
+				return "unknown";
+			}
+		}
+
+		std::string SiteName(uint32_t site, const std::unordered_map<uint32_t, uint16_t>& opcodes)
+		{
+			if (site == MemoryGC::UNKNOWN_SITE)
+				return "@?";
+			auto it = opcodes.find(site);
+			return "@" + std::to_string(site) + " " + (it != opcodes.end() ? GetInstructionName(static_cast<InstructionID>(it->second)) : "UNKNOWN");
+		}
+
+		std::string RootDescription(const SnapshotRoot& root)
+		{
+			std::string s = RootName(root.kind);
+			if (root.kind == HeapSnapshot::RootGlobal)
+				s += " " + root.name;
+			else
+				s += "[" + std::to_string(root.index) + "]";
+			return s;
+		}
+	}
+
+	void HeapSnapshot::Write(const Engine& engine, std::ostream& out)
+	{
+		const auto& gc = engine.mGC;
+		std::unordered_map<const HeapValue*, uint32_t> nurserySites(gc.mNurserySites.begin(), gc.mNurserySites.end());
+		std::unordered_map<const HeapValue*, uint32_t> ids;
+		std::vector<const HeapValue*> objects;
+		std::vector<SnapshotRoot> roots;
+		std::vector<std::pair<uint32_t, uint32_t>> edges;
+
+		auto visit = [&](const Value& v) -> uint32_t
+		{
+			auto h = v.mValue.hValue;
+			auto it = ids.find(h);
+			if (it != ids.end())
+				return it->second;
+			auto id = static_cast<uint32_t>(objects.size());
+			ids.emplace(h, id);
+			objects.push_back(h);
+			return id;
+		};
+		auto root = [&](uint8_t kind, const Value& v, size_t index, const std::string& name)
+		{
+			if (v.IsHeapValue())
+				roots.push_back({ kind, visit(v), static_cast<uint32_t>(index), name });
+		};
+
+		for (auto v = engine.mCALCStack.data(); v != engine.mCALCTop; ++v)
+		{
+			root(RootCalcStack, *v, v - engine.mCALCStack.data(), std::string());
+		}
+		for (size_t i = 0; i < engine.mDATAStack.size(); ++i)
+		{
+			root(RootDataStack, engine.mDATAStack[i], i, std::string());
+		}
+		for (size_t i = 0; i < engine.mCallParameters.size(); ++i)
+		{
+			root(RootCallParameter, engine.mCallParameters[i], i, std::string());
+		}
+		for (auto& v : engine.mGlobalVariableTable)
+		{
+			Value name;
+			name.mType = Value::String;
+			name.mValue.hValue = const_cast<HeapValue*>(v.first);
+			std::string utf8;
+			name.AsUTF8(utf8);
+			root(RootGlobal, engine.mGlobalVariables[v.second].value, static_cast<uint32_t>(v.second), utf8);
+		}
+		for (size_t i = 0; i < engine.mConstants.size(); ++i)
+		{
+			root(RootConstant, engine.mConstants[i], i, std::string());
+		}
+
+		//按序号遍历，新发现的对象追加在末尾
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			auto h = objects[i];
+			if (!h->GCHasChildren())
+				continue;
+			auto children = const_cast<HeapValue*>(h);
+			for (auto d = children->GCChildrenBegin(), e = children->GCChildrenEnd(); d < e; ++d)
+			{
+				if (d->IsHeapValue())
+					edges.emplace_back(static_cast<uint32_t>(i), visit(*d));
+			}
+		}
+
+		out.write(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+		WriteNumber<uint32_t>(out, SNAPSHOT_VERSION);
+		WriteNumber<uint32_t>(out, 0);
+
+		std::set<uint32_t> sites;
+		WriteNumber<uint64_t>(out, objects.size());
+		for (auto h : objects)
+		{
+			uint32_t site = MemoryGC::UNKNOWN_SITE;
+			auto n = nurserySites.find(h);
+			if (n != nurserySites.end())
+			{
+				site = n->second;
+			}
+			else
+			{
+				auto o = gc.mSites.find(h);
+				if (o != gc.mSites.end())
+					site = o->second;
+			}
+			if (site != MemoryGC::UNKNOWN_SITE)
+				sites.insert(site);
+
+			WriteNumber<uint8_t>(out, h->mType);
+			WriteNumber<uint8_t>(out, h->GCGeneration());
+			WriteNumber<uint16_t>(out, 0);
+			WriteNumber<uint32_t>(out, site);
+			WriteNumber<uint64_t>(out, MemoryAllocator::SizeOf(h));
+			if (h->mType == Value::Array)
+			{
+				WriteNumber<uint64_t>(out, h->mValue.aValue.row);
+				WriteNumber<uint64_t>(out, h->mValue.aValue.col);
+			}
+			else
+			{
+				WriteNumber<uint64_t>(out, h->mValue.sValue.length);
+				WriteNumber<uint64_t>(out, 0);
+			}
+		}
+
+		WriteNumber<uint64_t>(out, edges.size());
+		for (auto& e : edges)
+		{
+			WriteNumber<uint32_t>(out, e.first);
+			WriteNumber<uint32_t>(out, e.second);
+		}
+
+		WriteNumber<uint64_t>(out, roots.size());
+		for (auto& r : roots)
+		{
+			WriteNumber<uint8_t>(out, r.kind);
+			WriteNumber<uint32_t>(out, r.obj);
+			WriteNumber<uint32_t>(out, r.index);
+			WriteNumber<uint32_t>(out, static_cast<uint32_t>(r.name.size()));
+			out.write(r.name.data(), r.name.size());
+		}
+
+		WriteNumber<uint64_t>(out, sites.size());
+		for (auto site : sites)
+		{
+			WriteNumber<uint32_t>(out, site);
+			WriteNumber<uint16_t>(out, site < engine.mOpcodes.size() ? static_cast<uint16_t>(engine.mOpcodes[site]) : 0xFFFF);
+		}
+	}
+
+	void HeapSnapshot::Summarize(std::istream& in, std::ostream& out, size_t top)
+	{
+		char magic[sizeof(SNAPSHOT_MAGIC)];
+		if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), SNAPSHOT_MAGIC))
+			throw Exception(10001, "File is not in the correct format.");
+		if (ReadNumber<uint32_t>(in) != SNAPSHOT_VERSION)
+			throw Exception(10001, "File is not in the correct format.");
+		ReadNumber<uint32_t>(in);
+
+		std::vector<SnapshotObject> objects(ReadCount(in, 32));
+		for (auto& o : objects)
+		{
+			o.type = ReadNumber<uint8_t>(in);
+			o.gen = ReadNumber<uint8_t>(in);
+			ReadNumber<uint16_t>(in);
+			o.site = ReadNumber<uint32_t>(in);
+			o.size = ReadNumber<uint64_t>(in);
+			o.a = ReadNumber<uint64_t>(in);
+			o.b = ReadNumber<uint64_t>(in);
+		}
+
+		//每个对象的引用者：对象表序号，或根表序号按位取反
+		std::vector<std::vector<uint32_t>> referrers(objects.size());
+		auto edgeCount = ReadCount(in, 8);
+		for (size_t i = 0; i < edgeCount; ++i)
+		{
+			auto from = ReadNumber<uint32_t>(in);
+			auto to = ReadNumber<uint32_t>(in);
+			if (from >= objects.size() || to >= objects.size())
+				throw Exception(10001, "File is not in the correct format.");
+			referrers[to].push_back(from);
+		}
+
+		std::vector<SnapshotRoot> roots(ReadCount(in, 13));
+		for (size_t i = 0; i < roots.size(); ++i)
+		{
+			auto& r = roots[i];
+			r.kind = ReadNumber<uint8_t>(in);
+			r.obj = ReadNumber<uint32_t>(in);
+			r.index = ReadNumber<uint32_t>(in);
+			r.name.resize(ReadNumber<uint32_t>(in));
+			if (r.obj >= objects.size() || !in.read(&r.name[0], r.name.size()))
+				throw Exception(10001, "File is not in the correct format.");
+			referrers[r.obj].push_back(~static_cast<uint32_t>(i));
+		}
+
+		std::unordered_map<uint32_t, uint16_t> opcodes;
+		auto siteCount = ReadCount(in, 6);
+		for (size_t i = 0; i < siteCount; ++i)
+		{
+			auto site = ReadNumber<uint32_t>(in);
+			opcodes[site] = ReadNumber<uint16_t>(in);
+		}
+
+		auto describe = [&](uint32_t referrer) -> std::string
+		{
+			if (referrer >= objects.size())
+				return RootDescription(roots[~referrer]);
+			auto& o = objects[referrer];
+			return "#" + std::to_string(referrer) + " " + TypeName(o.type) + " " + SiteName(o.site, opcodes);
+		};
+
+		uint64_t totalBytes = 0;
+		std::map<uint8_t, std::pair<uint64_t, uint64_t>> byType;
+		std::unordered_map<uint32_t, std::pair<uint64_t, uint64_t>> bySite;
+		//按（分配位置，第一个引用者）汇总，找出是谁让某个位置分配的对象保持存活
+		std::map<std::pair<uint32_t, std::string>, std::pair<uint64_t, uint64_t>> byHolder;
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			auto& o = objects[i];
+			totalBytes += o.size;
+			auto& t = byType[o.type];
+			++t.first;
+			t.second += o.size;
+			auto& s = bySite[o.site];
+			++s.first;
+			s.second += o.size;
+			std::string holder;
+			if (!referrers[i].empty())
+			{
+				auto r = referrers[i].front();
+				holder = r >= objects.size() ? RootDescription(roots[~r]) : std::string(TypeName(objects[r].type)) + " " + SiteName(objects[r].site, opcodes);
+			}
+			auto& h = byHolder[std::make_pair(o.site, holder)];
+			++h.first;
+			h.second += o.size;
+		}
+
+		out << "Live objects: " << objects.size() << ", " << totalBytes << " bytes, " << edgeCount << " references, " << roots.size() << " roots" << std::endl;
+		for (auto& t : byType)
+		{
+			out << "  " << TypeName(t.first) << ": " << t.second.first << " objects, " << t.second.second << " bytes" << std::endl;
+		}
+
+		std::vector<std::pair<uint32_t, std::pair<uint64_t, uint64_t>>> sites(bySite.begin(), bySite.end());
+		std::sort(sites.begin(), sites.end(), [](const std::pair<uint32_t, std::pair<uint64_t, uint64_t>>& l, const std::pair<uint32_t, std::pair<uint64_t, uint64_t>>& r)
+		{
+			return l.second.second != r.second.second ? l.second.second > r.second.second : l.first < r.first;
+		});
+		out << std::endl << "Allocation sites by retained bytes:" << std::endl;
+		for (size_t i = 0; i < sites.size() && i < top; ++i)
+		{
+			out << "  " << SiteName(sites[i].first, opcodes) << ": " << sites[i].second.first << " objects, " << sites[i].second.second << " bytes" << std::endl;
+		}
+
+		std::vector<uint32_t> largest(objects.size());
+		for (size_t i = 0; i < largest.size(); ++i)
+		{
+			largest[i] = static_cast<uint32_t>(i);
+		}
+		auto count = std::min(top, largest.size());
+		std::partial_sort(largest.begin(), largest.begin() + count, largest.end(), [&](uint32_t l, uint32_t r)
+		{
+			return objects[l].size != objects[r].size ? objects[l].size > objects[r].size : l < r;
+		});
+		out << std::endl << "Largest objects:" << std::endl;
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto& o = objects[largest[i]];
+			out << "  #" << largest[i] << " " << TypeName(o.type);
+			if (o.type == Value::Array)
+				out << "[" << o.a << "x" << o.b << "]";
+			else
+				out << "(" << o.a << ")";
+			out << " gen " << (o.gen == HeapValue::GC_UNTRACKED ? std::string("constant") : std::to_string(o.gen)) << ", " << o.size << " bytes, " << SiteName(o.site, opcodes) << std::endl;
+			auto& r = referrers[largest[i]];
+			for (size_t j = 0; j < r.size() && j < 3; ++j)
+			{
+				out << "      <- " << describe(r[j]) << std::endl;
+			}
+			if (r.size() > 3)
+				out << "      <- ... " << (r.size() - 3) << " more" << std::endl;
+		}
+
+		std::vector<std::pair<std::pair<uint32_t, std::string>, std::pair<uint64_t, uint64_t>>> holders(byHolder.begin(), byHolder.end());
+		std::stable_sort(holders.begin(), holders.end(), [](const std::pair<std::pair<uint32_t, std::string>, std::pair<uint64_t, uint64_t>>& l, const std::pair<std::pair<uint32_t, std::string>, std::pair<uint64_t, uint64_t>>& r)
+		{
+			return l.second.second > r.second.second;
+		});
+		out << std::endl << "Retained bytes by allocation site and holder:" << std::endl;
+		for (size_t i = 0; i < holders.size() && i < top; ++i)
+		{
+			auto& h = holders[i];
+			out << "  " << SiteName(h.first.first, opcodes) << " held by " << (h.first.second.empty() ? std::string("nothing") : h.first.second)
+				<< ": " << h.second.first << " objects, " << h.second.second << " bytes" << std::endl;
+		}
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include "VM.h"
+
+namespace VM
+{
+	//堆快照：从根（计算栈、数据栈、宿主函数参数、全局变量、常量）出发遍历所有可达的堆对象，
+	//  写出每个对象的类型、大小、所属代、分配位置及对象之间的引用关系。
+	//  分配位置须在加载程序前用 Engine::SetAllocationSites 开启跟踪，否则都为 MemoryGC::UNKNOWN_SITE。
+	//  Summarize 离线读取快照，按分配位置汇总存活对象，并列出最大的对象及保持它们存活的引用者。
+	//  文件格式（整数按本机字节序）：
+	//    头部    "CNPLHEAP" uint32 版本 uint32 保留
+	//    对象表  uint64 个数，每个对象：uint8 类型 uint8 代号 uint16 保留 uint32 分配位置 uint64 字节数 uint64 长度或行数 uint64 列数
+	//    引用表  uint64 条数，每条：uint32 引用者 uint32 被引用者（均为对象表中的序号）
+	//    根表    uint64 个数，每个根：uint8 种类 uint32 对象 uint32 位置 uint32 名称字节数 名称（UTF-8，只有全局变量有名称）
+	//    位置表  uint64 个数，每个：uint32 分配位置 uint16 该位置的指令
+	class HeapSnapshot
+	{
+	public:
+		typedef enum : uint8_t
+		{
+			RootCalcStack = 1,
+			RootDataStack,
+			RootCallParameter,
+			RootGlobal,
+			RootConstant
+		}RootKind;
+	public:
+		//只能在 GC 安全点调用（宿主函数中、MemoryGC::SetHeapWatch 的回调中或程序运行结束后）
+		static void Write(const Engine& engine, std::ostream& out);
+		//top 为每个列表最多输出的条数
+		static void Summarize(std::istream& in, std::ostream& out, size_t top = 20);
+	};
+}
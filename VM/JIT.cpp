@@ -0,0 +1,926 @@
+#include "JIT.h"
+
+#if defined(BYTE_CODE_VM_JIT)
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <initializer_list>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace VM
+{
+	//同一位置（函数入口或循环头）执行多少次后编译
+	static const uint32_t JIT_HOT_THRESHOLD = 1000;
+	//所有机器码放在同一块区域内，彼此之间可以直接用 32 位相对跳转
+	static const size_t JIT_CODE_SIZE = 32 * 1024 * 1024;
+	//一次编译最多收集的指令条数，超出部分运行到时退回解释器
+	static const size_t JIT_REGION_LIMIT = 20000;
+
+	static size_t PageSize(void)
+	{
+#if defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwPageSize;
+#else
+		return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+	}
+
+	namespace
+	{
+		//x86-64 条件码，取反只需翻转最低位
+		enum Condition : uint8_t
+		{
+			CC_E = 0x4,
+			CC_NE = 0x5,
+			CC_BE = 0x6,
+			CC_A = 0x7
+		};
+
+		class Assembler
+		{
+		public:
+			size_t Size(void) const { return mBytes.size(); }
+			uint8_t* Data(void) { return mBytes.data(); }
+			void Emit(std::initializer_list<uint8_t> bytes)
+			{
+				mBytes.insert(mBytes.end(), bytes);
+			}
+			void Emit32(uint32_t value)
+			{
+				for (size_t i = 0; i < 4; ++i)
+					mBytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+			}
+			void Emit64(uint64_t value)
+			{
+				for (size_t i = 0; i < 8; ++i)
+					mBytes.push_back(static_cast<uint8_t>(value >> (8 * i)));
+			}
+			//jmp rel32 / jcc rel32，返回待回填的位移所在位置
+			size_t Jmp(void)
+			{
+				Emit({ 0xE9 });
+				return Placeholder();
+			}
+			size_t Jcc(Condition cc)
+			{
+				Emit({ 0x0F, static_cast<uint8_t>(0x80 | cc) });
+				return Placeholder();
+			}
+			//把 at 处的位移指向缓冲区内的 target 位置
+			void Patch(size_t at, size_t target)
+			{
+				Put32(at, static_cast<uint32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(at + 4)));
+			}
+			//代码最终放到 base 处时，把 at 处的位移指向绝对地址 target
+			void Patch(size_t at, const uint8_t* base, const uint8_t* target)
+			{
+				Put32(at, static_cast<uint32_t>(target - (base + at + 4)));
+			}
+			void Bind(size_t at)
+			{
+				Patch(at, Size());
+			}
+		private:
+			size_t Placeholder(void)
+			{
+				auto at = Size();
+				Emit32(0);
+				return at;
+			}
+			void Put32(size_t at, uint32_t value)
+			{
+				for (size_t i = 0; i < 4; ++i)
+					mBytes[at + i] = static_cast<uint8_t>(value >> (8 * i));
+			}
+		private:
+			std::vector<uint8_t> mBytes;
+		};
+	}
+
+	JIT::JIT(Engine* engine) :
+		mEngine(engine),
+		mCode(nullptr),
+		mCodeUsed(0),
+		mFull(true),
+		mTrampoline(nullptr),
+		mExitStub(nullptr),
+		mErrorStub(nullptr),
+		mEntries(engine->mInstructionCount, nullptr),
+		mHotCounts(engine->mInstructionCount, 0),
+		mContext(),
+		mException()
+	{
+		mContext.jit = this;
+#if defined(_WIN32)
+		void* code = VirtualAlloc(nullptr, JIT_CODE_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+		void* code = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code == MAP_FAILED)
+			code = nullptr;
+#endif
+		//申请不到内存或无法设为可执行（例如系统禁止生成代码）时只用解释器
+		if (code == nullptr)
+			return;
+		mCode = static_cast<uint8_t*>(code);
+		mFull = !EmitTrampoline();
+	}
+
+	JIT::~JIT()
+	{
+		if (mCode == nullptr)
+			return;
+#if defined(_WIN32)
+		VirtualFree(mCode, 0, MEM_RELEASE);
+#else
+		munmap(mCode, JIT_CODE_SIZE);
+#endif
+	}
+
+	static_assert(sizeof(Value) == 16, "JIT templates assume 16-byte values");
+
+	//Context 字段相对 rbx 的偏移，全部用 8 位位移寻址
+	#define JIT_CONTEXT_OFFSET(field) static_cast<uint8_t>(offsetof(Context, field))
+
+	//代码页任何时候都不同时可写、可执行（W^X）：写入前把涉及的页改为可读写，写完再改回可读、可执行。
+	//  新代码可能与已有代码共用一页，修改期间不会执行该页上的代码（编译只在解释器或辅助函数中进行）
+	bool JIT::WriteCode(size_t offset, const uint8_t* bytes, size_t size)
+	{
+		auto pageSize = PageSize();
+		auto first = offset & ~(pageSize - 1);
+		auto length = ((offset + size + pageSize - 1) & ~(pageSize - 1)) - first;
+#if defined(_WIN32)
+		DWORD old;
+		if (!VirtualProtect(mCode + first, length, PAGE_READWRITE, &old))
+			return false;
+		memcpy(mCode + offset, bytes, size);
+		if (!VirtualProtect(mCode + first, length, PAGE_EXECUTE_READ, &old))
+			return false;
+		FlushInstructionCache(GetCurrentProcess(), mCode + offset, size);
+#else
+		if (mprotect(mCode + first, length, PROT_READ | PROT_WRITE) != 0)
+			return false;
+		memcpy(mCode + offset, bytes, size);
+		if (mprotect(mCode + first, length, PROT_READ | PROT_EXEC) != 0)
+			return false;
+#endif
+		return true;
+	}
+
+	bool JIT::EmitTrampoline(void)
+	{
+		static_assert(offsetof(Context, jit) < 0x80, "context fields must be reachable with disp8");
+		Assembler a;
+		//int trampoline(Context* context, const void* entry)
+		//保存全部用到的被调用者保存寄存器，多压 r14/r15 让栈在调用辅助函数时保持 16 字节对齐，
+		//再留出 32 字节给 Windows x64 的影子空间（System V 下无害）
+		a.Emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });	//push rbx/r12/r13/r14/r15
+		a.Emit({ 0x48, 0x83, 0xEC, 0x20 });									//sub rsp, 32
+#if defined(_WIN32)
+		a.Emit({ 0x48, 0x89, 0xCB });											//mov rbx, rcx
+#else
+		a.Emit({ 0x48, 0x89, 0xFB });											//mov rbx, rdi
+#endif
+		a.Emit({ 0x4C, 0x8B, 0x63, JIT_CONTEXT_OFFSET(calcTop) });				//mov r12, [rbx+calcTop]
+		a.Emit({ 0x4C, 0x8B, 0x6B, JIT_CONTEXT_OFFSET(dataFrame) });			//mov r13, [rbx+dataFrame]
+#if defined(_WIN32)
+		a.Emit({ 0xFF, 0xE2 });													//jmp rdx
+#else
+		a.Emit({ 0xFF, 0xE6 });													//jmp rsi
+#endif
+		//正常退出：返回 0，解释器从 context->ip 的下一条继续
+		auto exitStub = a.Size();
+		a.Emit({ 0x31, 0xC0 });													//xor eax, eax
+		auto epilogue = a.Size();
+		a.Emit({ 0x48, 0x83, 0xC4, 0x20 });									//add rsp, 32
+		a.Emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3 });	//pop r15/r14/r13/r12/rbx; ret
+		//通用实现抛出异常：返回 1，异常保存在 mException 中，由 Enter 重新抛出
+		auto errorStub = a.Size();
+		a.Emit({ 0xB8, 0x01, 0x00, 0x00, 0x00 });								//mov eax, 1
+		a.Patch(a.Jmp(), epilogue);
+
+		if (!WriteCode(0, a.Data(), a.Size()))
+			return false;
+		mTrampoline = reinterpret_cast<PFN_TRAMPOLINE>(mCode);
+		mExitStub = mCode + exitStub;
+		mErrorStub = mCode + errorStub;
+		mCodeUsed = (a.Size() + 15) & ~static_cast<size_t>(15);
+		return true;
+	}
+
+	void JIT::Enter(void)
+	{
+		auto next = static_cast<size_t>(mEngine->mIP - mEngine->mInstructions) + 1;
+		auto entry = Lookup(next);
+		if (entry == nullptr)
+			return;
+		SyncOut(&mContext);
+		if (mTrampoline(&mContext, entry) != 0)
+		{
+			auto e = mException;
+			mException = nullptr;
+			std::rethrow_exception(e);
+		}
+		mEngine->mCALCTop = mContext.calcTop;
+		mEngine->mIP = static_cast<const Engine::Instruction*>(mContext.ip);
+	}
+
+	const uint8_t* JIT::Lookup(size_t index)
+	{
+		if (index >= mEntries.size())
+			return nullptr;
+		auto entry = mEntries[index];
+		if (entry == nullptr && !mFull && ++mHotCounts[index] >= JIT_HOT_THRESHOLD)
+		{
+			mHotCounts[index] = 0;
+			entry = Compile(index);
+		}
+		return entry;
+	}
+
+	void JIT::SyncOut(Context* context)
+	{
+		context->calcTop = mEngine->mCALCTop;
+		context->calcLimit = mEngine->mCALCLimit;
+		context->dataFrame = mEngine->mDATAStack.data() + mEngine->mDATABase;
+	}
+
+	//控制转移到 next：已编译则返回其机器码地址，否则记下位置并退回解释器
+	const void* JIT::Continue(Context* context, size_t next)
+	{
+		auto entry = Lookup(next);
+		if (entry != nullptr)
+			return entry;
+		context->ip = mEngine->mInstructions + (next - 1);
+		return mExitStub;
+	}
+
+	//慢速路径：用通用实现执行第 index 条指令。
+	//返回 nullptr 表示继续执行下一条的机器码，否则跳转到返回的地址（跳转目标、退出或异常出口）
+	const void* JIT::Step(Context* context, size_t index)
+	{
+		auto jit = context->jit;
+		auto engine = jit->mEngine;
+		auto ip = engine->mInstructions + index;
+		try
+		{
+			engine->mCALCTop = context->calcTop;
+			engine->mIP = ip;
+			if (engine->GlobalVariableSite(index) == InstructionID::STG)
+				engine->InstructionSTG(ip->tag);
+			else
+				engine->ExecuteGeneric(engine->mOpcodes[index], ip->tag);
+			jit->SyncOut(context);
+			if (engine->mIP == ip)
+				return nullptr;
+			return jit->Continue(context, static_cast<size_t>(engine->mIP - engine->mInstructions) + 1);
+		}
+		catch (...)
+		{
+			jit->mException = std::current_exception();
+			return jit->mErrorStub;
+		}
+	}
+
+	const uint8_t* JIT::Compile(size_t start)
+	{
+		typedef struct
+		{
+			size_t at;
+			size_t index;
+		}Fixup;
+		typedef struct
+		{
+			std::vector<size_t> at;
+			size_t index;
+		}SlowPath;
+
+		auto engine = mEngine;
+		auto count = engine->mInstructionCount;
+		auto& opcodes = engine->mOpcodes;
+		auto instructions = engine->mInstructions;
+
+		//沿控制流收集尚未编译的指令；CALL 的目标不在此收集，等它自己变热后单独编译
+		std::vector<size_t> region;
+		std::unordered_map<size_t, size_t> labels;
+		std::vector<size_t> pending = { start };
+		while (!pending.empty())
+		{
+			auto i = pending.back();
+			pending.pop_back();
+			if (i >= count || mEntries[i] != nullptr || labels.count(i) != 0 || region.size() >= JIT_REGION_LIMIT)
+				continue;
+			labels[i] = 0;
+			region.push_back(i);
+			auto op = opcodes[i];
+			if (op == InstructionID::JMP || op == InstructionID::JMPC || op == InstructionID::JMPN)
+				pending.push_back(instructions[i].tag);
+			if (op != InstructionID::JMP && op != InstructionID::RET)
+				pending.push_back(i + 1);
+		}
+		std::sort(region.begin(), region.end());
+
+		Assembler a;
+		std::vector<Fixup> fixups;
+		std::vector<SlowPath> slowPaths;
+		const uint8_t TOP = JIT_CONTEXT_OFFSET(calcTop);
+		const uint8_t LIMIT = JIT_CONTEXT_OFFSET(calcLimit);
+		const uint8_t FRAME = JIT_CONTEXT_OFFSET(dataFrame);
+		const uint8_t IP = JIT_CONTEXT_OFFSET(ip);
+		const uint8_t HEAP_GENERATION = static_cast<uint8_t>(offsetof(HeapValue, mGeneration));
+		const uint8_t ARRAY_ROW = static_cast<uint8_t>(offsetof(HeapValue, mValue.aValue.row));
+		const uint8_t ARRAY_COL = static_cast<uint8_t>(offsetof(HeapValue, mValue.aValue.col));
+		const uint8_t ARRAY_DATA = static_cast<uint8_t>(offsetof(HeapValue, mValue.aValue.data));
+
+		//cmp byte [r12+disp], type; jne fail
+		auto guardType = [&](int8_t disp, Value::Type type, std::vector<size_t>& fail)
+		{
+			a.Emit({ 0x41, 0x80, 0x7C, 0x24, static_cast<uint8_t>(disp), static_cast<uint8_t>(type) });
+			fail.push_back(a.Jcc(CC_NE));
+		};
+		//cmp r12, [rbx+calcLimit]; jae fail
+		auto guardPush = [&](std::vector<size_t>& fail)
+		{
+			a.Emit({ 0x4C, 0x3B, 0x63, LIMIT });
+			a.Emit({ 0x0F, 0x83 });
+			fail.push_back(a.Size());
+			a.Emit32(0);
+		};
+		auto bindAll = [&](std::vector<size_t>& at)
+		{
+			for (auto p : at)
+				a.Bind(p);
+			at.clear();
+		};
+		//调用 Step(context, index)，之后重新载入栈顶和栈帧；返回非空则跳到返回的地址
+		auto callStep = [&](size_t index)
+		{
+			a.Emit({ 0x4C, 0x89, 0x63, TOP });					//mov [rbx+calcTop], r12
+#if defined(_WIN32)
+			a.Emit({ 0x48, 0x89, 0xD9, 0xBA });					//mov rcx, rbx; mov edx, imm32
+#else
+			a.Emit({ 0x48, 0x89, 0xDF, 0xBE });					//mov rdi, rbx; mov esi, imm32
+#endif
+			a.Emit32(static_cast<uint32_t>(index));
+			a.Emit({ 0x48, 0xB8 });								//mov rax, imm64
+			a.Emit64(reinterpret_cast<uint64_t>(&JIT::Step));
+			a.Emit({ 0xFF, 0xD0 });								//call rax
+			a.Emit({ 0x4C, 0x8B, 0x63, TOP });					//mov r12, [rbx+calcTop]
+			a.Emit({ 0x4C, 0x8B, 0x6B, FRAME });				//mov r13, [rbx+dataFrame]
+			a.Emit({ 0x48, 0x85, 0xC0, 0x74, 0x02, 0xFF, 0xE0 });	//test rax, rax; jz +2; jmp rax
+		};
+		//把次栈顶与栈顶比较并设置标志位，返回比较结果为真时的条件码
+		auto emitCompare = [&](InstructionID op, std::vector<size_t>& slow) -> Condition
+		{
+			if (op == InstructionID::EQ || op == InstructionID::NE)
+			{
+				guardType(-32, Value::Integer, slow);
+				guardType(-16, Value::Integer, slow);
+				a.Emit({ 0x49, 0x8B, 0x44, 0x24, 0xE8 });			//mov rax, [r12-24]
+				a.Emit({ 0x49, 0x3B, 0x44, 0x24, 0xF8 });			//cmp rax, [r12-8]
+				return op == InstructionID::EQ ? CC_E : CC_NE;
+			}
+			//与通用实现一致，整数也按实数比较
+			std::vector<size_t> notInteger;
+			guardType(-32, Value::Integer, notInteger);
+			guardType(-16, Value::Integer, slow);
+			a.Emit({ 0xF2, 0x49, 0x0F, 0x2A, 0x44, 0x24, 0xE8 });	//cvtsi2sd xmm0, [r12-24]
+			a.Emit({ 0xF2, 0x49, 0x0F, 0x2A, 0x4C, 0x24, 0xF8 });	//cvtsi2sd xmm1, [r12-8]
+			auto loaded = a.Jmp();
+			bindAll(notInteger);
+			guardType(-32, Value::Real, slow);
+			guardType(-16, Value::Real, slow);
+			a.Emit({ 0xF2, 0x41, 0x0F, 0x10, 0x44, 0x24, 0xE8 });	//movsd xmm0, [r12-24]
+			a.Emit({ 0xF2, 0x41, 0x0F, 0x10, 0x4C, 0x24, 0xF8 });	//movsd xmm1, [r12-8]
+			a.Bind(loaded);
+			//NaN 参与比较时 CF=ZF=1，a 条件为假，与 C++ 的比较结果一致
+			if (op == InstructionID::LT)
+				a.Emit({ 0x66, 0x0F, 0x2E, 0xC8 });				//ucomisd xmm1, xmm0
+			else
+				a.Emit({ 0x66, 0x0F, 0x2E, 0xC1 });				//ucomisd xmm0, xmm1
+			return CC_A;
+		};
+
+		//组合模板：LD/LC 的操作数不经过计算栈，直接从栈帧或立即数装入 rax、rcx。
+		//i 之后的指令仍会单独生成（跳转可能落在中间），组合代码执行完跳过它们；
+		//类型检查失败时按原指令执行第 i 条，再转到第 i+1 条的单独代码
+		typedef struct
+		{
+			bool constant;
+			uint32_t disp;
+			uint64_t words[2];
+		}Operand;
+		auto fetchOperand = [&](size_t i, Operand& operand) -> bool
+		{
+			if (i >= count || labels.count(i) == 0)
+				return false;
+			auto tag = instructions[i].tag;
+			if (opcodes[i] == InstructionID::LD && tag <= 0x07FFFFFF)
+			{
+				operand.constant = false;
+				operand.disp = static_cast<uint32_t>(tag * sizeof(Value));
+				return true;
+			}
+			if (opcodes[i] == InstructionID::LC && tag < engine->mConstants.size())
+			{
+				operand.constant = true;
+				memcpy(operand.words, &engine->mConstants[tag], sizeof(operand.words));
+				return true;
+			}
+			return false;
+		};
+		auto operandType = [&](const Operand& operand) -> Value::Type
+		{
+			return static_cast<Value::Type>(static_cast<uint8_t>(operand.words[0]));
+		};
+		//reg 为 0 时装入 rax，为 1 时装入 rcx
+		auto loadOperand = [&](const Operand& operand, uint8_t reg)
+		{
+			if (operand.constant)
+			{
+				a.Emit({ 0x48, static_cast<uint8_t>(0xB8 | reg) });		//mov rax/rcx, imm64
+				a.Emit64(operand.words[1]);
+			}
+			else
+			{
+				a.Emit({ 0x49, 0x8B, static_cast<uint8_t>(0x85 | (reg << 3)) });	//mov rax/rcx, [r13+disp32+8]
+				a.Emit32(operand.disp + 8);
+			}
+		};
+		auto storeResult = [&](uint32_t disp, Value::Type type)
+		{
+			a.Emit({ 0x49, 0xC7, 0x85 });								//mov qword [r13+disp32], type
+			a.Emit32(disp);
+			a.Emit32(type);
+			a.Emit({ 0x49, 0x89, 0x85 });								//mov [r13+disp32+8], rax
+			a.Emit32(disp + 8);
+		};
+		auto emitFused = [&](size_t i, SlowPath& slow) -> bool
+		{
+			Operand lhs = {};
+			Operand rhs = {};
+			if (!fetchOperand(i, lhs))
+				return false;
+
+			//LD/LC; SD：直接复制到变量
+			if (i + 1 < count && opcodes[i + 1] == InstructionID::SD && labels.count(i + 1) != 0 && instructions[i + 1].tag <= 0x07FFFFFF)
+			{
+				auto disp = static_cast<uint32_t>(instructions[i + 1].tag * sizeof(Value));
+				if (lhs.constant)
+				{
+					a.Emit({ 0x48, 0xB8 });								//mov rax, imm64
+					a.Emit64(lhs.words[0]);
+				}
+				else
+				{
+					a.Emit({ 0x49, 0x8B, 0x85 });						//mov rax, [r13+disp32]
+					a.Emit32(lhs.disp);
+				}
+				a.Emit({ 0x49, 0x89, 0x85 });							//mov [r13+disp32], rax
+				a.Emit32(disp);
+				loadOperand(lhs, 0);
+				a.Emit({ 0x49, 0x89, 0x85 });							//mov [r13+disp32+8], rax
+				a.Emit32(disp + 8);
+				fixups.push_back({ a.Jmp(), i + 2 });
+				return true;
+			}
+
+			if (!fetchOperand(i + 1, rhs) || i + 2 >= count || labels.count(i + 2) == 0)
+				return false;
+			auto op = opcodes[i + 2];
+			auto arithmetic = op == InstructionID::ADD || op == InstructionID::SUB || op == InstructionID::MUL || op == InstructionID::DIV;
+			auto compare = op == InstructionID::LT || op == InstructionID::GT || op == InstructionID::EQ || op == InstructionID::NE;
+			auto sink = i + 3 < count && labels.count(i + 3) != 0 ? opcodes[i + 3] : InstructionID::NOOP;
+			auto store = arithmetic && sink == InstructionID::SD && instructions[i + 3].tag <= 0x07FFFFFF;
+			auto branch = compare && (sink == InstructionID::JMPN || sink == InstructionID::JMPC);
+			if (!arithmetic && !branch)
+				return false;
+
+			//依次尝试整数、实数两种快速路径，常量操作数的类型在编译时已知
+			std::vector<Value::Type> types;
+			if (op != InstructionID::DIV)
+				types.push_back(Value::Integer);
+			if (op != InstructionID::EQ && op != InstructionID::NE)
+				types.push_back(Value::Real);
+			types.erase(std::remove_if(types.begin(), types.end(), [&](Value::Type type)
+			{
+				return (lhs.constant && operandType(lhs) != type) || (rhs.constant && operandType(rhs) != type);
+			}), types.end());
+			if (types.empty())
+				return false;
+			if (!store && !branch)
+				guardPush(slow.at);
+
+			std::vector<size_t> next;
+			for (auto type : types)
+			{
+				bindAll(next);
+				if (!lhs.constant)
+				{
+					a.Emit({ 0x41, 0x80, 0xBD });						//cmp byte [r13+disp32], type
+					a.Emit32(lhs.disp);
+					a.Emit({ static_cast<uint8_t>(type) });
+					next.push_back(a.Jcc(CC_NE));
+				}
+				if (!rhs.constant)
+				{
+					a.Emit({ 0x41, 0x80, 0xBD });						//cmp byte [r13+disp32], type
+					a.Emit32(rhs.disp);
+					a.Emit({ static_cast<uint8_t>(type) });
+					next.push_back(a.Jcc(CC_NE));
+				}
+				loadOperand(lhs, 0);
+				loadOperand(rhs, 1);
+
+				if (branch)
+				{
+					Condition cc;
+					if (op == InstructionID::EQ || op == InstructionID::NE)
+					{
+						a.Emit({ 0x48, 0x39, 0xC8 });					//cmp rax, rcx
+						cc = op == InstructionID::EQ ? CC_E : CC_NE;
+					}
+					else
+					{
+						if (type == Value::Integer)
+						{
+							a.Emit({ 0x0F, 0x57, 0xC0, 0x0F, 0x57, 0xC9 });	//xorps xmm0, xmm0; xorps xmm1, xmm1
+							a.Emit({ 0xF2, 0x48, 0x0F, 0x2A, 0xC0 });	//cvtsi2sd xmm0, rax
+							a.Emit({ 0xF2, 0x48, 0x0F, 0x2A, 0xC9 });	//cvtsi2sd xmm1, rcx
+						}
+						else
+						{
+							a.Emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 });	//movq xmm0, rax
+							a.Emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC9 });	//movq xmm1, rcx
+						}
+						if (op == InstructionID::LT)
+							a.Emit({ 0x66, 0x0F, 0x2E, 0xC8 });			//ucomisd xmm1, xmm0
+						else
+							a.Emit({ 0x66, 0x0F, 0x2E, 0xC1 });			//ucomisd xmm0, xmm1
+						cc = CC_A;
+					}
+					auto jump = sink == InstructionID::JMPC ? cc : static_cast<Condition>(cc ^ 1);
+					fixups.push_back({ a.Jcc(jump), instructions[i + 3].tag });
+					fixups.push_back({ a.Jmp(), i + 4 });
+					continue;
+				}
+
+				if (type == Value::Integer)
+				{
+					if (op == InstructionID::ADD)
+						a.Emit({ 0x48, 0x01, 0xC8 });					//add rax, rcx
+					else if (op == InstructionID::SUB)
+						a.Emit({ 0x48, 0x29, 0xC8 });					//sub rax, rcx
+					else
+						a.Emit({ 0x48, 0x0F, 0xAF, 0xC1 });				//imul rax, rcx
+				}
+				else
+				{
+					uint8_t sse = op == InstructionID::ADD ? 0x58 : op == InstructionID::SUB ? 0x5C : op == InstructionID::MUL ? 0x59 : 0x5E;
+					a.Emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 });			//movq xmm0, rax
+					a.Emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC9 });			//movq xmm1, rcx
+					a.Emit({ 0xF2, 0x0F, sse, 0xC1 });					//addsd/subsd/mulsd/divsd xmm0, xmm1
+					a.Emit({ 0x66, 0x48, 0x0F, 0x7E, 0xC0 });			//movq rax, xmm0
+				}
+				if (store)
+				{
+					storeResult(static_cast<uint32_t>(instructions[i + 3].tag * sizeof(Value)), type);
+					fixups.push_back({ a.Jmp(), i + 4 });
+				}
+				else
+				{
+					a.Emit({ 0x49, 0xC7, 0x04, 0x24 });					//mov qword [r12], type
+					a.Emit32(type);
+					a.Emit({ 0x49, 0x89, 0x44, 0x24, 0x08 });			//mov [r12+8], rax
+					a.Emit({ 0x49, 0x83, 0xC4, 0x10 });					//add r12, 16
+					fixups.push_back({ a.Jmp(), i + 3 });
+				}
+			}
+			for (auto p : next)
+				slow.at.push_back(p);
+			return true;
+		};
+
+		for (size_t n = 0; n < region.size(); ++n)
+		{
+			auto i = region[n];
+			auto op = opcodes[i];
+			auto tag = instructions[i].tag;
+			auto fallthrough = true;
+			SlowPath slow;
+			slow.index = i;
+			labels[i] = a.Size();
+
+			if (emitFused(i, slow))
+			{
+				if (!slow.at.empty())
+					slowPaths.push_back(slow);
+				continue;
+			}
+
+			switch (op)
+			{
+			case InstructionID::NOOP:
+				break;
+			case InstructionID::LD:
+			case InstructionID::LC:
+				if ((op == InstructionID::LD && tag > 0x07FFFFFF) || (op == InstructionID::LC && tag >= engine->mConstants.size()))
+				{
+					callStep(i);
+					break;
+				}
+				if (op == InstructionID::LC && labels.count(i + 1) != 0)
+				{
+					//LC 变量名; CALLSYS 读/写全局变量：槽位地址在加载时已确定，读取直接从槽位搬运，写入需经过写屏障
+					auto site = engine->GlobalVariableSite(i);
+					if (site == InstructionID::STG)
+					{
+						callStep(i);
+						break;
+					}
+					if (site == InstructionID::LDG)
+					{
+						guardPush(slow.at);
+						a.Emit({ 0x48, 0xBA });							//mov rdx, imm64
+						a.Emit64(reinterpret_cast<uint64_t>(&engine->mConstantGlobals[tag]->value));
+						a.Emit({ 0x48, 0x8B, 0x02 });					//mov rax, [rdx]
+						a.Emit({ 0x48, 0x8B, 0x4A, 0x08 });				//mov rcx, [rdx+8]
+						a.Emit({ 0x49, 0x89, 0x04, 0x24 });				//mov [r12], rax
+						a.Emit({ 0x49, 0x89, 0x4C, 0x24, 0x08 });		//mov [r12+8], rcx
+						a.Emit({ 0x49, 0x83, 0xC4, 0x10 });				//add r12, 16
+						fixups.push_back({ a.Jmp(), i + 2 });
+						break;
+					}
+				}
+				//值按两个 8 字节分别搬运：运算模板只改写其中一半，16 字节整体读写会导致存储转发失败
+				guardPush(slow.at);
+				if (op == InstructionID::LD)
+				{
+					a.Emit({ 0x49, 0x8B, 0x85 });						//mov rax, [r13+disp32]
+					a.Emit32(static_cast<uint32_t>(tag * sizeof(Value)));
+					a.Emit({ 0x49, 0x8B, 0x8D });						//mov rcx, [r13+disp32+8]
+					a.Emit32(static_cast<uint32_t>(tag * sizeof(Value) + 8));
+				}
+				else
+				{
+					//常量在程序卸载前不会改变，直接作为立即数写入
+					uint64_t words[2];
+					memcpy(words, &engine->mConstants[tag], sizeof(words));
+					a.Emit({ 0x48, 0xB8 });								//mov rax, imm64
+					a.Emit64(words[0]);
+					a.Emit({ 0x48, 0xB9 });								//mov rcx, imm64
+					a.Emit64(words[1]);
+				}
+				a.Emit({ 0x49, 0x89, 0x04, 0x24 });						//mov [r12], rax
+				a.Emit({ 0x49, 0x89, 0x4C, 0x24, 0x08 });				//mov [r12+8], rcx
+				a.Emit({ 0x49, 0x83, 0xC4, 0x10 });						//add r12, 16
+				break;
+			case InstructionID::SD:
+				if (tag > 0x07FFFFFF)
+				{
+					callStep(i);
+					break;
+				}
+				a.Emit({ 0x49, 0x83, 0xEC, 0x10 });						//sub r12, 16
+				a.Emit({ 0x49, 0x8B, 0x04, 0x24 });						//mov rax, [r12]
+				a.Emit({ 0x49, 0x8B, 0x4C, 0x24, 0x08 });				//mov rcx, [r12+8]
+				a.Emit({ 0x49, 0x89, 0x85 });							//mov [r13+disp32], rax
+				a.Emit32(static_cast<uint32_t>(tag * sizeof(Value)));
+				a.Emit({ 0x49, 0x89, 0x8D });							//mov [r13+disp32+8], rcx
+				a.Emit32(static_cast<uint32_t>(tag * sizeof(Value) + 8));
+				break;
+			case InstructionID::POP:
+				a.Emit({ 0x49, 0x83, 0xEC, 0x10 });						//sub r12, 16
+				break;
+			case InstructionID::PUSH:
+				guardPush(slow.at);
+				a.Emit({ 0x49, 0xC7, 0x04, 0x24 });						//mov qword [r12], Boolean
+				a.Emit32(Value::Boolean);
+				a.Emit({ 0x49, 0xC7, 0x44, 0x24, 0x08 });				//mov qword [r12+8], 0
+				a.Emit32(0);
+				a.Emit({ 0x49, 0x83, 0xC4, 0x10 });						//add r12, 16
+				break;
+			case InstructionID::ADD:
+			case InstructionID::SUB:
+			case InstructionID::MUL:
+			case InstructionID::DIV:
+			{
+				//整数除法留给通用实现处理除零
+				std::vector<size_t> notInteger;
+				size_t done = 0;
+				if (op != InstructionID::DIV)
+				{
+					guardType(-32, Value::Integer, notInteger);
+					guardType(-16, Value::Integer, slow.at);
+					a.Emit({ 0x49, 0x8B, 0x44, 0x24, 0xE8 });			//mov rax, [r12-24]
+					if (op == InstructionID::ADD)
+						a.Emit({ 0x49, 0x03, 0x44, 0x24, 0xF8 });		//add rax, [r12-8]
+					else if (op == InstructionID::SUB)
+						a.Emit({ 0x49, 0x2B, 0x44, 0x24, 0xF8 });		//sub rax, [r12-8]
+					else
+						a.Emit({ 0x49, 0x0F, 0xAF, 0x44, 0x24, 0xF8 });	//imul rax, [r12-8]
+					a.Emit({ 0x49, 0x89, 0x44, 0x24, 0xE8 });			//mov [r12-24], rax
+					done = a.Jmp();
+					bindAll(notInteger);
+				}
+				guardType(-32, Value::Real, slow.at);
+				guardType(-16, Value::Real, slow.at);
+				uint8_t sse = op == InstructionID::ADD ? 0x58 : op == InstructionID::SUB ? 0x5C : op == InstructionID::MUL ? 0x59 : 0x5E;
+				a.Emit({ 0xF2, 0x41, 0x0F, 0x10, 0x44, 0x24, 0xE8 });	//movsd xmm0, [r12-24]
+				a.Emit({ 0xF2, 0x41, 0x0F, sse, 0x44, 0x24, 0xF8 });	//addsd/subsd/mulsd/divsd xmm0, [r12-8]
+				a.Emit({ 0xF2, 0x41, 0x0F, 0x11, 0x44, 0x24, 0xE8 });	//movsd [r12-24], xmm0
+				if (op != InstructionID::DIV)
+					a.Bind(done);
+				a.Emit({ 0x49, 0x83, 0xEC, 0x10 });						//sub r12, 16
+				break;
+			}
+			case InstructionID::LT:
+			case InstructionID::GT:
+			case InstructionID::EQ:
+			case InstructionID::NE:
+			{
+				auto cc = emitCompare(op, slow.at);
+				auto next = i + 1 < count ? opcodes[i + 1] : InstructionID::NOOP;
+				if ((next == InstructionID::JMPN || next == InstructionID::JMPC) && labels.count(i + 1) != 0)
+				{
+					//紧跟条件跳转时直接按标志位跳转，不生成逻辑值；慢速路径仍压入逻辑值后转到独立的跳转指令
+					auto branch = next == InstructionID::JMPC ? cc : static_cast<Condition>(cc ^ 1);
+					a.Emit({ 0x4D, 0x8D, 0x64, 0x24, 0xE0 });			//lea r12, [r12-32]（不影响标志位）
+					fixups.push_back({ a.Jcc(branch), instructions[i + 1].tag });
+					fixups.push_back({ a.Jmp(), i + 2 });
+					fallthrough = false;
+				}
+				else
+				{
+					a.Emit({ 0x0F, static_cast<uint8_t>(0x90 | cc), 0xC0 });	//setcc al
+					a.Emit({ 0x0F, 0xB6, 0xC0 });						//movzx eax, al
+					a.Emit({ 0x41, 0xC6, 0x44, 0x24, 0xE0, Value::Boolean });	//mov byte [r12-32], Boolean
+					a.Emit({ 0x49, 0x89, 0x44, 0x24, 0xE8 });			//mov [r12-24], rax
+					a.Emit({ 0x49, 0x83, 0xEC, 0x10 });					//sub r12, 16
+				}
+				break;
+			}
+			case InstructionID::ARRAYREAD:
+			case InstructionID::ARRAYWRITE:
+			{
+				if (tag > 0x07FFFFFF)
+				{
+					callStep(i);
+					break;
+				}
+				//行列都是整数且不越界时直接访问阵列元素；越界、非阵列等情况交给通用实现
+				auto disp = static_cast<uint32_t>(tag * sizeof(Value));
+				int8_t rowAt = op == InstructionID::ARRAYREAD ? -32 : -48;
+				guardType(rowAt, Value::Integer, slow.at);
+				guardType(rowAt + 16, Value::Integer, slow.at);
+				a.Emit({ 0x41, 0x80, 0xBD });							//cmp byte [r13+disp32], Array
+				a.Emit32(disp);
+				a.Emit({ Value::Array });
+				slow.at.push_back(a.Jcc(CC_NE));
+				a.Emit({ 0x49, 0x8B, 0x95 });							//mov rdx, [r13+disp32+8]
+				a.Emit32(disp + 8);
+				if (op == InstructionID::ARRAYWRITE)
+				{
+					//老代阵列写入堆对象时需要写屏障，交给通用实现
+					a.Emit({ 0x80, 0x7A, HEAP_GENERATION, 0x00 });		//cmp byte [rdx+generation], 0
+					auto young = a.Jcc(CC_E);
+					a.Emit({ 0x41, 0x8A, 0x44, 0x24, 0xF0 });			//mov al, [r12-16]
+					a.Emit({ 0x3C, Value::String });					//cmp al, String
+					slow.at.push_back(a.Jcc(CC_E));
+					a.Emit({ 0x3C, Value::Array });						//cmp al, Array
+					slow.at.push_back(a.Jcc(CC_E));
+					a.Bind(young);
+				}
+				a.Emit({ 0x49, 0x8B, 0x44, 0x24, static_cast<uint8_t>(rowAt + 8) });	//mov rax, [r12+row]
+				a.Emit({ 0x49, 0x8B, 0x4C, 0x24, static_cast<uint8_t>(rowAt + 24) });	//mov rcx, [r12+col]
+				a.Emit({ 0x48, 0x3B, 0x42, ARRAY_ROW });				//cmp rax, [rdx+row]
+				a.Emit({ 0x0F, 0x83 });									//jae slow
+				slow.at.push_back(a.Size());
+				a.Emit32(0);
+				a.Emit({ 0x48, 0x3B, 0x4A, ARRAY_COL });				//cmp rcx, [rdx+col]
+				a.Emit({ 0x0F, 0x83 });									//jae slow
+				slow.at.push_back(a.Size());
+				a.Emit32(0);
+				a.Emit({ 0x48, 0x0F, 0xAF, 0x42, ARRAY_COL });			//imul rax, [rdx+col]
+				a.Emit({ 0x48, 0x01, 0xC8 });							//add rax, rcx
+				a.Emit({ 0x48, 0xC1, 0xE0, 0x04 });						//shl rax, 4
+				a.Emit({ 0x48, 0x01, 0xD0 });							//add rax, rdx
+				if (op == InstructionID::ARRAYREAD)
+				{
+					a.Emit({ 0x48, 0x8B, 0x48, ARRAY_DATA });			//mov rcx, [rax+data]
+					a.Emit({ 0x48, 0x8B, 0x40, ARRAY_DATA + 8 });		//mov rax, [rax+data+8]
+					//从未写入的大阵列元素全为零，类型改为逻辑假（值已是 0）
+					a.Emit({ 0x84, 0xC9 });								//test cl, cl
+					a.Emit({ 0x75, 0x02 });								//jnz +2
+					a.Emit({ 0xB1, Value::Boolean });					//mov cl, Boolean
+					a.Emit({ 0x49, 0x89, 0x4C, 0x24, 0xE0 });			//mov [r12-32], rcx
+					a.Emit({ 0x49, 0x89, 0x44, 0x24, 0xE8 });			//mov [r12-24], rax
+					a.Emit({ 0x49, 0x83, 0xEC, 0x10 });					//sub r12, 16
+				}
+				else
+				{
+					a.Emit({ 0x49, 0x8B, 0x4C, 0x24, 0xF0 });			//mov rcx, [r12-16]
+					a.Emit({ 0x48, 0x89, 0x48, ARRAY_DATA });			//mov [rax+data], rcx
+					a.Emit({ 0x49, 0x8B, 0x4C, 0x24, 0xF8 });			//mov rcx, [r12-8]
+					a.Emit({ 0x48, 0x89, 0x48, ARRAY_DATA + 8 });		//mov [rax+data+8], rcx
+					a.Emit({ 0x49, 0x83, 0xEC, 0x30 });					//sub r12, 48
+				}
+				break;
+			}
+			case InstructionID::JMPN:
+			case InstructionID::JMPC:
+				guardType(-16, Value::Boolean, slow.at);
+				a.Emit({ 0x49, 0x83, 0xEC, 0x10 });						//sub r12, 16
+				a.Emit({ 0x41, 0x80, 0x7C, 0x24, 0x08, 0x00 });			//cmp byte [r12+8], 0
+				fixups.push_back({ a.Jcc(op == InstructionID::JMPN ? CC_E : CC_NE), tag });
+				break;
+			case InstructionID::JMP:
+				fixups.push_back({ a.Jmp(), tag });
+				fallthrough = false;
+				break;
+			case InstructionID::RET:
+				//RET 总是转移控制，Step 不会返回空
+				callStep(i);
+				fallthrough = false;
+				break;
+			default:
+				callStep(i);
+				break;
+			}
+
+			if (!slow.at.empty())
+				slowPaths.push_back(slow);
+			if (fallthrough && (n + 1 >= region.size() || region[n + 1] != i + 1))
+				fixups.push_back({ a.Jmp(), i + 1 });
+		}
+
+		//慢速路径集中放在末尾，快速路径保持连续
+		for (auto& slow : slowPaths)
+		{
+			bindAll(slow.at);
+			callStep(slow.index);
+			fixups.push_back({ a.Jmp(), slow.index + 1 });
+		}
+
+		//跳转目标依次解析为：本次编译的指令、之前已编译的指令、退回解释器的出口
+		std::vector<std::pair<size_t, const uint8_t*>> absolutes;
+		std::unordered_map<size_t, size_t> exits;
+		for (size_t k = 0; k < fixups.size(); ++k)
+		{
+			auto fixup = fixups[k];
+			auto label = labels.find(fixup.index);
+			if (label != labels.end())
+			{
+				a.Patch(fixup.at, label->second);
+				continue;
+			}
+			if (fixup.index < count && mEntries[fixup.index] != nullptr)
+			{
+				absolutes.push_back(std::make_pair(fixup.at, mEntries[fixup.index]));
+				continue;
+			}
+			auto exit = exits.find(fixup.index);
+			if (exit == exits.end())
+			{
+				exit = exits.insert(std::make_pair(fixup.index, a.Size())).first;
+				a.Emit({ 0x48, 0xB8 });									//mov rax, ip
+				a.Emit64(reinterpret_cast<uint64_t>(instructions + (fixup.index - 1)));
+				a.Emit({ 0x48, 0x89, 0x43, IP });						//mov [rbx+ip], rax
+				a.Emit({ 0x4C, 0x89, 0x63, TOP });						//mov [rbx+calcTop], r12
+				absolutes.push_back(std::make_pair(a.Jmp(), mExitStub));
+			}
+			a.Patch(fixup.at, exit->second);
+		}
+
+		if (mCodeUsed + a.Size() > JIT_CODE_SIZE)
+		{
+			mFull = true;
+			return nullptr;
+		}
+		auto base = mCode + mCodeUsed;
+		for (auto& absolute : absolutes)
+			a.Patch(absolute.first, base, absolute.second);
+		if (!WriteCode(mCodeUsed, a.Data(), a.Size()))
+		{
+			mFull = true;
+			return nullptr;
+		}
+		mCodeUsed = (mCodeUsed + a.Size() + 15) & ~static_cast<size_t>(15);
+
+		for (auto i : region)
+			mEntries[i] = base + labels[i];
+		return mEntries[start];
+	}
+
+	#undef JIT_CONTEXT_OFFSET
+}
+#endif
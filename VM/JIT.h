@@ -0,0 +1,56 @@
+#pragma once
+#include "VM.h"
+
+#if defined(BYTE_CODE_VM_JIT)
+#include <exception>
+
+namespace VM
+{
+	//基线模板 JIT（x86-64）
+	//  函数入口或循环头执行次数达到阈值后，从该位置沿控制流收集尚未编译的指令，按每条指令的机器码模板拼接成本机代码。
+	//  所有模板都遵循同一约定：rbx 指向 Context，r12 为计算栈顶，r13 为当前栈帧，
+	//  因此任意指令边界都可以进入或退出机器码，不需要额外的状态转换。
+	//  整数/实数运算、比较跳转、读写变量、常量和阵列元素有内联快速路径，类型不符或其它指令调用 Engine 的通用实现。
+	class JIT
+	{
+	public:
+		JIT(Engine* engine);
+		JIT(const JIT&) = delete;
+		~JIT();
+	public:
+		//解释器执行 CALL 或向后跳转之后调用，此时 mIP 指向下一条指令的前一条；
+		//若该位置已编译（或刚好达到阈值并编译成功）则转入机器码，返回时 mIP 已指向解释器应继续执行位置的前一条
+		void Enter(void);
+	private:
+		typedef struct
+		{
+			Value* calcTop;
+			Value* calcLimit;
+			Value* dataFrame;
+			const void* ip;
+			JIT* jit;
+		}Context;
+		typedef int (*PFN_TRAMPOLINE)(Context* context, const void* entry);
+	private:
+		bool WriteCode(size_t offset, const uint8_t* bytes, size_t size);
+		bool EmitTrampoline(void);
+		const uint8_t* Lookup(size_t index);
+		const uint8_t* Compile(size_t start);
+		void SyncOut(Context* context);
+		const void* Continue(Context* context, size_t next);
+		static const void* Step(Context* context, size_t index);
+	private:
+		Engine* mEngine;
+		uint8_t* mCode;
+		size_t mCodeUsed;
+		bool mFull;
+		PFN_TRAMPOLINE mTrampoline;
+		const uint8_t* mExitStub;
+		const uint8_t* mErrorStub;
+		std::vector<const uint8_t*> mEntries;
+		std::vector<uint32_t> mHotCounts;
+		Context mContext;
+		std::exception_ptr mException;
+	};
+}
+#endif
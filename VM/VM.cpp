@@ -1,24 +1,137 @@
 ﻿#include "VM.h"
-#include <locale>
-#include <codecvt>
+#include "JIT.h"
+#include "AOT.h"
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <deque>
+#include <chrono>
+#include <new>
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+//GC 标记时预取对象头，不支持的编译器上为空操作
+#if defined(__GNUC__) || defined(__clang__)
+#define GC_PREFETCH(p) __builtin_prefetch(p)
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define GC_PREFETCH(p) _mm_prefetch(reinterpret_cast<const char*>(p), _MM_HINT_T0)
+#else
+#define GC_PREFETCH(p) ((void)(p))
+#endif
 
 namespace VM
 {
+	const char* GetInstructionName(InstructionID id)
+	{
+		static const char* names[] =
+		{
+			"NOOP",
+			"ADD",
+			"AND",
+			"ALLOCDSTK",
+			"ARRAYMAKE",
+			"ARRAYREAD",
+			"ARRAYWRITE",
+			"CALL",
+			"CALLSYS",
+			"DIV",
+			"EQ",
+			"GT",
+			"JMP",
+			"JMPC",
+			"JMPN",
+			"LT",
+			"LC",
+			"LD",
+			"MOD",
+			"MUL",
+			"NE",
+			"NOT",
+			"OR",
+			"POP",
+			"PUSH",
+			"RET",
+			"SUB",
+			"SD",
+			"HALT",
+			"ADD_II",
+			"ADD_RR",
+			"ADD_SS",
+			"SUB_II",
+			"SUB_RR",
+			"MUL_II",
+			"MUL_RR",
+			"DIV_II",
+			"DIV_RR",
+			"LT_II",
+			"LT_RR",
+			"GT_II",
+			"GT_RR",
+			"EQ_II",
+			"EQ_RR",
+			"PROFILE",
+			"LD_LC_ADD_SD",
+			"LD_LD_ADD_SD",
+			"LD_LC_SUB_SD",
+			"LD_LD_LT_JMPN",
+			"LD_LC_LT_JMPN",
+			"LD_LD_GT_JMPN",
+			"LD_LC_GT_JMPN",
+			"LDG",
+			"STG"
+		};
+		static_assert(sizeof(names) / sizeof(names[0]) == static_cast<size_t>(InstructionID::INSTRUCTION_COUNT), "instruction name table size mismatch");
+		auto i = static_cast<size_t>(id);
+		if (i >= static_cast<size_t>(InstructionID::INSTRUCTION_COUNT))
+			return "UNKNOWN";
+		return names[i];
+	}
+
 	Engine::Engine() :
+		mDispatchTable(nullptr),
 		mConstants(),
+		mConstantArrays(),
 		mInstructionCount(0),
 		mInstructions(nullptr),
+		mOpcodes(),
 		mIP(nullptr),
 		mCallParameters(),
 		mCallStack(),
 		mCALCStack(),
-		mDATAStack(nullptr),
+		mCALCTop(nullptr),
+		mCALCLimit(nullptr),
+		mDATAStack(),
+		mDATABase(0),
+		mDATAWatermark(0),
+		mGlobalVariables(),
 		mGlobalVariableTable(),
+		mConstantGlobals(),
+		mReadGlobalHostCall(static_cast<size_t>(-1)),
+		mWriteGlobalHostCall(static_cast<size_t>(-1)),
+		mQuickeningSites(),
+		mProfiling(false),
+		mProfileLast(nullptr),
+		mProfileHistory(),
+		mProfileHistoryLength(0),
+		mOpcodeNGrams(),
+		mJITEnabled(true),
+		mAllocationSites(false),
+		mJIT(nullptr),
+		mNativeEntry(nullptr),
 		mGC()
 	{
 		mCallParameters.reserve(1024);
+		mDATAStack.reserve(4096);
+		CALCStackGrow();
+		InitDispatchTable();
 	}
 
 	Engine::~Engine()
@@ -33,6 +146,12 @@ namespace VM
 		return r;
 	}
 
+	void Engine::SetGlobalVariableHostCalls(size_t read, size_t write)
+	{
+		mReadGlobalHostCall = read;
+		mWriteGlobalHostCall = write;
+	}
+
 	void Engine::LoadProgram(std::fstream& in)
 	{
 		const uint8_t file_flag[] = { 0xDA,0xE6,0x9F,0xF3,0xF6,0x98,0x54,0x48,0xB0,0xCB,0x65,0x9E,0xF6,0xB8,0x38,0xCE };
@@ -51,30 +170,70 @@ namespace VM
 			mConstants.push_back(ReadValue(in));
 		}
 
-		mInstructions = new Instruction[instructionCount];
+		//末尾追加两条 HALT：顺序执行到末尾，或顶层 RET 返回到末尾后，都会落在 HALT 上，解释器无需逐条检查边界
+		mInstructions = new Instruction[instructionCount + 2];
 		Instruction* instruction = mInstructions;
+		mOpcodes.reserve(instructionCount);
 		for (uint32_t i = 0; i < instructionCount; ++i)
 		{
-			ReadInstruction(in, instruction++);
+			mOpcodes.push_back(ReadInstruction(in, instruction++));
+		}
+		for (uint32_t i = 0; i < 2; ++i)
+		{
+			instruction->handler = mDispatchTable[static_cast<size_t>(InstructionID::HALT)];
+			instruction->tag = 0;
+			++instruction;
 		}
 		mInstructionCount = instructionCount;
+		VerifyFrames();
+		mQuickeningSites.resize(instructionCount);
+		if (mProfiling)
+		{
+			for (uint32_t i = 0; i < instructionCount; ++i)
+				mInstructions[i].handler = mDispatchTable[static_cast<size_t>(InstructionID::PROFILE)];
+		}
+		else
+		{
+			FuseInstructions();
+			BindGlobalVariables();
+		}
+#if defined(BYTE_CODE_VM_JIT)
+		if (mJITEnabled && !mProfiling && !mAllocationSites)
+			mJIT = new JIT(this);
+#endif
+		mGC.Start();
+		mGC.TrackAllocationSites(mAllocationSites ? this : nullptr);
+	}
+
+	void Engine::LoadProgram(const NativeProgram& program)
+	{
+		ClearProgram();
+		std::istringstream in(std::string(reinterpret_cast<const char*>(program.constants), program.constantsSize), std::ios::binary);
+		for (uint32_t i = 0; i < program.constantCount; ++i)
+		{
+			mConstants.push_back(ReadValue(in));
+		}
+		mNativeEntry = program.entry;
+		mGC.Start();
+		//本机程序没有指令序号，不跟踪分配位置
+		mGC.TrackAllocationSites(nullptr);
 	}
 
-	InstructionID Engine::ReadIID(std::fstream& in)
+	InstructionID Engine::ReadIID(std::istream& in)
 	{
 		auto id = ReadNumber<uint16_t>(in);
 		return static_cast<InstructionID>(id);
 	}
 
 	template<class TNumber>
-	TNumber Engine::ReadNumber(std::fstream& in)
+	TNumber Engine::ReadNumber(std::istream& in)
 	{
 		TNumber value;
 		in.read(reinterpret_cast<char*>(&value), sizeof(value));
 		return value;
 	}
 
-	uint64_t Engine::Read7BitInt(std::fstream& in)
+	uint64_t Engine::Read7BitInt(std::istream& in)
 	{
 		uint64_t mask = 0x7F;
 		uint64_t temp = 0;
@@ -94,152 +253,73 @@ namespace VM
 		return result;
 	}
 
-	void Engine::ReadString(std::fstream& in, std::wstring& value)
+	Value Engine::ReadString(std::istream& in)
 	{
-		std::wstring_convert<std::codecvt_utf8<wchar_t>> strCnv;
 		auto len = static_cast<size_t>(Read7BitInt(in));
 		std::vector<char> utf8;
 		utf8.resize(len);
 		in.read(utf8.data(), len);
-		value = strCnv.from_bytes(utf8.data(), utf8.data() + utf8.size());
+		return mGC.RawMemory().NewUTF8Value(utf8.data(), utf8.size());
 	}
 
-	bool Engine::ReadBoolean(std::fstream& in)
+	bool Engine::ReadBoolean(std::istream& in)
 	{
 		uint8_t bytes[2];
 		ReadBytes(in, bytes, sizeof(bytes));
 		return bytes[0] == 0x00 && bytes[1] == 0xFF;
 	}
 
-	void Engine::ReadBytes(std::fstream& in, void* buffer, size_t size)
+	void Engine::ReadBytes(std::istream& in, void* buffer, size_t size)
 	{
 		in.read(reinterpret_cast<char*>(buffer), size);
 	}
-	void Engine::ReadInstruction(std::fstream& in, Instruction* instruction)
+	InstructionID Engine::ReadInstruction(std::istream& in, Instruction* instruction)
 	{
 		auto iid = ReadIID(in);
 		switch (iid)
 		{
 		case InstructionID::NOOP:
-			instruction->func = &Engine::InstructionNOOP;
-			instruction->tag = 0;
-			break;
 		case InstructionID::ADD:
-			instruction->func = &Engine::InstructionADD;
-			instruction->tag = 0;
-			break;
 		case InstructionID::AND:
-			instruction->func = &Engine::InstructionAND;
-			instruction->tag = 0;
-			break;
-		case InstructionID::ALLOCDSTK:
-			instruction->func = &Engine::InstructionALLOCDSTK;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
 		case InstructionID::ARRAYMAKE:
-			instruction->func = &Engine::InstructionARRAYMAKE;
-			instruction->tag = 0;
-			break;
-		case InstructionID::ARRAYREAD:
-			instruction->func = &Engine::InstructionARRAYREAD;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::ARRAYWRITE:
-			instruction->func = &Engine::InstructionARRAYWRITE;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::CALL:
-			instruction->func = &Engine::InstructionCALL;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::CALLSYS:
-			instruction->func = &Engine::InstructionCALLSYS;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
 		case InstructionID::DIV:
-			instruction->func = &Engine::InstructionDIV;
-			instruction->tag = 0;
-			break;
 		case InstructionID::EQ:
-			instruction->func = &Engine::InstructionEQ;
-			instruction->tag = 0;
-			break;
 		case InstructionID::GT:
-			instruction->func = &Engine::InstructionGT;
-			instruction->tag = 0;
-			break;
-		case InstructionID::JMP:
-			instruction->func = &Engine::InstructionJMP;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::JMPC:
-			instruction->func = &Engine::InstructionJMPC;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::JMPN:
-			instruction->func = &Engine::InstructionJMPN;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
 		case InstructionID::LT:
-			instruction->func = &Engine::InstructionLT;
-			instruction->tag = 0;
-			break;
-		case InstructionID::LC:
-			instruction->func = &Engine::InstructionLC;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
-		case InstructionID::LD:
-			instruction->func = &Engine::InstructionLD;
-			instruction->tag = static_cast<size_t>(Read7BitInt(in));
-			break;
 		case InstructionID::MOD:
-			instruction->func = &Engine::InstructionMOD;
-			instruction->tag = 0;
-			break;
 		case InstructionID::MUL:
-			instruction->func = &Engine::InstructionMUL;
-			instruction->tag = 0;
-			break;
 		case InstructionID::NE:
-			instruction->func = &Engine::InstructionNE;
-			instruction->tag = 0;
-			break;
 		case InstructionID::NOT:
-			instruction->func = &Engine::InstructionNOT;
-			instruction->tag = 0;
-			break;
 		case InstructionID::OR:
-			instruction->func = &Engine::InstructionOR;
-			instruction->tag = 0;
-			break;
 		case InstructionID::POP:
-			instruction->func = &Engine::InstructionPOP;
-			instruction->tag = 0;
-			break;
 		case InstructionID::PUSH:
-			instruction->func = &Engine::InstructionPUSH;
-			instruction->tag = 0;
-			break;
 		case InstructionID::RET:
-			instruction->func = &Engine::InstructionRET;
-			instruction->tag = 0;
-			break;
 		case InstructionID::SUB:
-			instruction->func = &Engine::InstructionSUB;
 			instruction->tag = 0;
 			break;
+		case InstructionID::ALLOCDSTK:
+		case InstructionID::ARRAYREAD:
+		case InstructionID::ARRAYWRITE:
+		case InstructionID::CALL:
+		case InstructionID::CALLSYS:
+		case InstructionID::JMP:
+		case InstructionID::JMPC:
+		case InstructionID::JMPN:
+		case InstructionID::LC:
+		case InstructionID::LD:
 		case InstructionID::SD:
-			instruction->func = &Engine::InstructionSD;
 			instruction->tag = static_cast<size_t>(Read7BitInt(in));
 			break;
 		default:
 			throw Exception(10003, "Unrecognized instruction.");
 		}
+		instruction->handler = mDispatchTable[static_cast<size_t>(iid)];
+		return iid;
 	}
 
-	Value* Engine::ReadValue(std::fstream& in)
+	Value Engine::ReadValue(std::istream& in)
 	{
-		Value* result = nullptr;
+		Value result;
 		uint8_t type[2];
 		ReadBytes(in, type, sizeof(type));
 		if (type[1] == 0)
@@ -254,9 +334,10 @@ namespace VM
 				break;
 			case Value::String:
 			{
-				std::wstring s;
-				ReadString(in, s);
-				result = mGC.RawMemory().NewValue(s);
+				//常量字符串都驻留，相同的常量共用一个对象
+				auto s = ReadString(in);
+				result = mGC.InternString(s);
+				mGC.RawMemory().FreeValue(s);
 			}
 			break;
 			case Value::Boolean:
@@ -266,16 +347,17 @@ namespace VM
 			{
 				size_t rx = static_cast<size_t>(Read7BitInt(in));
 				size_t cx = static_cast<size_t>(Read7BitInt(in));
-				auto arr = mGC.RawMemory().NewValue(rx, cx, nullptr);
+				auto arr = mGC.RawMemory().NewValue(rx, cx);
 				try
 				{
 					for (size_t r = 0; r < rx; ++r)
 					{
 						for (size_t c = 0; c < cx; ++c)
 						{
-							arr->SetValue(r, c, ReadValue(in));
+							arr.SetValue(r, c, ReadValue(in));
 						}
 					}
+					mConstantArrays.push_back(arr.mValue.hValue);
 					result = arr;
 				}
 				catch (const Exception&)
@@ -297,159 +379,566 @@ namespace VM
 		return result;
 	}
 
+	//数据栈按下标直接访问，不再逐次检查边界：加载时沿控制流求出每条指令所在栈帧的大小
+	//  （ALLOCDSTK 之后为其大小，程序入口和函数入口为 0，多条路径汇合时取最小值），
+	//  访问数据栈的指令下标超出栈帧时拒绝加载。解释器、超级指令、JIT 和 AOT 都依赖这一检查
+	void Engine::VerifyFrames(void)
+	{
+		const size_t UNREACHED = static_cast<size_t>(-1);
+		std::vector<size_t> frames(mInstructionCount, UNREACHED);
+		std::vector<std::pair<size_t, size_t>> pending;
+		pending.push_back({ 0, 0 });
+		for (size_t i = 0; i < mInstructionCount; ++i)
+		{
+			if (mOpcodes[i] == InstructionID::CALL)
+				pending.push_back({ mInstructions[i].tag, 0 });
+		}
+		while (!pending.empty())
+		{
+			auto i = pending.back().first;
+			auto frame = pending.back().second;
+			pending.pop_back();
+			//顺序执行到末尾或跳转到末尾后落在 HALT 上
+			if (i >= mInstructionCount || frames[i] <= frame)
+				continue;
+			frames[i] = frame;
+			auto tag = mInstructions[i].tag;
+			switch (mOpcodes[i])
+			{
+			case InstructionID::ALLOCDSTK:
+				pending.push_back({ i + 1, tag });
+				break;
+			case InstructionID::JMP:
+				pending.push_back({ tag, frame });
+				break;
+			case InstructionID::JMPC:
+			case InstructionID::JMPN:
+				pending.push_back({ tag, frame });
+				pending.push_back({ i + 1, frame });
+				break;
+			case InstructionID::RET:
+				break;
+			default:
+				//CALL 返回后仍在调用者的栈帧中
+				pending.push_back({ i + 1, frame });
+				break;
+			}
+		}
+		for (size_t i = 0; i < mInstructionCount; ++i)
+		{
+			switch (mOpcodes[i])
+			{
+			case InstructionID::LD:
+			case InstructionID::SD:
+			case InstructionID::ARRAYREAD:
+			case InstructionID::ARRAYWRITE:
+				if (frames[i] != UNREACHED && mInstructions[i].tag >= frames[i])
+					throw Exception(10004, "Data stack index out of bounds.");
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
 	void Engine::ClearProgram(void)
 	{
+#if defined(BYTE_CODE_VM_JIT)
+		delete mJIT;
+#endif
+		mJIT = nullptr;
+		mNativeEntry = nullptr;
+
+		//驻留的字符串由 MemoryGC 释放
 		for (auto v : mConstants)
 		{
-			mGC.RawMemory().FreeValue(v);
+			if (!v.Is(Value::String))
+				mGC.RawMemory().FreeValue(v);
 		}
 		mConstants.clear();
+		mConstantArrays.clear();
 
 		if (mInstructions != nullptr)
 			delete[] mInstructions;
 		mInstructions = nullptr;
 		mInstructionCount = 0;
+		mOpcodes.clear();
+		mQuickeningSites.clear();
+		mOpcodeNGrams.clear();
+		mProfileLast = nullptr;
+		mProfileHistoryLength = 0;
 
 		mIP = 0;
 
-		for (auto n : mCallStack)
-		{
-			n.datastack->clear();
-			delete n.datastack;
-		}
 		mCallStack.clear();
 
-		mCALCStack.clear();
+		mCALCTop = mCALCStack.data();
 
-		mDATAStack = nullptr;
+		mDATAStack.clear();
+		mDATABase = 0;
+		mDATAWatermark = 0;
 
 		mCallParameters.clear();
 
 		mGlobalVariableTable.clear();
+		mGlobalVariables.clear();
+		mConstantGlobals.clear();
 
+		mGC.ClearInterned();
 		mGC.Clean();
 	}
 
 	int Engine::Run(void)
 	{
+		if (mNativeEntry != nullptr)
+		{
+			try
+			{
+				mNativeEntry(this);
+			}
+			catch (const AOT::HaltSignal&)
+			{
+			}
+			return static_cast<int>(CALCStackPop().AsReal());
+		}
 		mIP = mInstructions;
 		const Instruction* end = mInstructions + mInstructionCount;
 		CallNode cn =
 		{
 			end,
-			nullptr
+			0
 		};
 		mCallStack.push_back(cn);
-		mGC.Start();
+#if defined(BYTE_CODE_VM_CALL_DISPATCH)
 		while (mIP < end)
 		{
-			(this->*(mIP->func))(mIP->tag);
+			(this->*(mIP->handler))(mIP->tag);
 			++mIP;
-			mGC.CheckMemoryGC(this);
 		}
-		return static_cast<int>(CALCStackPop()->AsReal());
+#else
+		Execute(false);
+#endif
+		return static_cast<int>(CALCStackPop().AsReal());
+	}
+
+#if defined(BYTE_CODE_VM_CALL_DISPATCH)
+	void Engine::InitDispatchTable(void)
+	{
+		static const InstructionHandler table[] =
+		{
+			&Engine::InstructionNOOP,
+			&Engine::InstructionADD,
+			&Engine::InstructionAND,
+			&Engine::InstructionALLOCDSTK,
+			&Engine::InstructionARRAYMAKE,
+			&Engine::InstructionARRAYREAD,
+			&Engine::InstructionARRAYWRITE,
+			&Engine::InstructionCALL,
+			&Engine::InstructionCALLSYS,
+			&Engine::InstructionDIV,
+			&Engine::InstructionEQ,
+			&Engine::InstructionGT,
+			&Engine::InstructionJMP,
+			&Engine::InstructionJMPC,
+			&Engine::InstructionJMPN,
+			&Engine::InstructionLT,
+			&Engine::InstructionLC,
+			&Engine::InstructionLD,
+			&Engine::InstructionMOD,
+			&Engine::InstructionMUL,
+			&Engine::InstructionNE,
+			&Engine::InstructionNOT,
+			&Engine::InstructionOR,
+			&Engine::InstructionPOP,
+			&Engine::InstructionPUSH,
+			&Engine::InstructionRET,
+			&Engine::InstructionSUB,
+			&Engine::InstructionSD,
+			&Engine::InstructionNOOP,
+			&Engine::InstructionADD_II,
+			&Engine::InstructionADD_RR,
+			&Engine::InstructionADD_SS,
+			&Engine::InstructionSUB_II,
+			&Engine::InstructionSUB_RR,
+			&Engine::InstructionMUL_II,
+			&Engine::InstructionMUL_RR,
+			&Engine::InstructionDIV_II,
+			&Engine::InstructionDIV_RR,
+			&Engine::InstructionLT_II,
+			&Engine::InstructionLT_RR,
+			&Engine::InstructionGT_II,
+			&Engine::InstructionGT_RR,
+			&Engine::InstructionEQ_II,
+			&Engine::InstructionEQ_RR,
+			&Engine::InstructionPROFILE,
+			&Engine::InstructionLD_LC_ADD_SD,
+			&Engine::InstructionLD_LD_ADD_SD,
+			&Engine::InstructionLD_LC_SUB_SD,
+			&Engine::InstructionLD_LD_LT_JMPN,
+			&Engine::InstructionLD_LC_LT_JMPN,
+			&Engine::InstructionLD_LD_GT_JMPN,
+			&Engine::InstructionLD_LC_GT_JMPN,
+			&Engine::InstructionLDG,
+			&Engine::InstructionSTG
+		};
+		static_assert(sizeof(table) / sizeof(table[0]) == static_cast<size_t>(InstructionID::INSTRUCTION_COUNT), "dispatch table size mismatch");
+		mDispatchTable = table;
+	}
+#else
+	void Engine::InitDispatchTable(void)
+	{
+		Execute(true);
 	}
 
+#if defined(BYTE_CODE_VM_COMPUTED_GOTO)
+#define VM_HANDLER_ADDRESS(name) &&VM_LABEL_##name
+#define VM_HANDLER(name) VM_LABEL_##name:
+#define VM_DISPATCH_BEGIN() goto *(mIP->handler);
+#define VM_DISPATCH_END()
+#define VM_NEXT() ++mIP; goto *(mIP->handler)
+#define VM_REDISPATCH(id) goto *(mDispatchTable[static_cast<size_t>(id)])
+#else
+#define VM_HANDLER_ADDRESS(name) static_cast<InstructionHandler>(InstructionID::name)
+#define VM_HANDLER(name) case InstructionID::name:
+#define VM_DISPATCH_BEGIN() for (InstructionHandler handler = mIP->handler;; handler = mIP->handler) { VM_LABEL_REDISPATCH: switch (static_cast<InstructionID>(handler)) {
+#define VM_DISPATCH_END() default: throw Exception(10003, "Unrecognized instruction."); } }
+#define VM_NEXT() ++mIP; continue
+#define VM_REDISPATCH(id) handler = static_cast<InstructionHandler>(id); goto VM_LABEL_REDISPATCH
+#endif
+//CALL 之后与向后跳转之后是 JIT 的入口：已编译或已变热时转入机器码，返回后从更新过的 mIP 继续解释
+#if defined(BYTE_CODE_VM_JIT)
+#define VM_JIT_ENTER() if (mJIT != nullptr) mJIT->Enter()
+#else
+#define VM_JIT_ENTER()
+#endif
 
-	void Engine::SetGlobalVariable(const std::wstring& name, Value* value)
+	void Engine::Execute(bool exportDispatchTable)
 	{
-		mGlobalVariableTable[name] = value;
+		static const InstructionHandler table[] =
+		{
+			VM_HANDLER_ADDRESS(NOOP),
+			VM_HANDLER_ADDRESS(ADD),
+			VM_HANDLER_ADDRESS(AND),
+			VM_HANDLER_ADDRESS(ALLOCDSTK),
+			VM_HANDLER_ADDRESS(ARRAYMAKE),
+			VM_HANDLER_ADDRESS(ARRAYREAD),
+			VM_HANDLER_ADDRESS(ARRAYWRITE),
+			VM_HANDLER_ADDRESS(CALL),
+			VM_HANDLER_ADDRESS(CALLSYS),
+			VM_HANDLER_ADDRESS(DIV),
+			VM_HANDLER_ADDRESS(EQ),
+			VM_HANDLER_ADDRESS(GT),
+			VM_HANDLER_ADDRESS(JMP),
+			VM_HANDLER_ADDRESS(JMPC),
+			VM_HANDLER_ADDRESS(JMPN),
+			VM_HANDLER_ADDRESS(LT),
+			VM_HANDLER_ADDRESS(LC),
+			VM_HANDLER_ADDRESS(LD),
+			VM_HANDLER_ADDRESS(MOD),
+			VM_HANDLER_ADDRESS(MUL),
+			VM_HANDLER_ADDRESS(NE),
+			VM_HANDLER_ADDRESS(NOT),
+			VM_HANDLER_ADDRESS(OR),
+			VM_HANDLER_ADDRESS(POP),
+			VM_HANDLER_ADDRESS(PUSH),
+			VM_HANDLER_ADDRESS(RET),
+			VM_HANDLER_ADDRESS(SUB),
+			VM_HANDLER_ADDRESS(SD),
+			VM_HANDLER_ADDRESS(HALT),
+			VM_HANDLER_ADDRESS(ADD_II),
+			VM_HANDLER_ADDRESS(ADD_RR),
+			VM_HANDLER_ADDRESS(ADD_SS),
+			VM_HANDLER_ADDRESS(SUB_II),
+			VM_HANDLER_ADDRESS(SUB_RR),
+			VM_HANDLER_ADDRESS(MUL_II),
+			VM_HANDLER_ADDRESS(MUL_RR),
+			VM_HANDLER_ADDRESS(DIV_II),
+			VM_HANDLER_ADDRESS(DIV_RR),
+			VM_HANDLER_ADDRESS(LT_II),
+			VM_HANDLER_ADDRESS(LT_RR),
+			VM_HANDLER_ADDRESS(GT_II),
+			VM_HANDLER_ADDRESS(GT_RR),
+			VM_HANDLER_ADDRESS(EQ_II),
+			VM_HANDLER_ADDRESS(EQ_RR),
+			VM_HANDLER_ADDRESS(PROFILE),
+			VM_HANDLER_ADDRESS(LD_LC_ADD_SD),
+			VM_HANDLER_ADDRESS(LD_LD_ADD_SD),
+			VM_HANDLER_ADDRESS(LD_LC_SUB_SD),
+			VM_HANDLER_ADDRESS(LD_LD_LT_JMPN),
+			VM_HANDLER_ADDRESS(LD_LC_LT_JMPN),
+			VM_HANDLER_ADDRESS(LD_LD_GT_JMPN),
+			VM_HANDLER_ADDRESS(LD_LC_GT_JMPN),
+			VM_HANDLER_ADDRESS(LDG),
+			VM_HANDLER_ADDRESS(STG)
+		};
+		static_assert(sizeof(table) / sizeof(table[0]) == static_cast<size_t>(InstructionID::INSTRUCTION_COUNT), "dispatch table size mismatch");
+
+		if (exportDispatchTable)
+		{
+			mDispatchTable = table;
+			return;
+		}
+
+		VM_DISPATCH_BEGIN()
+		VM_HANDLER(NOOP) VM_NEXT();
+		VM_HANDLER(ADD) InstructionADD(mIP->tag); VM_NEXT();
+		VM_HANDLER(AND) InstructionAND(mIP->tag); VM_NEXT();
+		VM_HANDLER(ALLOCDSTK) InstructionALLOCDSTK(mIP->tag); VM_NEXT();
+		VM_HANDLER(ARRAYMAKE) InstructionARRAYMAKE(mIP->tag); VM_NEXT();
+		VM_HANDLER(ARRAYREAD) InstructionARRAYREAD(mIP->tag); VM_NEXT();
+		VM_HANDLER(ARRAYWRITE) InstructionARRAYWRITE(mIP->tag); VM_NEXT();
+		VM_HANDLER(CALL) InstructionCALL(mIP->tag); VM_JIT_ENTER(); VM_NEXT();
+		VM_HANDLER(CALLSYS) InstructionCALLSYS(mIP->tag); VM_NEXT();
+		VM_HANDLER(DIV) InstructionDIV(mIP->tag); VM_NEXT();
+		VM_HANDLER(EQ) InstructionEQ(mIP->tag); VM_NEXT();
+		VM_HANDLER(GT) InstructionGT(mIP->tag); VM_NEXT();
+		VM_HANDLER(JMP) { auto from = mIP; InstructionJMP(mIP->tag); if (mIP < from) VM_JIT_ENTER(); } VM_NEXT();
+		VM_HANDLER(JMPC) InstructionJMPC(mIP->tag); VM_NEXT();
+		VM_HANDLER(JMPN) InstructionJMPN(mIP->tag); VM_NEXT();
+		VM_HANDLER(LT) InstructionLT(mIP->tag); VM_NEXT();
+		VM_HANDLER(LC) InstructionLC(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD) InstructionLD(mIP->tag); VM_NEXT();
+		VM_HANDLER(MOD) InstructionMOD(mIP->tag); VM_NEXT();
+		VM_HANDLER(MUL) InstructionMUL(mIP->tag); VM_NEXT();
+		VM_HANDLER(NE) InstructionNE(mIP->tag); VM_NEXT();
+		VM_HANDLER(NOT) InstructionNOT(mIP->tag); VM_NEXT();
+		VM_HANDLER(OR) InstructionOR(mIP->tag); VM_NEXT();
+		VM_HANDLER(POP) InstructionPOP(mIP->tag); VM_NEXT();
+		VM_HANDLER(PUSH) InstructionPUSH(mIP->tag); VM_NEXT();
+		VM_HANDLER(RET) InstructionRET(mIP->tag); VM_NEXT();
+		VM_HANDLER(SUB) InstructionSUB(mIP->tag); VM_NEXT();
+		VM_HANDLER(SD) InstructionSD(mIP->tag); VM_NEXT();
+		VM_HANDLER(HALT) return;
+		VM_HANDLER(ADD_II) InstructionADD_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(ADD_RR) InstructionADD_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(ADD_SS) InstructionADD_SS(mIP->tag); VM_NEXT();
+		VM_HANDLER(SUB_II) InstructionSUB_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(SUB_RR) InstructionSUB_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(MUL_II) InstructionMUL_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(MUL_RR) InstructionMUL_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(DIV_II) InstructionDIV_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(DIV_RR) InstructionDIV_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(LT_II) InstructionLT_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(LT_RR) InstructionLT_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(GT_II) InstructionGT_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(GT_RR) InstructionGT_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(EQ_II) InstructionEQ_II(mIP->tag); VM_NEXT();
+		VM_HANDLER(EQ_RR) InstructionEQ_RR(mIP->tag); VM_NEXT();
+		VM_HANDLER(PROFILE) ProfileInstruction(); VM_REDISPATCH(mOpcodes[mIP - mInstructions]);
+		VM_HANDLER(LD_LC_ADD_SD) InstructionLD_LC_ADD_SD(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LD_ADD_SD) InstructionLD_LD_ADD_SD(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LC_SUB_SD) InstructionLD_LC_SUB_SD(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LD_LT_JMPN) InstructionLD_LD_LT_JMPN(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LC_LT_JMPN) InstructionLD_LC_LT_JMPN(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LD_GT_JMPN) InstructionLD_LD_GT_JMPN(mIP->tag); VM_NEXT();
+		VM_HANDLER(LD_LC_GT_JMPN) InstructionLD_LC_GT_JMPN(mIP->tag); VM_NEXT();
+		VM_HANDLER(LDG) InstructionLDG(mIP->tag); VM_NEXT();
+		VM_HANDLER(STG) InstructionSTG(mIP->tag); VM_NEXT();
+		VM_DISPATCH_END()
 	}
 
-	Value* Engine::GetGlobalVariable(const std::wstring& name)
+#undef VM_HANDLER_ADDRESS
+#undef VM_HANDLER
+#undef VM_DISPATCH_BEGIN
+#undef VM_DISPATCH_END
+#undef VM_NEXT
+#undef VM_REDISPATCH
+#undef VM_JIT_ENTER
+#endif
+
+
+	GlobalSlot& Engine::GlobalVariable(const HeapValue* name)
 	{
 		auto it = mGlobalVariableTable.find(name);
+		if (it != mGlobalVariableTable.end())
+			return mGlobalVariables[it->second];
+		mGlobalVariableTable.emplace(name, mGlobalVariables.size());
+		GlobalSlot slot = { mGC.NewBooleanValue(false), false };
+		mGlobalVariables.push_back(slot);
+		return mGlobalVariables.back();
+	}
+
+	void Engine::SetGlobalVariable(const std::wstring& name, const Value& value)
+	{
+		auto& slot = GlobalVariable(mGC.InternString(name.data(), name.length()).mValue.hValue);
+		slot.value = value;
+		mGC.GCRememberGlobal(slot);
+	}
+
+	Value Engine::GetGlobalVariable(const std::wstring& name)
+	{
+		auto key = mGC.FindInternedString(name.data(), name.length());
+		auto it = key != nullptr ? mGlobalVariableTable.find(key) : mGlobalVariableTable.end();
 		if (it == mGlobalVariableTable.end())
 			return mGC.NewBooleanValue(false);
-		return it->second;
+		return mGlobalVariables[it->second].value;
 	}
 
-	void Engine::DATAStackAlloc(size_t size)
+	void Engine::SetGlobalVariable(const Value& name, const Value& value)
+	{
+		auto& slot = GlobalVariable(mGC.InternString(name).mValue.hValue);
+		slot.value = value;
+		mGC.GCRememberGlobal(slot);
+	}
+
+	Value Engine::GetGlobalVariable(const Value& name)
+	{
+		//变量名不存在时不驻留，程序拼出的临时名字不会一直占用内存
+		auto key = mGC.FindInternedString(name);
+		auto it = key != nullptr ? mGlobalVariableTable.find(key) : mGlobalVariableTable.end();
+		if (it == mGlobalVariableTable.end())
+			return mGC.NewBooleanValue(false);
+		return mGlobalVariables[it->second].value;
+	}
+
+	InstructionID Engine::GlobalVariableSite(size_t index) const
+	{
+		if (index + 1 >= mInstructionCount || mOpcodes[index] != InstructionID::LC || mOpcodes[index + 1] != InstructionID::CALLSYS)
+			return InstructionID::NOOP;
+		auto name = mInstructions[index].tag;
+		if (name >= mConstantGlobals.size() || mConstantGlobals[name] == nullptr)
+			return InstructionID::NOOP;
+		auto tag = mInstructions[index + 1].tag;
+		auto pc = (tag & 0xFFC00000) >> 22;
+		auto idx = tag & 0x003FFFFF;
+		if (idx == mReadGlobalHostCall && pc == 1)
+			return InstructionID::LDG;
+		if (idx == mWriteGlobalHostCall && pc == 2)
+			return InstructionID::STG;
+		return InstructionID::NOOP;
+	}
+
+	//与超级指令相同，只改写 LC 的处理函数并跳过其后的 CALLSYS；跳转到 CALLSYS 时仍按宿主函数调用执行，
+	//  宿主函数按变量名找到的是同一个槽位
+	void Engine::BindGlobalVariables(void)
 	{
-		mDATAStack = new std::vector<Value*>();
-		mDATAStack->reserve(size);
-		for (size_t i = 0; i < size; ++i)
+		mConstantGlobals.assign(mConstants.size(), nullptr);
+		for (size_t i = 0; i + 1 < mInstructionCount; ++i)
+		{
+			if (mOpcodes[i] != InstructionID::LC || mOpcodes[i + 1] != InstructionID::CALLSYS)
+				continue;
+			auto tag = mInstructions[i + 1].tag & 0x003FFFFF;
+			if (tag != mReadGlobalHostCall && tag != mWriteGlobalHostCall)
+				continue;
+			auto& name = mConstants[mInstructions[i].tag];
+			if (name.Is(Value::String))
+				mConstantGlobals[mInstructions[i].tag] = &GlobalVariable(name.mValue.hValue);
+		}
+		for (size_t i = 0; i + 1 < mInstructionCount; ++i)
 		{
-			mDATAStack->push_back(mGC.NewBooleanValue(false));
+			auto id = GlobalVariableSite(i);
+			if (id != InstructionID::NOOP)
+				mInstructions[i].handler = mDispatchTable[static_cast<size_t>(id)];
 		}
 	}
 
-	Value* Engine::DATAStackGet(size_t index)
+	void Engine::InstructionLDG(size_t tag)
 	{
-		return mDATAStack->at(index);
+		CALCStackPush(mConstantGlobals[tag]->value);
+		++mIP;
 	}
 
-	void Engine::DATAStackPut(size_t index, Value* value)
+	void Engine::InstructionSTG(size_t tag)
 	{
-		mDATAStack->at(index) = value;
+		//写入的值留在栈顶，作为宿主函数的返回值
+		auto& slot = *mConstantGlobals[tag];
+		slot.value = mCALCTop[-1];
+		mGC.GCRememberGlobal(slot);
+		++mIP;
 	}
 
-	Value* Engine::CALCStackPop(void)
+	void Engine::DATAStackAlloc(size_t size)
 	{
-		auto r = mCALCStack.back();
-		mCALCStack.pop_back();
-		return r;
+		//所有栈帧共用一段连续区域，新帧从当前栈顶开始，初始值为 false
+		mDATABase = mDATAStack.size();
+		mDATAStack.resize(mDATABase + size, mGC.NewBooleanValue(false));
+	}
+
+	const Value& Engine::DATAStackGet(size_t index)
+	{
+		return mDATAStack[mDATABase + index];
+	}
+
+	void Engine::DATAStackPut(size_t index, const Value& value)
+	{
+		mDATAStack[mDATABase + index] = value;
 	}
 
-	void Engine::CALCStackPush(Value* value)
+	Value Engine::CALCStackPop(void)
 	{
-		mCALCStack.push_back(value);
+		return *--mCALCTop;
+	}
+
+	void Engine::CALCStackPush(const Value& value)
+	{
+		if (mCALCTop == mCALCLimit)
+			CALCStackGrow();
+		*mCALCTop++ = value;
+	}
+
+	void Engine::CALCStackGrow(void)
+	{
+		//计算栈是一段定长存储区加栈顶指针，JIT 代码直接读写栈顶，满了才扩容
+		auto depth = static_cast<size_t>(mCALCTop - mCALCStack.data());
+		mCALCStack.resize(mCALCStack.empty() ? 1024 : mCALCStack.size() * 2);
+		mCALCTop = mCALCStack.data() + depth;
+		mCALCLimit = mCALCStack.data() + mCALCStack.size();
 	}
 
 	void Engine::InstructionAND(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		auto r = mGC.NewBooleanValue(a->AsBoolean() && b->AsBoolean());
+		auto r = mGC.NewBooleanValue(a.AsBoolean() && b.AsBoolean());
 		CALCStackPush(r);
 	}
 	void Engine::InstructionADD(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->GetType() == b->GetType())
+		Value r;
+		if (a.GetType() == b.GetType())
 		{
-			switch (a->GetType())
+			switch (a.GetType())
 			{
 			case Value::String:
 			{
-				std::wstring sa;
-				std::wstring sb;
-				a->AsString(sa);
-				b->AsString(sb);
-				r = mGC.NewStringValue(sa.append(sb));
+				r = mGC.NewStringValue(a, b);
 			}
 			break;
 			case Value::Integer:
 			{
-				r = mGC.NewIntegerValue(a->AsInteger() + b->AsInteger());
+				r = mGC.NewIntegerValue(a.AsInteger() + b.AsInteger());
 			}
 			break;
 			default:
 			{
-				r = mGC.NewRealValue(a->AsReal() + b->AsReal());
+				r = mGC.NewRealValue(a.AsReal() + b.AsReal());
 			}
 			break;
 			}
 		}
 		else
 		{
-			if (a->Is(Value::String) || b->Is(Value::String))
+			//另一侧先在栈上转换为字符串，再与字符串一侧拼接，长字符串不会被展开复制
+			wchar_t buffer[Value::TEXT_BUFFER_SIZE];
+			if (a.Is(Value::String))
+			{
+				r = mGC.NewStringValue(a, mGC.NewStringValue(buffer, b.FormatText(buffer)));
+			}
+			else if (b.Is(Value::String))
 			{
-				std::wstring sa;
-				std::wstring sb;
-				a->AsString(sa);
-				b->AsString(sb);
-				r = mGC.NewStringValue(sa.append(sb));
+				r = mGC.NewStringValue(mGC.NewStringValue(buffer, a.FormatText(buffer)), b);
 			}
 			else
 			{
-				r = mGC.NewRealValue(a->AsReal() + b->AsReal());
+				r = mGC.NewRealValue(a.AsReal() + b.AsReal());
 			}
 		}
 
 		CALCStackPush(r);
+		Quicken(InstructionID::ADD, a, b);
+		mGC.CheckMemoryGC(this);
 	}
 	void Engine::InstructionALLOCDSTK(size_t tag)
 	{
@@ -462,19 +951,20 @@ namespace VM
 		auto vr = CALCStackPop();
 
 		auto r = mGC.NewArrayValue(
-			static_cast<size_t>(vr->AsReal()),
-			static_cast<size_t>(vc->AsReal()),
+			static_cast<size_t>(vr.AsReal()),
+			static_cast<size_t>(vc.AsReal()),
 			vf);
 		CALCStackPush(r);
+		mGC.CheckMemoryGC(this);
 	}
 	void Engine::InstructionARRAYREAD(size_t tag)
 	{
 		auto vc = CALCStackPop();
 		auto vr = CALCStackPop();
 		auto d = DATAStackGet(tag);
-		auto r = d->GetValue(
-			static_cast<size_t>(vr->AsReal()),
-			static_cast<size_t>(vc->AsReal())
+		auto r = d.GetValue(
+			static_cast<size_t>(vr.AsReal()),
+			static_cast<size_t>(vc.AsReal())
 		);
 		CALCStackPush(r);
 	}
@@ -485,9 +975,9 @@ namespace VM
 		auto vr = CALCStackPop();
 
 		auto d = DATAStackGet(tag);
-		d->SetValue(
-			static_cast<size_t>(vr->AsReal()),
-			static_cast<size_t>(vc->AsReal()),
+		d.SetValue(
+			static_cast<size_t>(vr.AsReal()),
+			static_cast<size_t>(vc.AsReal()),
 			vv
 		);
 	}
@@ -496,7 +986,7 @@ namespace VM
 		CallNode cn =
 		{
 			mIP,
-			mDATAStack
+			mDATABase
 		};
 		mCallStack.push_back(cn);
 		mIP = mInstructions + (tag - 1);
@@ -515,47 +1005,47 @@ namespace VM
 		auto r = sc(this, pc, mCallParameters.data());
 		mCallParameters.clear();
 		CALCStackPush(r);
+		mGC.CheckMemoryGC(this);
 	}
 	void Engine::InstructionDIV(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->GetType() == b->GetType() && a->GetType() == Value::Integer)
+		Value r;
+		if (a.GetType() == b.GetType() && a.GetType() == Value::Integer)
 		{
-			r = mGC.NewIntegerValue(a->AsInteger() / b->AsInteger());
+			r = mGC.NewIntegerValue(a.AsInteger() / b.AsInteger());
 		}
 		else
 		{
-			r = mGC.NewRealValue(a->AsReal() / b->AsReal());
+			r = mGC.NewRealValue(a.AsReal() / b.AsReal());
 		}
 		CALCStackPush(r);
+		Quicken(InstructionID::DIV, a, b);
 	}
 	void Engine::InstructionEQ(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		auto r = mGC.NewBooleanValue(a->VEquals(b));
+		auto r = mGC.NewBooleanValue(a.VEquals(b));
 		CALCStackPush(r);
+		Quicken(InstructionID::EQ, a, b);
 	}
 	void Engine::InstructionGT(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->Is(Value::String) || b->Is(Value::String))
+		Value r;
+		if (a.Is(Value::String) || b.Is(Value::String))
 		{
-			std::wstring sa;
-			std::wstring sb;
-			a->AsString(sa);
-			b->AsString(sb);
-			r = mGC.NewBooleanValue(sa.size() > sb.size());
+			r = mGC.NewBooleanValue(a.StringLength() > b.StringLength());
 		}
 		else
 		{
-			r = mGC.NewBooleanValue(a->AsReal() > b->AsReal());
+			r = mGC.NewBooleanValue(a.AsReal() > b.AsReal());
 		}
 		CALCStackPush(r);
+		Quicken(InstructionID::GT, a, b);
 	}
 	void Engine::InstructionJMP(size_t tag)
 	{
@@ -564,33 +1054,30 @@ namespace VM
 	void Engine::InstructionJMPC(size_t tag)
 	{
 		auto a = CALCStackPop();
-		if (a->AsBoolean())
+		if (a.AsBoolean())
 			mIP = mInstructions + (tag - 1);
 	}
 	void Engine::InstructionJMPN(size_t tag)
 	{
 		auto a = CALCStackPop();
-		if (!a->AsBoolean())
+		if (!a.AsBoolean())
 			mIP = mInstructions + (tag - 1);
 	}
 	void Engine::InstructionLT(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->Is(Value::String) || b->Is(Value::String))
+		Value r;
+		if (a.Is(Value::String) || b.Is(Value::String))
 		{
-			std::wstring sa;
-			std::wstring sb;
-			a->AsString(sa);
-			b->AsString(sb);
-			r = mGC.NewBooleanValue(sa.size() < sb.size());
+			r = mGC.NewBooleanValue(a.StringLength() < b.StringLength());
 		}
 		else
 		{
-			r = mGC.NewBooleanValue(a->AsReal() < b->AsReal());
+			r = mGC.NewBooleanValue(a.AsReal() < b.AsReal());
 		}
 		CALCStackPush(r);
+		Quicken(InstructionID::LT, a, b);
 	}
 	void Engine::InstructionLC(size_t tag)
 	{
@@ -606,35 +1093,36 @@ namespace VM
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r = mGC.NewIntegerValue(a->AsInteger() % b->AsInteger());
+		Value r = mGC.NewIntegerValue(a.AsInteger() % b.AsInteger());
 		CALCStackPush(r);
 	}
 	void Engine::InstructionMUL(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->GetType() == b->GetType() && a->GetType() == Value::Integer)
+		Value r;
+		if (a.GetType() == b.GetType() && a.GetType() == Value::Integer)
 		{
-			r = mGC.NewIntegerValue(a->AsInteger() * b->AsInteger());
+			r = mGC.NewIntegerValue(a.AsInteger() * b.AsInteger());
 		}
 		else
 		{
-			r = mGC.NewRealValue(a->AsReal() * b->AsReal());
+			r = mGC.NewRealValue(a.AsReal() * b.AsReal());
 		}
 		CALCStackPush(r);
+		Quicken(InstructionID::MUL, a, b);
 	}
 	void Engine::InstructionNE(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		auto r = mGC.NewBooleanValue(!a->VEquals(b));
+		auto r = mGC.NewBooleanValue(!a.VEquals(b));
 		CALCStackPush(r);
 	}
 	void Engine::InstructionNOT(size_t tag)
 	{
 		auto a = CALCStackPop();
-		auto r = mGC.NewBooleanValue(!a->AsBoolean());
+		auto r = mGC.NewBooleanValue(!a.AsBoolean());
 		CALCStackPush(r);
 	}
 	void Engine::InstructionOR(size_t tag)
@@ -642,8 +1130,8 @@ namespace VM
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
 		auto r = mGC.NewBooleanValue(
-			a->AsBoolean() ||
-			b->AsBoolean());
+			a.AsBoolean() ||
+			b.AsBoolean());
 		CALCStackPush(r);
 	}
 	void Engine::InstructionPOP(size_t tag)
@@ -657,78 +1145,111 @@ namespace VM
 	void Engine::InstructionRET(size_t tag)
 	{
 		const CallNode& cn = mCallStack.back();
-		delete mDATAStack;
+		mDATAStack.resize(mDATABase);
 		mIP = cn.ip;
-		mDATAStack = cn.datastack;
+		mDATABase = cn.base;
+		if (mDATABase < mDATAWatermark)
+			mDATAWatermark = mDATABase;
 		mCallStack.pop_back();
 	}
 
-	static std::wstring& trim_end(std::wstring &s)
+	//字符串存储中的第 index 个字符
+	static uint32_t StorageChar(const void* data, uint16_t kind, size_t index)
 	{
-		if (s.empty())
-			return s;
-
-		s.erase(s.find_last_not_of(L" ") + 1);
-		return s;
+		switch (kind)
+		{
+		case HeapValue::STRING_LATIN1: return static_cast<const uint8_t*>(data)[index];
+		case HeapValue::STRING_UCS2: return static_cast<const char16_t*>(data)[index];
+		default: return static_cast<uint32_t>(static_cast<const wchar_t*>(data)[index]);
+		}
 	}
 
-	static std::wstring& trim_start(std::wstring &s)
+	//字符串开头、末尾的空格数
+	static size_t LeadingSpaces(const HeapValue* value)
 	{
-		if (s.empty())
-			return s;
+		size_t count = 0;
+		StringCursor cursor(value);
+		while (cursor.Fill())
+		{
+			for (size_t i = 0; i < cursor.Length(); ++i, ++count)
+			{
+				if (StorageChar(cursor.Data(), cursor.Kind(), i) != L' ')
+					return count;
+			}
+			cursor.Skip(cursor.Length());
+		}
+		return count;
+	}
 
-		s.erase(0, s.find_first_not_of(L" "));
-		return s;
+	static size_t TrailingSpaces(const HeapValue* value)
+	{
+		size_t count = 0;
+		StringCursor cursor(value);
+		while (cursor.Fill())
+		{
+			for (size_t i = 0; i < cursor.Length(); ++i)
+			{
+				count = StorageChar(cursor.Data(), cursor.Kind(), i) == L' ' ? count + 1 : 0;
+			}
+			cursor.Skip(cursor.Length());
+		}
+		return count;
 	}
 
 	void Engine::InstructionSUB(size_t tag)
 	{
 		auto b = CALCStackPop();
 		auto a = CALCStackPop();
-		Value* r;
-		if (a->GetType() == b->GetType())
+		Value r;
+		if (a.GetType() == b.GetType())
 		{
-			switch (a->GetType())
+			switch (a.GetType())
 			{
 			case Value::String:
 			{
-				std::wstring sa;
-				std::wstring sb;
-				a->AsString(sa);
-				b->AsString(sb);
-				r = mGC.NewStringValue(sa.append(sb));
+				r = mGC.NewStringValue(a, b);
 			}
 			break;
 			case Value::Integer:
 			{
-				r = mGC.NewIntegerValue(a->AsInteger() - b->AsInteger());
+				r = mGC.NewIntegerValue(a.AsInteger() - b.AsInteger());
 			}
 			break;
 			default:
 			{
-				r = mGC.NewRealValue(a->AsReal() - b->AsReal());
+				r = mGC.NewRealValue(a.AsReal() - b.AsReal());
 			}
 			break;
 			}
 		}
 		else
 		{
-			if (a->Is(Value::String) || b->Is(Value::String))
+			//去掉左侧末尾和右侧开头的空格后拼接；数值、逻辑量和阵列转换成的字符串两端没有空格，
+			//  只需处理字符串一侧，另一侧在栈上转换
+			wchar_t buffer[Value::TEXT_BUFFER_SIZE];
+			if (a.Is(Value::String))
 			{
-				std::wstring sa;
-				std::wstring sb;
-				a->AsString(sa);
-				b->AsString(sb);
-
-				r = mGC.NewStringValue(trim_end(sa).append(trim_start(sb)));
+				auto length = a.StringLength();
+				auto spaces = TrailingSpaces(a.mValue.hValue);
+				auto left = spaces == 0 ? a : mGC.NewStringValue(a, 0, length - spaces);
+				r = mGC.NewStringValue(left, mGC.NewStringValue(buffer, b.FormatText(buffer)));
+			}
+			else if (b.Is(Value::String))
+			{
+				auto length = b.StringLength();
+				auto spaces = LeadingSpaces(b.mValue.hValue);
+				auto right = spaces == 0 ? b : mGC.NewStringValue(b, spaces, length - spaces);
+				r = mGC.NewStringValue(mGC.NewStringValue(buffer, a.FormatText(buffer)), right);
 			}
 			else
 			{
-				r = mGC.NewRealValue(a->AsReal() - b->AsReal());
+				r = mGC.NewRealValue(a.AsReal() - b.AsReal());
 			}
 		}
 
 		CALCStackPush(r);
+		Quicken(InstructionID::SUB, a, b);
+		mGC.CheckMemoryGC(this);
 	}
 	void Engine::InstructionSD(size_t tag)
 	{
@@ -736,98 +1257,886 @@ namespace VM
 		DATAStackPut(tag, v);
 	}
 
+	//同一位置退回通用实现超过该次数后，视为多态位置，不再特化
+	static const uint32_t QUICKENING_DEOPT_LIMIT = 4;
 
-
-
-
-
-
-
-
-	bool Value::VEquals(const Value* value)const
+	void Engine::Quicken(InstructionID generic, const Value& a, const Value& b)
 	{
-		if (value == this)
-			return true;
-		if (value->Is(GetType()))
+		//本机程序没有可改写的指令
+		if (mProfiling || mNativeEntry != nullptr)
+			return;
+		auto index = static_cast<size_t>(mIP - mInstructions);
+		auto& site = mQuickeningSites[index];
+		if (site.deoptimized >= QUICKENING_DEOPT_LIMIT)
+			return;
+
+		auto id = generic;
+		if (a.GetType() == b.GetType())
 		{
-			switch (GetType())
-			{
-			case Integer: return mValue.iValue == value->mValue.iValue;
-			case Real: return mValue.dValue == value->mValue.dValue;
-			case String:
+			switch (generic)
 			{
-				if (mValue.sValue.length == value->mValue.sValue.length)
-				{
-					return memcmp(
-						mValue.sValue.str,
-						value->mValue.sValue.str,
-						value->mValue.sValue.length * sizeof(wchar_t))==0;
-				}
-				return false;
-			}
-			case Boolean: return mValue.bValue == value->mValue.bValue;
-			case Array:
-				return false;
+			case InstructionID::ADD:
+				if (a.Is(Value::Integer))
+					id = InstructionID::ADD_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::ADD_RR;
+				else if (a.Is(Value::String))
+					id = InstructionID::ADD_SS;
+				break;
+			case InstructionID::SUB:
+				if (a.Is(Value::Integer))
+					id = InstructionID::SUB_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::SUB_RR;
+				break;
+			case InstructionID::MUL:
+				if (a.Is(Value::Integer))
+					id = InstructionID::MUL_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::MUL_RR;
+				break;
+			case InstructionID::DIV:
+				if (a.Is(Value::Integer))
+					id = InstructionID::DIV_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::DIV_RR;
+				break;
+			case InstructionID::LT:
+				if (a.Is(Value::Integer))
+					id = InstructionID::LT_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::LT_RR;
+				break;
+			case InstructionID::GT:
+				if (a.Is(Value::Integer))
+					id = InstructionID::GT_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::GT_RR;
+				break;
+			case InstructionID::EQ:
+				if (a.Is(Value::Integer))
+					id = InstructionID::EQ_II;
+				else if (a.Is(Value::Real))
+					id = InstructionID::EQ_RR;
+				break;
 			default:
 				break;
 			}
 		}
-		else
-		{
-			if (Is(String) || value->Is(String))
-			{
-				std::wstring s0;
-				std::wstring s1;
-				AsString(s0);
-				value->AsString(s1);
-				return s0 == s1;
-			}
-			else if (Is(Real))
-			{
-				return AsReal() == value->AsReal();
-			}
-			else if (Is(Boolean))
-			{
-				return AsBoolean() == value->AsBoolean();
-			}
-		}
-		return false;
+		if (id == generic)
+			return;
+
+		site.index = index;
+		site.generic = generic;
+		site.current = id;
+		++site.quickened;
+		mInstructions[index].handler = mDispatchTable[static_cast<size_t>(id)];
 	}
 
-	bool Value::AsBoolean(void) const
+	void Engine::Deoptimize(InstructionID generic)
 	{
-		switch (GetType())
-		{
-		case Integer: return mValue.iValue != int64_t(0);
-		case Real: return mValue.dValue != double(0);
-		case String: return (mValue.sValue.length != 0);
-		case Boolean: return mValue.bValue;
-		case Array: return true;
-		default:
-			break;
-		}
-		return false;
+		auto index = static_cast<size_t>(mIP - mInstructions);
+		auto& site = mQuickeningSites[index];
+		site.current = generic;
+		++site.deoptimized;
+		mInstructions[index].handler = mDispatchTable[static_cast<size_t>(generic)];
 	}
 
-	void Value::AsString(std::wstring& s) const
+	std::vector<Engine::QuickeningSite> Engine::GetQuickeningStats(void) const
 	{
-		switch (GetType())
+		std::vector<QuickeningSite> result;
+		for (auto& site : mQuickeningSites)
 		{
-		case Integer: s = std::to_wstring(mValue.iValue); break;
-		case Real:
+			if (site.quickened != 0 || site.deoptimized != 0)
+				result.push_back(site);
+		}
+		return result;
+	}
+	std::vector<Engine::OpcodeNGram> Engine::GetOpcodeNGrams(void) const
+	{
+		std::vector<OpcodeNGram> result;
+		for (auto& it : mOpcodeNGrams)
 		{
-			s = std::to_wstring(mValue.dValue);
-			s.erase(s.find_last_not_of(L'0') + 1, std::string::npos);
-			s.erase(s.find_last_not_of(L'.') + 1, std::string::npos);
+			OpcodeNGram gram = {};
+			gram.length = static_cast<size_t>(it.first >> 56);
+			for (size_t i = 0; i < gram.length; ++i)
+				gram.ops[i] = static_cast<InstructionID>((it.first >> (8 * (gram.length - 1 - i))) & 0xFF);
+			gram.count = it.second;
+			result.push_back(gram);
+		}
+		std::sort(result.begin(), result.end(), [](const OpcodeNGram& a, const OpcodeNGram& b)
+		{
+			if (a.count != b.count)
+				return a.count > b.count;
+			return a.length < b.length;
+		});
+		return result;
+	}
+
+	//类型特化指令：操作数类型与特化时一致则直接计算，否则退回通用实现
+	void Engine::InstructionADD_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::ADD);
+			InstructionADD(tag);
+			return;
+		}
+		a.mValue.iValue += b.mValue.iValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionADD_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::ADD);
+			InstructionADD(tag);
+			return;
+		}
+		a.mValue.dValue += b.mValue.dValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionADD_SS(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::String) || !b.Is(Value::String))
+		{
+			Deoptimize(InstructionID::ADD);
+			InstructionADD(tag);
+			return;
+		}
+		a = mGC.NewStringValue(a, b);
+		--mCALCTop;
+		mGC.CheckMemoryGC(this);
+	}
+	void Engine::InstructionSUB_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::SUB);
+			InstructionSUB(tag);
+			return;
+		}
+		a.mValue.iValue -= b.mValue.iValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionSUB_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::SUB);
+			InstructionSUB(tag);
+			return;
+		}
+		a.mValue.dValue -= b.mValue.dValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionMUL_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::MUL);
+			InstructionMUL(tag);
+			return;
+		}
+		a.mValue.iValue *= b.mValue.iValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionMUL_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::MUL);
+			InstructionMUL(tag);
+			return;
+		}
+		a.mValue.dValue *= b.mValue.dValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionDIV_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::DIV);
+			InstructionDIV(tag);
+			return;
+		}
+		a.mValue.iValue /= b.mValue.iValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionDIV_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::DIV);
+			InstructionDIV(tag);
+			return;
+		}
+		a.mValue.dValue /= b.mValue.dValue;
+		--mCALCTop;
+	}
+	void Engine::InstructionLT_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::LT);
+			InstructionLT(tag);
+			return;
+		}
+		//与通用实现保持一致，按实数比较
+		a = mGC.NewBooleanValue(static_cast<double>(a.mValue.iValue) < static_cast<double>(b.mValue.iValue));
+		--mCALCTop;
+	}
+	void Engine::InstructionLT_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::LT);
+			InstructionLT(tag);
+			return;
+		}
+		a = mGC.NewBooleanValue(a.mValue.dValue < b.mValue.dValue);
+		--mCALCTop;
+	}
+	void Engine::InstructionGT_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::GT);
+			InstructionGT(tag);
+			return;
+		}
+		a = mGC.NewBooleanValue(static_cast<double>(a.mValue.iValue) > static_cast<double>(b.mValue.iValue));
+		--mCALCTop;
+	}
+	void Engine::InstructionGT_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::GT);
+			InstructionGT(tag);
+			return;
+		}
+		a = mGC.NewBooleanValue(a.mValue.dValue > b.mValue.dValue);
+		--mCALCTop;
+	}
+	void Engine::InstructionEQ_II(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Integer) || !b.Is(Value::Integer))
+		{
+			Deoptimize(InstructionID::EQ);
+			InstructionEQ(tag);
+			return;
+		}
+		a = mGC.NewBooleanValue(a.mValue.iValue == b.mValue.iValue);
+		--mCALCTop;
+	}
+	void Engine::InstructionEQ_RR(size_t tag)
+	{
+		auto& b = mCALCTop[-1];
+		auto& a = *(&b - 1);
+		if (!a.Is(Value::Real) || !b.Is(Value::Real))
+		{
+			Deoptimize(InstructionID::EQ);
+			InstructionEQ(tag);
+			return;
+		}
+		a = mGC.NewBooleanValue(a.mValue.dValue == b.mValue.dValue);
+		--mCALCTop;
+	}
+
+	//融合规则来自 CNPL_OPCODE_PROFILE 统计出的高频指令序列，跳转只允许出现在序列末尾。
+	//超级指令只改写序列第一条的处理函数，其余指令保持原样，
+	//跳转到序列中间时仍按原指令逐条执行，所以跳转目标无需重新计算。
+	static const struct
+	{
+		InstructionID pattern[Engine::OPCODE_NGRAM_MAX];
+		size_t length;
+		InstructionID fused;
+	} FUSION_RULES[] =
+	{
+		{ { InstructionID::LD, InstructionID::LC, InstructionID::ADD, InstructionID::SD }, 4, InstructionID::LD_LC_ADD_SD },
+		{ { InstructionID::LD, InstructionID::LD, InstructionID::ADD, InstructionID::SD }, 4, InstructionID::LD_LD_ADD_SD },
+		{ { InstructionID::LD, InstructionID::LC, InstructionID::SUB, InstructionID::SD }, 4, InstructionID::LD_LC_SUB_SD },
+		{ { InstructionID::LD, InstructionID::LD, InstructionID::LT, InstructionID::JMPN }, 4, InstructionID::LD_LD_LT_JMPN },
+		{ { InstructionID::LD, InstructionID::LC, InstructionID::LT, InstructionID::JMPN }, 4, InstructionID::LD_LC_LT_JMPN },
+		{ { InstructionID::LD, InstructionID::LD, InstructionID::GT, InstructionID::JMPN }, 4, InstructionID::LD_LD_GT_JMPN },
+		{ { InstructionID::LD, InstructionID::LC, InstructionID::GT, InstructionID::JMPN }, 4, InstructionID::LD_LC_GT_JMPN }
+	};
+
+	void Engine::FuseInstructions(void)
+	{
+		size_t i = 0;
+		while (i < mInstructionCount)
+		{
+			size_t length = 1;
+			for (auto& rule : FUSION_RULES)
+			{
+				if (i + rule.length > mInstructionCount)
+					continue;
+				if (!std::equal(rule.pattern, rule.pattern + rule.length, mOpcodes.begin() + i))
+					continue;
+				mInstructions[i].handler = mDispatchTable[static_cast<size_t>(rule.fused)];
+				length = rule.length;
+				break;
+			}
+			i += length;
+		}
+	}
+
+	//按原指令逐条执行 length 条，用于超级指令的类型检查失败时
+	void Engine::StepGeneric(size_t length)
+	{
+		for (size_t i = 0; i < length; ++i)
+		{
+			if (i != 0)
+				++mIP;
+			ExecuteGeneric(mOpcodes[mIP - mInstructions], mIP->tag);
+		}
+	}
+
+	//按字节码中的原始指令执行，不经过分派表，供超级指令回退和 JIT 慢速路径使用
+	void Engine::ExecuteGeneric(InstructionID id, size_t tag)
+	{
+		switch (id)
+		{
+		case InstructionID::NOOP: InstructionNOOP(tag); break;
+		case InstructionID::ADD: InstructionADD(tag); break;
+		case InstructionID::AND: InstructionAND(tag); break;
+		case InstructionID::ALLOCDSTK: InstructionALLOCDSTK(tag); break;
+		case InstructionID::ARRAYMAKE: InstructionARRAYMAKE(tag); break;
+		case InstructionID::ARRAYREAD: InstructionARRAYREAD(tag); break;
+		case InstructionID::ARRAYWRITE: InstructionARRAYWRITE(tag); break;
+		case InstructionID::CALL: InstructionCALL(tag); break;
+		case InstructionID::CALLSYS: InstructionCALLSYS(tag); break;
+		case InstructionID::DIV: InstructionDIV(tag); break;
+		case InstructionID::EQ: InstructionEQ(tag); break;
+		case InstructionID::GT: InstructionGT(tag); break;
+		case InstructionID::JMP: InstructionJMP(tag); break;
+		case InstructionID::JMPC: InstructionJMPC(tag); break;
+		case InstructionID::JMPN: InstructionJMPN(tag); break;
+		case InstructionID::LT: InstructionLT(tag); break;
+		case InstructionID::LC: InstructionLC(tag); break;
+		case InstructionID::LD: InstructionLD(tag); break;
+		case InstructionID::MOD: InstructionMOD(tag); break;
+		case InstructionID::MUL: InstructionMUL(tag); break;
+		case InstructionID::NE: InstructionNE(tag); break;
+		case InstructionID::NOT: InstructionNOT(tag); break;
+		case InstructionID::OR: InstructionOR(tag); break;
+		case InstructionID::POP: InstructionPOP(tag); break;
+		case InstructionID::PUSH: InstructionPUSH(tag); break;
+		case InstructionID::RET: InstructionRET(tag); break;
+		case InstructionID::SUB: InstructionSUB(tag); break;
+		case InstructionID::SD: InstructionSD(tag); break;
+		default:
+			throw Exception(10003, "Unrecognized instruction.");
+		}
+	}
+
+	void Engine::InstructionLD_LC_ADD_SD(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = mConstants[mIP[1].tag];
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			DATAStackPut(mIP[3].tag, mGC.NewIntegerValue(a.mValue.iValue + b.mValue.iValue));
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			DATAStackPut(mIP[3].tag, mGC.NewRealValue(a.mValue.dValue + b.mValue.dValue));
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		mIP += 3;
+	}
+	void Engine::InstructionLD_LD_ADD_SD(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = DATAStackGet(mIP[1].tag);
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			DATAStackPut(mIP[3].tag, mGC.NewIntegerValue(a.mValue.iValue + b.mValue.iValue));
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			DATAStackPut(mIP[3].tag, mGC.NewRealValue(a.mValue.dValue + b.mValue.dValue));
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		mIP += 3;
+	}
+	void Engine::InstructionLD_LC_SUB_SD(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = mConstants[mIP[1].tag];
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			DATAStackPut(mIP[3].tag, mGC.NewIntegerValue(a.mValue.iValue - b.mValue.iValue));
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			DATAStackPut(mIP[3].tag, mGC.NewRealValue(a.mValue.dValue - b.mValue.dValue));
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		mIP += 3;
+	}
+	void Engine::InstructionLD_LD_LT_JMPN(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = DATAStackGet(mIP[1].tag);
+		bool r;
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			r = static_cast<double>(a.mValue.iValue) < static_cast<double>(b.mValue.iValue);
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			r = a.mValue.dValue < b.mValue.dValue;
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		if (r)
+			mIP += 3;
+		else
+			mIP = mInstructions + (mIP[3].tag - 1);
+	}
+	void Engine::InstructionLD_LC_LT_JMPN(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = mConstants[mIP[1].tag];
+		bool r;
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			r = static_cast<double>(a.mValue.iValue) < static_cast<double>(b.mValue.iValue);
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			r = a.mValue.dValue < b.mValue.dValue;
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		if (r)
+			mIP += 3;
+		else
+			mIP = mInstructions + (mIP[3].tag - 1);
+	}
+	void Engine::InstructionLD_LD_GT_JMPN(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = DATAStackGet(mIP[1].tag);
+		bool r;
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			r = static_cast<double>(a.mValue.iValue) > static_cast<double>(b.mValue.iValue);
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			r = a.mValue.dValue > b.mValue.dValue;
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		if (r)
+			mIP += 3;
+		else
+			mIP = mInstructions + (mIP[3].tag - 1);
+	}
+	void Engine::InstructionLD_LC_GT_JMPN(size_t tag)
+	{
+		auto& a = DATAStackGet(tag);
+		auto& b = mConstants[mIP[1].tag];
+		bool r;
+		if (a.Is(Value::Integer) && b.Is(Value::Integer))
+			r = static_cast<double>(a.mValue.iValue) > static_cast<double>(b.mValue.iValue);
+		else if (a.Is(Value::Real) && b.Is(Value::Real))
+			r = a.mValue.dValue > b.mValue.dValue;
+		else
+		{
+			StepGeneric(4);
+			return;
+		}
+		if (r)
+			mIP += 3;
+		else
+			mIP = mInstructions + (mIP[3].tag - 1);
+	}
+
+	void Engine::ProfileInstruction(void)
+	{
+		auto op = mOpcodes[mIP - mInstructions];
+		//只统计顺序执行的指令序列，发生跳转、调用或返回后重新开始
+		if (mProfileLast == nullptr || mProfileLast + 1 != mIP)
+			mProfileHistoryLength = 0;
+		mProfileLast = mIP;
+
+		if (mProfileHistoryLength == OPCODE_NGRAM_MAX)
+		{
+			for (size_t i = 1; i < OPCODE_NGRAM_MAX; ++i)
+				mProfileHistory[i - 1] = mProfileHistory[i];
+			--mProfileHistoryLength;
+		}
+		mProfileHistory[mProfileHistoryLength++] = op;
+
+		//键值：高 8 位为序列长度，其余每 8 位一条指令
+		for (size_t n = 2; n <= mProfileHistoryLength; ++n)
+		{
+			uint64_t key = static_cast<uint64_t>(n) << 56;
+			for (size_t i = mProfileHistoryLength - n; i < mProfileHistoryLength; ++i)
+				key = (key & 0xFF00000000000000ULL) | ((key << 8) & 0x00FFFFFFFFFFFFFFULL) | static_cast<uint64_t>(mProfileHistory[i]);
+			++mOpcodeNGrams[key];
+		}
+	}
+#if defined(BYTE_CODE_VM_CALL_DISPATCH)
+	void Engine::InstructionPROFILE(size_t tag)
+	{
+		ProfileInstruction();
+		(this->*(mDispatchTable[static_cast<size_t>(mOpcodes[mIP - mInstructions])]))(tag);
+	}
+#endif
+
+
+
+
+
+
+
+
+
+	namespace
+	{
+		//十进制无符号整数，返回字符数
+		size_t FormatUnsigned(wchar_t* buffer, uint64_t value)
+		{
+			wchar_t digits[20];
+			size_t n = 0;
+			do
+			{
+				digits[n++] = static_cast<wchar_t>(L'0' + value % 10);
+				value /= 10;
+			} while (value != 0);
+			for (size_t i = 0; i < n; ++i)
+			{
+				buffer[i] = digits[n - 1 - i];
+			}
+			return n;
+		}
+
+		//逐段比较两个字符串的内容，存储方式相同的部分直接比较内存
+		bool StringEquals(StringCursor& c0, StringCursor& c1)
+		{
+			for (;;)
+			{
+				auto more0 = c0.Fill();
+				auto more1 = c1.Fill();
+				if (!more0 || !more1)
+					return more0 == more1;
+				auto n = std::min(c0.Length(), c1.Length());
+				if (c0.Kind() == c1.Kind())
+				{
+					if (memcmp(c0.Data(), c1.Data(), n * HeapValue::StringKindWidth(c0.Kind())) != 0)
+						return false;
+				}
+				else
+				{
+					for (size_t i = 0; i < n; ++i)
+					{
+						if (StorageChar(c0.Data(), c0.Kind(), i) != StorageChar(c1.Data(), c1.Kind(), i))
+							return false;
+					}
+				}
+				c0.Skip(n);
+				c1.Skip(n);
+			}
+		}
+
+		//按存储方式把字符串内容追加到 std::wstring
+		struct StringAppender
+		{
+			std::wstring& s;
+			template<typename Char>
+			void operator()(const Char* str, size_t length) { s.append(str, str + length); }
+		};
+
+		//字符串转换为数值时使用的文本：较短的内容放在栈上的缓冲区，不分配内存
+		class NumberText
+		{
+		public:
+			explicit NumberText(const Value& value) : mLength(0)
+			{
+				WideStringVisitor<NumberText> wide = { *this };
+				value.VisitStringStorage(wide);
+				if (mLength < BUFFER_SIZE)
+					mBuffer[mLength] = 0;
+				else
+					value.AsString(mLong);
+			}
+			void operator()(const wchar_t* s, size_t length)
+			{
+				if (mLength + length < BUFFER_SIZE)
+					std::copy(s, s + length, mBuffer + mLength);
+				mLength += length;
+			}
+			const wchar_t* c_str(void) const { return mLength < BUFFER_SIZE ? mBuffer : mLong.c_str(); }
+		private:
+			static const size_t BUFFER_SIZE = 64;
+			wchar_t mBuffer[BUFFER_SIZE];
+			size_t mLength;
+			std::wstring mLong;
+		};
+
+		//逐段编码为 UTF-8；wchar_t 为 2 字节时代理对可能被拼接串分在两段中，高位代理留到下一段
+		struct UTF8Encoder
+		{
+			std::string& s;
+			uint32_t high;
+			void Put(uint32_t c)
+			{
+				if (c < 0x80)
+				{
+					s.push_back(static_cast<char>(c));
+				}
+				else if (c < 0x800)
+				{
+					s.push_back(static_cast<char>(0xC0 | (c >> 6)));
+					s.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+				}
+				else if (c < 0x10000)
+				{
+					s.push_back(static_cast<char>(0xE0 | (c >> 12)));
+					s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+					s.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+				}
+				else
+				{
+					s.push_back(static_cast<char>(0xF0 | (c >> 18)));
+					s.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+					s.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+					s.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+				}
+			}
+			void operator()(const uint8_t* str, size_t length)
+			{
+				Finish();
+				for (size_t i = 0; i < length; ++i)
+				{
+					if (str[i] < 0x80)
+						s.push_back(static_cast<char>(str[i]));
+					else
+						Put(str[i]);
+				}
+			}
+			template<typename Char>
+			void operator()(const Char* str, size_t length)
+			{
+				for (size_t i = 0; i < length; ++i)
+				{
+					auto c = static_cast<uint32_t>(str[i]);
+					if (sizeof(Char) == 2 && sizeof(wchar_t) == 2)
+					{
+						if (high != 0 && c >= 0xDC00 && c < 0xE000)
+						{
+							Put(0x10000 + ((high - 0xD800) << 10) + (c - 0xDC00));
+							high = 0;
+							continue;
+						}
+						Finish();
+						if (c >= 0xD800 && c < 0xDC00)
+						{
+							high = c;
+							continue;
+						}
+					}
+					Put(c);
+				}
+			}
+			//落单的代理按原值输出
+			void Finish(void)
+			{
+				if (high != 0)
+					Put(high);
+				high = 0;
+			}
+		};
+	}
+
+	bool Value::VEquals(const Value& value)const
+	{
+		if (value.Is(GetType()))
+		{
+			switch (GetType())
+			{
+			case Integer: return mValue.iValue == value.mValue.iValue;
+			case Real: return mValue.dValue == value.mValue.dValue;
+			case String:
+			{
+				auto s0 = mValue.hValue;
+				auto s1 = value.mValue.hValue;
+				if (s0 == s1)
+					return true;
+				//内容相同的驻留字符串是同一个对象
+				if (s0->IsInterned() && s1->IsInterned())
+					return false;
+				if (s0->mValue.sValue.length != s1->mValue.sValue.length)
+					return false;
+				//拼接串没有连续的内容，逐段比较
+				if (s0->IsRope() || s1->IsRope())
+				{
+					StringCursor c0(s0);
+					StringCursor c1(s1);
+					return StringEquals(c0, c1);
+				}
+				//同样的内容总是同样的存储方式，存储方式不同的内容一定不同
+				if (s0->StringKind() != s1->StringKind())
+					return false;
+				return memcmp(
+					s0->mValue.sValue.str,
+					s1->mValue.sValue.str,
+					s1->mValue.sValue.length * s1->StringWidth())==0;
+			}
+			case Boolean: return mValue.bValue == value.mValue.bValue;
+			case Array:
+				return mValue.hValue == value.mValue.hValue;
+			default:
+				break;
+			}
+		}
+		else
+		{
+			//另一侧在栈上转换为字符串后与字符串的存储比较
+			if (Is(String) || value.Is(String))
+			{
+				auto& str = Is(String) ? *this : value;
+				auto& other = Is(String) ? value : *this;
+				wchar_t buffer[TEXT_BUFFER_SIZE];
+				auto length = other.FormatText(buffer);
+				if (str.mValue.hValue->mValue.sValue.length != length)
+					return false;
+				StringCursor c0(str.mValue.hValue);
+				StringCursor c1(buffer, length);
+				return StringEquals(c0, c1);
+			}
+			else if (Is(Real))
+			{
+				return AsReal() == value.AsReal();
+			}
+			else if (Is(Boolean))
+			{
+				return AsBoolean() == value.AsBoolean();
+			}
+		}
+		return false;
+	}
+
+	bool Value::AsBoolean(void) const
+	{
+		switch (GetType())
+		{
+		case Integer: return mValue.iValue != int64_t(0);
+		case Real: return mValue.dValue != double(0);
+		case String: return (mValue.hValue->mValue.sValue.length != 0);
+		case Boolean: return mValue.bValue;
+		case Array: return true;
+		default:
+			break;
+		}
+		return false;
+	}
+
+	size_t Value::FormatText(wchar_t* buffer) const
+	{
+		size_t length = 0;
+		switch (GetType())
+		{
+		case Integer:
+		{
+			if (mValue.iValue < 0)
+				buffer[length++] = L'-';
+			auto magnitude = mValue.iValue < 0 ? 0 - static_cast<uint64_t>(mValue.iValue) : static_cast<uint64_t>(mValue.iValue);
+			length += FormatUnsigned(buffer + length, magnitude);
+		}
+		break;
+		case Real:
+		{
+			//与 std::to_wstring 的格式相同，再去掉末尾的 0 和小数点
+			auto n = swprintf(buffer, TEXT_BUFFER_SIZE, L"%f", mValue.dValue);
+			length = n < 0 ? 0 : static_cast<size_t>(n);
+			while (length > 0 && buffer[length - 1] == L'0')
+				--length;
+			while (length > 0 && buffer[length - 1] == L'.')
+				--length;
+		}
+		break;
+		case Boolean:
+		{
+			auto text = mValue.bValue ? L"True" : L"False";
+			length = std::wcslen(text);
+			std::copy(text, text + length, buffer);
+		}
+		break;
+		case Array:
+		{
+			buffer[length++] = L'[';
+			length += FormatUnsigned(buffer + length, mValue.hValue->mValue.aValue.row);
+			buffer[length++] = L',';
+			length += FormatUnsigned(buffer + length, mValue.hValue->mValue.aValue.col);
+			buffer[length++] = L']';
 		}
 		break;
-		case String: s.assign(mValue.sValue.str, mValue.sValue.length); break;
-		case Boolean: s = mValue.bValue ? L"True" : L"False"; break;
-		case Array: s = L"[" + std::to_wstring(mValue.aValue.row) + L"," + std::to_wstring(mValue.aValue.col) + L"]"; break;
 		default:
-			s = std::wstring();
 			break;
 		}
+		buffer[length] = 0;
+		return length;
+	}
+
+	size_t Value::StringLength(void) const
+	{
+		if (Is(String))
+			return mValue.hValue->mValue.sValue.length;
+		wchar_t buffer[TEXT_BUFFER_SIZE];
+		return FormatText(buffer);
+	}
+
+	void Value::AsString(std::wstring& s) const
+	{
+		switch (GetType())
+		{
+		case String:
+		{
+			s.clear();
+			s.reserve(mValue.hValue->mValue.sValue.length);
+			StringAppender append = { s };
+			VisitStringStorage(append);
+		}
+		break;
+		default:
+		{
+			wchar_t buffer[TEXT_BUFFER_SIZE];
+			s.assign(buffer, FormatText(buffer));
+		}
+		break;
+		}
 	}
 
 	int64_t Value::AsInteger(void) const
@@ -836,261 +2145,1355 @@ namespace VM
 		{
 		case Integer: return mValue.iValue;
 		case Real: return static_cast<int64_t>(mValue.dValue);
-		case String: return std::wcstoll(mValue.sValue.str, nullptr, 10);
+		case String:
+		{
+			if (!mValue.hValue->IsRope() && mValue.hValue->StringWidth() == sizeof(wchar_t))
+				return std::wcstoll(mValue.hValue->WideChars(), nullptr, 10);
+			NumberText text(*this);
+			return std::wcstoll(text.c_str(), nullptr, 10);
+		}
 		case Boolean: return mValue.bValue ? int64_t(1) : int64_t(0);
 		case Array: return int64_t(0);
 		default:
 			break;
 		}
-		return int64_t(0);
+		return int64_t(0);
+	}
+
+	double Value::AsReal(void) const
+	{
+		switch (GetType())
+		{
+		case Integer: return static_cast<double>(mValue.iValue);
+		case Real: return mValue.dValue;
+		case String:
+		{
+			if (!mValue.hValue->IsRope() && mValue.hValue->StringWidth() == sizeof(wchar_t))
+				return std::wcstod(mValue.hValue->WideChars(), nullptr);
+			NumberText text(*this);
+			return std::wcstod(text.c_str(), nullptr);
+		}
+		case Boolean: return mValue.bValue ? double(1) : double(0);
+		case Array: return double(0);
+		default:
+			break;
+		}
+		return double(0);
+	}
+
+	void Value::AsUTF8(std::string& s) const
+	{
+		s.clear();
+		if (!Is(String))
+		{
+			UTF8Encoder encode = { s, 0 };
+			auto w = AsString();
+			encode(w.data(), w.length());
+			encode.Finish();
+			return;
+		}
+		s.reserve(mValue.hValue->mValue.sValue.length);
+		UTF8Encoder encode = { s, 0 };
+		VisitStringStorage(encode);
+		encode.Finish();
+	}
+
+	size_t Value::GetRow(void)const
+	{
+		if (Is(Array))
+			return mValue.hValue->mValue.aValue.row;
+		return 0;
+	}
+	size_t Value::GetCol(void)const
+	{
+		if (Is(Array))
+			return mValue.hValue->mValue.aValue.col;
+		return 0;
+	}
+	Value Value::GetValue(size_t r, size_t c) const
+	{
+		if (Is(Array))
+		{
+			auto& a = mValue.hValue->mValue.aValue;
+			if (r < a.row && c < a.col)
+			{
+				return Element(a.data[r*a.col + c]);
+			}
+		}
+		return MemoryAllocator::BooleanValue(false);
+	}
+	void Value::SetValue(size_t r, size_t c, const Value& v)
+	{
+		if (Is(Array))
+		{
+			auto h = mValue.hValue;
+			auto& a = h->mValue.aValue;
+			if (r < a.row && c < a.col)
+			{
+				auto index = r*a.col + c;
+				a.data[index] = v;
+				//写屏障：老代阵列引用了更年轻的对象时标记所在卡片，回收年轻代时只扫描这些卡片；
+				//  增量标记期间老年代阵列的所有写入都标记卡片，结束标记时重新扫描
+				if (v.IsHeapValue())
+				{
+					auto gen = h->mGeneration;
+					if (v.mValue.hValue->mGeneration < gen ||
+						(gen != 0 && gen != HeapValue::GC_UNTRACKED && MemoryGC::IsIncrementalMarking()))
+						h->GCCardMark(index);
+				}
+			}
+		}
+	}
+
+
+
+
+	thread_local size_t MemoryGC::sIncrementalMarking = 0;
+	//类内初始化的常量按引用传给 std::min/std::max 时需要类外定义（C++17 之前），否则未优化的构建链接失败
+	const size_t MemoryGC::MARK_RANGE_SIZE;
+	const size_t MemoryGC::NURSERY_LARGE_OBJECT;
+	const size_t MemoryGC::NURSERY_MIN_BYTES;
+
+	MemoryGC::MemoryGC(void) :
+		mMemoryPool(),
+		mConfig(DefaultConfig()),
+		mGenerationFullFlags{ false,false,false,false },
+		mGenerationLimits{ 0,0,0,0 },
+		mForceFull(false),
+		mGeneration(),
+		mMarkBits(),
+		mOldArrays(),
+		mRememberedGlobals(),
+		mScanQueue(),
+		mMarkStack(),
+		mIncrementalBudget(mConfig.incrementalBudget),
+		mMarkingGen(0),
+		mMarkingScavenges(0),
+		mDead(),
+		mSweeper(),
+		mSweepLock(),
+		mSweepSignal(),
+		mSweepQueue(),
+		mSweepBusy(false),
+		mSweepStop(false),
+		mNursery(nullptr),
+		mNurseryTop(nullptr),
+		mNurseryEnd(nullptr),
+		mAllocatedBytes(0),
+		mCollectThreshold(mConfig.nurseryBytes),
+		mCheckpoint(mCollectThreshold),
+		mOldBytes(0),
+		mSweptBytes(0),
+		mStats(),
+		mLastCollectedGen(0),
+		mLastCollectEnd(std::chrono::steady_clock::now()),
+		mPauseSinceCollect(0),
+		mGCTimeShare(0),
+		mSiteEngine(nullptr),
+		mNurserySites(),
+		mSites(),
+		mHeapWatchBytes(0),
+		mHeapWatch()
+	{
+
+	}
+	MemoryGC::~MemoryGC(void)
+	{
+		if (mSweeper.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(mSweepLock);
+				mSweepStop = true;
+			}
+			mSweepSignal.notify_all();
+			mSweeper.join();
+		}
+		ClearInterned();
+		Clean();
+	}
+
+
+	bool MemoryGC::GCTryMark(const HeapValue* v)
+	{
+		auto& word = mMarkBits[v->mGeneration][v->mSlot / MARK_WORD_BITS];
+		auto bit = static_cast<MarkWord>(1) << (v->mSlot % MARK_WORD_BITS);
+		if ((word & bit) != 0)
+			return false;
+		word |= bit;
+		return true;
+	}
+
+	bool MemoryGC::GCTryMarkAtomic(const HeapValue* v)
+	{
+		auto word = reinterpret_cast<std::atomic<MarkWord>*>(&mMarkBits[v->mGeneration][v->mSlot / MARK_WORD_BITS]);
+		auto bit = static_cast<MarkWord>(1) << (v->mSlot % MARK_WORD_BITS);
+		if ((word->load(std::memory_order_relaxed) & bit) != 0)
+			return false;
+		return (word->fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+	}
+
+	//把对象加入某一代的跟踪表，位图随之扩大，新增的位都是未标记
+	void MemoryGC::GCAppend(int gen, HeapValue* v)
+	{
+		auto& generation = mGeneration[gen];
+		v->mGeneration = static_cast<uint8_t>(gen);
+		v->mSlot = static_cast<uint32_t>(generation.size());
+		generation.push_back(v);
+		auto& marks = mMarkBits[gen];
+		if (marks.size() * MARK_WORD_BITS < generation.size())
+			marks.resize(marks.size() + 1024, 0);
+	}
+
+	void* MemoryGC::GCAllocate(size_t size)
+	{
+		mAllocatedBytes += size;
+		mStats.allocatedBytes += size;
+		if (size <= NURSERY_LARGE_OBJECT)
+		{
+			auto aligned = (size + 7) & ~static_cast<size_t>(7);
+			if (static_cast<size_t>(mNurseryEnd - mNurseryTop) >= aligned)
+			{
+				auto p = mNurseryTop;
+				mNurseryTop += aligned;
+				return p;
+			}
+		}
+		//大对象或新生代已满时从内存池分配，不移动，按标记清除回收
+		mOldBytes += size;
+		return RawMemory().AllocMemory(size);
+	}
+
+	void MemoryGC::GCEvacuate(Value& v)
+	{
+		if (!v.IsHeapValue())
+			return;
+
+		auto h = v.mValue.hValue;
+		if (IsNursery(h))
+		{
+			if (!h->IsGCForwarded())
+			{
+				auto size = MemoryAllocator::SizeOf(h);
+				auto to = reinterpret_cast<HeapValue*>(RawMemory().AllocMemory(size));
+				mOldBytes += size;
+				memcpy(to, h, size);
+				//只保留拼接串标志和字符串的存储宽度
+				to->mFlag &= 0x08 | HeapValue::STRING_KIND_MASK;
+				GCAppend(1, to);
+				if (to->Is(Value::Array))
+				{
+					memset(to->GCCards(), 0, HeapValue::GCCardCount(to->mValue.aValue.row * to->mValue.aValue.col));
+					mOldArrays.push_back(to);
+				}
+				if (to->GCHasChildren())
+					mScanQueue.push_back(to);
+				//增量标记期间复制出来的对象直接视为已标记，其元素由后续的标记处理
+				if (mMarkingGen > 0 && GCTryMark(to) && to->GCHasChildren())
+					GCMarkPushChildren(to, mMarkStack);
+				h->GCForward(to);
+			}
+			v.mValue.hValue = h->GCForwardAddress();
+		}
+		else if (h->mGeneration == 0)
+		{
+			if (GCTryMark(h) && h->GCHasChildren())
+				mScanQueue.push_back(h);
+		}
+	}
+
+	void MemoryGC::GCEvacuateCards(HeapValue* array)
+	{
+		auto& a = array->mValue.aValue;
+		auto count = a.row * a.col;
+		auto cards = array->GCCards();
+		auto cardCount = HeapValue::GCCardCount(count);
+		//增量标记期间已标记阵列的卡片可能来自写屏障，清理卡片前先标记其中的对象
+		bool shade = mMarkingGen > 0 && GCIsMarked(array);
+		bool dirty = false;
+		for (size_t i = 0; i < cardCount; ++i)
+		{
+			if (cards[i] == 0)
+				continue;
+
+			bool younger = false;
+			auto d = a.data + (i << HeapValue::GC_CARD_SHIFT);
+			auto e = std::min(d + (static_cast<size_t>(1) << HeapValue::GC_CARD_SHIFT), a.data + count);
+			for (; d < e; ++d)
+			{
+				GCEvacuate(*d);
+				if (shade)
+					GCMark(*d, mMarkingGen);
+				if (d->IsHeapValue() && d->mValue.hValue->mGeneration < array->mGeneration)
+					younger = true;
+			}
+			if (younger)
+				dirty = true;
+			else
+				cards[i] = 0;
+		}
+		if (!dirty)
+			array->GCCardClear();
+	}
+
+	//0 代回收：从根、记录的全局变量和老年代脏卡片出发，把新生代中的存活对象复制到 1 代，
+	//  耗时只与存活对象有关；未放入新生代的 0 代对象只做标记，随后由 GCGenerationClean 处理
+	void MemoryGC::GCScavenge(Engine* engine)
+	{
+		for (auto& v : engine->mCallParameters)
+		{
+			GCEvacuate(v);
+		}
+
+		for (auto v = engine->mCALCStack.data(); v != engine->mCALCTop; ++v)
+		{
+			GCEvacuate(*v);
+		}
+
+		//水位线以下的栈帧自上次回收以来没有写入，其中只有老年代对象，递归很深时不必每次都扫描；
+		//  回收后只有当前栈帧还可能被写入
+		auto& data = engine->mDATAStack;
+		for (size_t i = std::min(engine->mDATAWatermark, data.size()), n = data.size(); i < n; ++i)
+		{
+			GCEvacuate(data[i]);
+		}
+		engine->mDATAWatermark = engine->mDATABase;
+
+		//常量本身不参与回收，但常量阵列中可能写入了堆对象
+		for (auto h : engine->mConstantArrays)
+		{
+			auto d = h->mValue.aValue.data;
+			auto e = d + (h->mValue.aValue.row * h->mValue.aValue.col);
+			for (; d < e; ++d)
+				GCEvacuate(*d);
+		}
+
+		//每次回收后 0 代都会清空，全局变量中的 0 代对象只能来自此后的写入
+		for (auto v : mRememberedGlobals)
+		{
+			GCEvacuate(v->value);
+			v->remembered = false;
+		}
+
+		//复制出来的阵列会追加到 mOldArrays，它们的卡片都是干净的
+		for (size_t i = 0, n = mOldArrays.size(); i < n; ++i)
+		{
+			if (mOldArrays[i]->IsGCCardDirty())
+				GCEvacuateCards(mOldArrays[i]);
+		}
+
+		while (!mScanQueue.empty())
+		{
+			auto h = mScanQueue.back();
+			mScanQueue.pop_back();
+			for (auto d = h->GCChildrenBegin(), e = h->GCChildrenEnd(); d < e; ++d)
+				GCEvacuate(*d);
+		}
+
+		if (mSiteEngine != nullptr)
+			GCScavengeSites();
+		mRememberedGlobals.clear();
+		mNurseryTop = mNursery;
 	}
 
-	double Value::AsReal(void) const
+	void MemoryGC::GCMarkPushChildren(HeapValue* value, std::vector<MarkRange>& stack)
 	{
-		switch (GetType())
+		auto d = value->GCChildrenBegin();
+		auto e = value->GCChildrenEnd();
+		while (d < e)
 		{
-		case Integer: return static_cast<double>(mValue.iValue);
-		case Real: return mValue.dValue;
-		case String: return std::wcstod(mValue.sValue.str, nullptr);
-		case Boolean: return mValue.bValue ? double(1) : double(0);
-		case Array: return double(0);
-		default:
-			break;
+			auto n = std::min(static_cast<size_t>(e - d), MARK_RANGE_SIZE);
+			stack.push_back({ d, d + n });
+			d += n;
 		}
-		return double(0);
 	}
 
-	size_t Value::GetRow(void)const
+	//标记一个对象，首次标记的阵列和拼接串放入标记栈，由 GCMarkDrain 或 GCMarkParallel 扫描其元素
+	void MemoryGC::GCMark(const Value& v, int gen)
 	{
-		if (Is(Array))
-			return mValue.aValue.row;
-		return 0;
+		if (!v.IsHeapValue())
+			return;
+
+		//比回收代更老的对象不会被回收，它们对年轻对象的引用由卡片记录，不再深入；
+		//  常量的代号也大于任何一代，常量阵列由 mConstantArrays 逐个扫描；
+		//  0 代对象只在增量标记期间出现，由新生代回收负责，晋升时再标记
+		auto h = v.mValue.hValue;
+		if (h->mGeneration > gen || h->mGeneration == 0)
+			return;
+
+		if (GCTryMark(h) && h->GCHasChildren())
+			GCMarkPushChildren(h, mMarkStack);
 	}
-	size_t Value::GetCol(void)const
+
+	void MemoryGC::GCMarkRange(const MarkRange& r, int gen)
 	{
-		if (Is(Array))
-			return mValue.aValue.col;
-		return 0;
+		//标记时要读取对象头，先预取后面元素指向的对象，减少等待内存的时间
+		auto prefetch = r.begin + MARK_PREFETCH_DISTANCE;
+		for (auto d = r.begin; d < r.end; ++d, ++prefetch)
+		{
+			if (prefetch < r.end && prefetch->IsHeapValue())
+				GC_PREFETCH(prefetch->mValue.hValue);
+			GCMark(*d, gen);
+		}
 	}
-	Value* Value::GetValue(size_t r, size_t c) const
+
+	void MemoryGC::GCMarkDrain(int gen)
 	{
-		if (Is(Array))
+		while (!mMarkStack.empty())
+		{
+			auto r = mMarkStack.back();
+			mMarkStack.pop_back();
+			GCMarkRange(r, gen);
+		}
+	}
+
+	//每个线程优先处理本地栈，本地工作较多时分一部分到自己的共享队列，空闲线程从其它线程的共享队列窃取；
+	//  标记位用原子操作设置，同一对象只会被一个线程放入栈中
+	void MemoryGC::GCMarkParallel(int gen)
+	{
+		struct MarkDeque
+		{
+			std::mutex lock;
+			std::deque<MarkRange> items;
+			std::atomic<size_t> size;
+		};
+
+		auto count = mConfig.markThreads;
+		std::vector<MarkDeque> deques(count);
+		for (size_t i = 0; i < mMarkStack.size(); ++i)
+		{
+			deques[i % count].items.push_back(mMarkStack[i]);
+		}
+		for (auto& q : deques)
 		{
-			if (r < mValue.aValue.row && c < mValue.aValue.col)
+			q.size.store(q.items.size());
+		}
+		mMarkStack.clear();
+
+		std::atomic<size_t> idle(0);
+		auto worker = [&](size_t self)
+		{
+			std::vector<MarkRange> local;
+			auto& own = deques[self];
+			auto take = [](MarkDeque& q, bool front, std::vector<MarkRange>& to)
+			{
+				std::lock_guard<std::mutex> guard(q.lock);
+				if (q.items.empty())
+					return false;
+				to.push_back(front ? q.items.front() : q.items.back());
+				if (front)
+					q.items.pop_front();
+				else
+					q.items.pop_back();
+				q.size.store(q.items.size(), std::memory_order_relaxed);
+				return true;
+			};
+
+			for (;;)
 			{
-				auto result = mValue.aValue.data[r*mValue.aValue.col + c];
-				if (result != nullptr)
-					return result;
+				if (local.empty() && !take(own, false, local))
+				{
+					//没有工作时从其它线程窃取，尝试前先退出空闲状态，避免持有工作的线程被算作空闲；
+					//  所有线程都空闲时各队列必然为空，标记结束
+					idle.fetch_add(1);
+					bool found = false;
+					while (!found)
+					{
+						if (idle.load() == count)
+							return;
+						for (size_t k = 1; k < count && !found; ++k)
+						{
+							auto& victim = deques[(self + k) % count];
+							if (victim.size.load(std::memory_order_relaxed) == 0)
+								continue;
+							idle.fetch_sub(1);
+							found = take(victim, true, local);
+							if (!found)
+								idle.fetch_add(1);
+						}
+						if (!found)
+							std::this_thread::yield();
+					}
+					continue;
+				}
+
+				auto r = local.back();
+				local.pop_back();
+				auto prefetch = r.begin + MARK_PREFETCH_DISTANCE;
+				for (auto d = r.begin; d < r.end; ++d, ++prefetch)
+				{
+					if (prefetch < r.end && prefetch->IsHeapValue())
+						GC_PREFETCH(prefetch->mValue.hValue);
+					if (!d->IsHeapValue())
+						continue;
+					auto h = d->mValue.hValue;
+					if (h->mGeneration <= gen && h->mGeneration != 0 && GCTryMarkAtomic(h) && h->GCHasChildren())
+						GCMarkPushChildren(h, local);
+				}
+
+				if (local.size() > 64 && own.size.load(std::memory_order_relaxed) == 0)
+				{
+					std::lock_guard<std::mutex> guard(own.lock);
+					auto half = local.size() / 2;
+					own.items.insert(own.items.end(), local.begin(), local.begin() + half);
+					local.erase(local.begin(), local.begin() + half);
+					own.size.store(own.items.size(), std::memory_order_relaxed);
+				}
 			}
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < count; ++i)
+		{
+			threads.emplace_back(worker, i);
+		}
+		worker(0);
+		for (auto& t : threads)
+		{
+			t.join();
 		}
-		return MemoryAllocator::BooleanValue(false);
 	}
-	void Value::SetValue(size_t r, size_t c, Value* v)
+
+	void MemoryGC::GCMarkCards(HeapValue* array, int gen)
 	{
-		if (Is(Array))
+		auto& a = array->mValue.aValue;
+		auto count = a.row * a.col;
+		auto cards = array->GCCards();
+		auto cardCount = HeapValue::GCCardCount(count);
+		bool dirty = false;
+		for (size_t i = 0; i < cardCount; ++i)
 		{
-			if (r < mValue.aValue.row && c < mValue.aValue.col)
+			if (cards[i] == 0)
+				continue;
+
+			//卡片也可能由增量标记的写屏障标记，其中的对象都要标记；顺便清理已不再引用更年轻对象的卡片
+			bool younger = false;
+			auto d = a.data + (i << HeapValue::GC_CARD_SHIFT);
+			auto e = std::min(d + (static_cast<size_t>(1) << HeapValue::GC_CARD_SHIFT), a.data + count);
+			for (; d < e; ++d)
 			{
-				if (IsGCMarked())
-					v->GCMarkSet();
-				mValue.aValue.data[r*mValue.aValue.col + c] = v;
+				if (!d->IsHeapValue())
+					continue;
+				if (d->mValue.hValue->mGeneration < array->mGeneration)
+					younger = true;
+				GCMark(*d, gen);
 			}
+			if (younger)
+				dirty = true;
+			else
+				cards[i] = 0;
 		}
+		if (!dirty)
+			array->GCCardClear();
 	}
 
+	void MemoryGC::GCCardRefresh(HeapValue* array)
+	{
+		//阵列晋升后按新的代号重新标记卡片
+		auto& a = array->mValue.aValue;
+		auto count = a.row * a.col;
+		auto cards = array->GCCards();
+		memset(cards, 0, HeapValue::GCCardCount(count));
+		array->GCCardClear();
+		for (size_t i = 0; i < count; ++i)
+		{
+			auto& d = a.data[i];
+			if (d.IsHeapValue() && d.mValue.hValue->mGeneration < array->mGeneration)
+				array->GCCardMark(i);
+		}
+	}
 
+	void MemoryGC::GCMarkRoots(Engine* engine, int gen)
+	{
+		for (auto& v : engine->mCallParameters)
+		{
+			GCMark(v, gen);
+		}
 
+		for (auto v = engine->mCALCStack.data(); v != engine->mCALCTop; ++v)
+		{
+			GCMark(*v, gen);
+		}
 
-	MemoryGC::MemoryGC(void) :
-		mMemoryPool(),
-		mGenerationFullFlags{ false,false,false,false },
-		mGeneration()
-	{
+		for (auto& v : engine->mDATAStack)
+		{
+			GCMark(v, gen);
+		}
 
+		//常量阵列的代号大于任何一代，GCMark 会跳过其中嵌套的常量阵列
+		for (auto h : engine->mConstantArrays)
+		{
+			GCMarkPushChildren(h, mMarkStack);
+		}
+
+		for (auto& v : engine->mGlobalVariables)
+		{
+			GCMark(v.value, gen);
+		}
+
+		//增量标记结束时，已标记的阵列中被写屏障标记的卡片也要重新扫描
+		for (auto v : mOldArrays)
+		{
+			if ((v->mGeneration > gen || GCIsMarked(v)) && v->IsGCCardDirty())
+				GCMarkCards(v, gen);
+		}
 	}
-	MemoryGC::~MemoryGC(void)
+
+	void MemoryGC::GCMarkFinish(int gen)
 	{
-		Clean();
+		//根只放入标记栈，对象较多时多线程完成其余标记
+		size_t objects = 0;
+		for (int g = 0; g <= gen; ++g)
+		{
+			objects += mGeneration[g].size();
+		}
+		if (mConfig.markThreads > 1 && objects >= PARALLEL_MARK_MIN_OBJECTS && !mMarkStack.empty())
+			GCMarkParallel(gen);
+		else
+			GCMarkDrain(gen);
 	}
 
-
-	void MemoryGC::GCMarkRoots(Engine* engine)
+	//增量标记的一段：处理标记栈直到用完时间预算，其余留给下一段
+	void MemoryGC::GCMarkSlice(void)
 	{
-		for (auto v : engine->mCallParameters)
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(mIncrementalBudget);
+		while (!mMarkStack.empty())
 		{
-			v->GCMarkSet();
+			auto r = mMarkStack.back();
+			mMarkStack.pop_back();
+			GCMarkRange(r, mMarkingGen);
+			if (std::chrono::steady_clock::now() >= deadline)
+				break;
 		}
+	}
 
-		for (auto& n : engine->mCallStack)
+	//放弃进行中的增量标记：清除已有的标记，写屏障标记的卡片留给之后的回收处理
+	void MemoryGC::GCMarkAbort(void)
+	{
+		for (int g = 1; g <= mMarkingGen; ++g)
 		{
-			if (n.datastack != nullptr)
-			{
-				for (auto v : *(n.datastack))
-				{
-					v->GCMarkSet();
-				}
-			}
+			std::fill(mMarkBits[g].begin(), mMarkBits[g].end(), 0);
 		}
+		mMarkStack.clear();
+		mMarkingGen = 0;
+		--sIncrementalMarking;
+	}
+
+	//堆占用超过上限：先等清扫线程释放已回收的对象，仍超过时回收全部老年代，还超过则报错
+	void MemoryGC::GCEnforceLimit(Engine* engine)
+	{
+		GCSweepWait();
+		if (HeapBytes() <= mConfig.maxHeapBytes)
+			return;
+
+		mForceFull = true;
+		GC(engine);
+		mForceFull = false;
+		GCSweepWait();
+		if (HeapBytes() > mConfig.maxHeapBytes)
+			throw Exception(20002, "Heap size limit exceeded.");
+	}
 
-		for (auto v : engine->mCALCStack)
+	//自适应调节：只回收了新生代时，停顿超过目标就缩小新生代，回收耗时占比过高且停顿还有余量就扩大新生代；
+	//  回收老年代的停顿超过目标时改用增量标记
+	void MemoryGC::GCAdapt(uint64_t pause, uint64_t gcTime, uint64_t elapsed)
+	{
+		auto target = mConfig.pauseTargetMicroseconds;
+		if (target == 0)
+			return;
+
+		auto share = static_cast<double>(gcTime) / static_cast<double>(elapsed + 1);
+		mGCTimeShare = mGCTimeShare * 0.75 + share * 0.25;
+		if (mLastCollectedGen > 0)
 		{
-			v->GCMarkSet();
+			if (pause > target && mIncrementalBudget == 0)
+				mIncrementalBudget = std::max(target / 4, static_cast<size_t>(1));
+			return;
 		}
 
-		if (engine->mDATAStack != nullptr)
+		auto size = mCollectThreshold;
+		if (pause > target)
+			size /= 2;
+		else if (mGCTimeShare * 100 > static_cast<double>(mConfig.gcTimePercent) && pause * 2 < target)
+			size *= 2;
+		//设置了堆上限时新生代不超过上限的四分之一
+		auto maxSize = NURSERY_MAX_BYTES;
+		if (mConfig.maxHeapBytes > 0)
+			maxSize = std::max(std::min(maxSize, mConfig.maxHeapBytes / 4), NURSERY_MIN_BYTES);
+		size = std::min(std::max(size, NURSERY_MIN_BYTES), maxSize);
+		if (size != mCollectThreshold)
+			GCResizeNursery(size);
+	}
+
+	//只在回收之后调用，此时新生代是空的
+	void MemoryGC::GCResizeNursery(size_t size)
+	{
+		delete[] mNursery;
+		mNursery = new uint8_t[size];
+		mNurseryTop = mNursery;
+		mNurseryEnd = mNursery + size;
+		mCollectThreshold = size;
+	}
+
+	void MemoryGC::GCStep(Engine* engine)
+	{
+		auto heap = HeapBytes();
+		if (heap > mStats.peakHeapBytes)
+			mStats.peakHeapBytes = heap;
+
+		auto start = std::chrono::steady_clock::now();
+		bool paused = true;
+		bool collected = false;
+		if (mAllocatedBytes >= mCollectThreshold)
+		{
+			GC(engine);
+			collected = true;
+		}
+		else if (mMarkingGen > 0)
+		{
+			GCMarkSlice();
+			++mStats.incrementalSlices;
+		}
+		else
+		{
+			paused = false;
+		}
+		if (mConfig.maxHeapBytes > 0 && HeapBytes() > mConfig.maxHeapBytes)
+		{
+			GCEnforceLimit(engine);
+			paused = true;
+			collected = true;
+		}
+		if (paused)
 		{
-			for (auto v : *(engine->mDATAStack))
+			auto end = std::chrono::steady_clock::now();
+			auto pause = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+			++mStats.pauses;
+			mStats.totalPauseMicroseconds += pause;
+			if (pause > mStats.maxPauseMicroseconds)
+				mStats.maxPauseMicroseconds = pause;
+			//增量标记各段的耗时计入下一次回收，每次回收后调节一次
+			mPauseSinceCollect += pause;
+			if (collected)
 			{
-				v->GCMarkSet();
+				auto elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(end - mLastCollectEnd).count());
+				GCAdapt(pause, mPauseSinceCollect, elapsed);
+				mLastCollectEnd = end;
+				mPauseSinceCollect = 0;
 			}
 		}
 
-		for (auto v : engine->mGlobalVariableTable)
+		mCheckpoint = mCollectThreshold;
+		if (mMarkingGen > 0)
+			mCheckpoint = std::min(mAllocatedBytes + mCollectThreshold / INCREMENTAL_STEP_DIVISOR, mCollectThreshold);
+		//设置了堆上限时，堆占用可能达到上限之前就要检查
+		if (mConfig.maxHeapBytes > 0)
+		{
+			heap = HeapBytes();
+			auto room = mConfig.maxHeapBytes > heap ? mConfig.maxHeapBytes - heap : 0;
+			mCheckpoint = std::min(mCheckpoint, mAllocatedBytes + room);
+		}
+
+		if (mHeapWatch && HeapBytes() >= mHeapWatchBytes)
 		{
-			v.second->GCMarkSet();
+			auto watch = std::move(mHeapWatch);
+			mHeapWatch = nullptr;
+			watch(engine);
 		}
 	}
 
-	void MemoryGC::GCGenerationMarkClear(int gen)
+	void MemoryGC::GCCollect(int gen)
 	{
-		auto g = mGeneration + gen;
-
-		for (auto v : *g)
+		//从最老的一代开始，年轻代晋升上来的对象不会再被检查
+		for (int g = gen; g > 0; --g)
 		{
-			v->GCMarkClear();
+			GCGenerationClean(g);
 		}
 	}
 
 	void MemoryGC::GCGenerationClean(int gen)
 	{
+		if (gen > 0)
+		{
+			auto end = std::remove_if(mOldArrays.begin(), mOldArrays.end(), [this, gen](HeapValue* v) {
+				return v->mGeneration == gen && !GCIsMarked(v);
+			});
+			mOldArrays.erase(end, mOldArrays.end());
+		}
+
+		//按位图判断存亡，不可达对象的头部只由清扫线程读取
+		++mStats.collections[gen];
+		mGenerationFullFlags[gen] = false;
+		auto generation = mGeneration + gen;
+		auto& marks = mMarkBits[gen];
 		if (gen >= 3)
 		{
-			mGenerationFullFlags[gen] = false;
-			auto generation = mGeneration + gen;
-			auto i = generation->begin();
-			while (i != generation->end())
+			//一次遍历把存活对象依次前移
+			size_t keep = 0;
+			for (size_t i = 0, n = generation->size(); i < n; ++i)
 			{
-				if ((*i)->IsGCMarkFreed())
+				auto v = (*generation)[i];
+				if (!GCBitTest(marks, i))
 				{
-					RawMemory().FreeValue(*i);
-					i = generation->erase(i);
+					mDead.push_back(v);
 				}
 				else
 				{
-					++i;
+					if (keep != i)
+					{
+						v->mSlot = static_cast<uint32_t>(keep);
+						(*generation)[keep] = v;
+					}
+					++keep;
 				}
 			}
+			generation->resize(keep);
+			//存活对象较多时调高触发回收的对象数，避免每次晋升都回收全部老年代
+			mGenerationLimits[gen] = std::max(mConfig.generationLimits[gen], keep * 2);
 		}
 		else
 		{
-			mGenerationFullFlags[gen] = false;
-			auto generation = mGeneration + gen;
+			auto collected = gen;
+			auto total = generation->size();
+			size_t promoted = 0;
 			auto nextGeneration = mGeneration + (++gen);
 			while (generation->size() > 0)
 			{
 				auto v = generation->back();
-				if (v->IsGCMarkFreed())
+				if (!GCBitTest(marks, generation->size() - 1))
 				{
-					RawMemory().FreeValue(v);
+					mDead.push_back(v);
 				}
 				else
 				{
-					nextGeneration->push_back(v);
+					++promoted;
+					GCAppend(gen, v);
+					if (v->Is(Value::Array))
+					{
+						GCCardRefresh(v);
+						if (gen == 1)
+							mOldArrays.push_back(v);
+					}
+					//增量标记期间晋升到 1 代的对象直接视为已标记，其元素由后续的标记处理
+					if (gen == 1 && mMarkingGen > 0 && GCTryMark(v) && v->GCHasChildren())
+						GCMarkPushChildren(v, mMarkStack);
 				}
 				generation->pop_back();
 			}
 
-			if (nextGeneration->size() > nextGeneration->capacity() - 32)
+			if (nextGeneration->size() >= mGenerationLimits[gen])
 			{
 				mGenerationFullFlags[gen] = true;
 			}
+
+			//自适应调节：大部分对象存活时回收该代得不偿失，推迟下次回收；存活率低时逐步恢复配置值
+			if (collected > 0 && mConfig.pauseTargetMicroseconds > 0)
+			{
+				if (promoted * 2 > total)
+					mGenerationLimits[collected] *= 2;
+				else if (promoted * 4 < total)
+					mGenerationLimits[collected] = std::max(mConfig.generationLimits[collected], mGenerationLimits[collected] / 2);
+			}
+		}
+		//回收结束后留下的对象都不带标记
+		std::fill(marks.begin(), marks.end(), 0);
+		if (mSiteEngine != nullptr)
+		{
+			for (auto v : mDead)
+			{
+				mSites.erase(v);
+			}
+		}
+		GCSweep(mDead);
+	}
+
+	void MemoryGC::GCSweep(std::vector<HeapValue*>& dead)
+	{
+		if (dead.empty())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mSweepLock);
+			if (mSweepQueue.empty())
+				mSweepQueue.swap(dead);
+			else
+				mSweepQueue.insert(mSweepQueue.end(), dead.begin(), dead.end());
+		}
+		dead.clear();
+		if (!mSweeper.joinable())
+			mSweeper = std::thread(&MemoryGC::GCSweeperMain, this);
+		mSweepSignal.notify_all();
+	}
+
+	void MemoryGC::GCSweepWait(void)
+	{
+		std::unique_lock<std::mutex> lock(mSweepLock);
+		mSweepSignal.wait(lock, [this] { return mSweepQueue.empty() && !mSweepBusy; });
+	}
+
+	//后台清扫线程：只读取不可达对象的头部计算大小，把内存还给 MemoryAllocator
+	void MemoryGC::GCSweeperMain(void)
+	{
+		std::vector<HeapValue*> batch;
+		std::unique_lock<std::mutex> lock(mSweepLock);
+		for (;;)
+		{
+			mSweepSignal.wait(lock, [this] { return mSweepStop || !mSweepQueue.empty(); });
+			if (mSweepQueue.empty())
+				return;
+
+			batch.swap(mSweepQueue);
+			mSweepBusy = true;
+			lock.unlock();
+			mSweptBytes.fetch_add(RawMemory().ReleaseValues(batch), std::memory_order_relaxed);
+			batch.clear();
+			lock.lock();
+			mSweepBusy = false;
+			mSweepSignal.notify_all();
 		}
 	}
 
 	void MemoryGC::GC(Engine* engine)
 	{
-		if (mGenerationFullFlags[3])
+		//老年代是否回收按本次回收开始时的状态决定，先清空新生代，之后的标记不会遇到新生代对象
+		bool full[4] = { mGenerationFullFlags[0], mGenerationFullFlags[1], mGenerationFullFlags[2], mGenerationFullFlags[3] };
+
+		GCScavenge(engine);
+		GCGenerationClean(0);
+		mLastCollectedGen = 0;
+
+		//必须回收全部老年代时放弃进行中的增量标记，重新一次完成
+		if (mMarkingGen > 0 && mForceFull)
+			GCMarkAbort();
+
+		if (mMarkingGen > 0)
+		{
+			//增量标记已处理完或持续太久时，重新扫描根和脏卡片完成本轮标记；
+			//  此时新生代刚清空，数据栈的写入不需要屏障
+			if (mMarkStack.empty() || ++mMarkingScavenges >= INCREMENTAL_MAX_SCAVENGES)
+			{
+				auto gen = mMarkingGen;
+				GCMarkRoots(engine, gen);
+				GCMarkFinish(gen);
+				mMarkingGen = 0;
+				--sIncrementalMarking;
+				GCCollect(gen);
+				mLastCollectedGen = gen;
+			}
+		}
+		else
+		{
+			//回收已满的最老一代，比它年轻的各代一起回收
+			int gen = 3;
+			if (mConfig.policy != GCFull && !mForceFull)
+			{
+				while (gen > 0 && !full[gen])
+				{
+					--gen;
+				}
+			}
+			if (gen > 0)
+			{
+				GCMarkRoots(engine, gen);
+				if (mIncrementalBudget > 0 && !mForceFull)
+				{
+					mMarkingGen = gen;
+					mMarkingScavenges = 0;
+					++sIncrementalMarking;
+				}
+				else
+				{
+					GCMarkFinish(gen);
+					GCCollect(gen);
+					mLastCollectedGen = gen;
+				}
+			}
+		}
+		mAllocatedBytes = 0;
+	}
+
+	void MemoryGC::GCTrack(const Value& v)
+	{
+		if (IsNursery(v.mValue.hValue))
+			v.mValue.hValue->mGeneration = 0;
+		else
+			GCAppend(0, v.mValue.hValue);
+		if (mSiteEngine != nullptr)
+			GCTrackSite(v.mValue.hValue);
+	}
+
+	void MemoryGC::GCTrackSite(HeapValue* v)
+	{
+		//解释器执行指令期间 mIP 指向当前指令
+		auto e = mSiteEngine;
+		auto site = UNKNOWN_SITE;
+		if (e->mIP != nullptr && e->mIP >= e->mInstructions && e->mIP < e->mInstructions + e->mInstructionCount)
+			site = static_cast<uint32_t>(e->mIP - e->mInstructions);
+		if (IsNursery(v))
+			mNurserySites.push_back(std::make_pair(v, site));
+		else
+			mSites[v] = site;
+	}
+
+	void MemoryGC::GCScavengeSites(void)
+	{
+		//新生代中没有被复制出去的对象都已死亡
+		for (auto& entry : mNurserySites)
+		{
+			if (entry.first->IsGCForwarded())
+				mSites[entry.first->GCForwardAddress()] = entry.second;
+		}
+		mNurserySites.clear();
+	}
+
+	uint32_t MemoryGC::AllocationSite(const HeapValue* v) const
+	{
+		if (mSiteEngine == nullptr)
+			return UNKNOWN_SITE;
+		if (IsNursery(v))
+		{
+			for (auto& entry : mNurserySites)
+			{
+				if (entry.first == v)
+					return entry.second;
+			}
+			return UNKNOWN_SITE;
+		}
+		auto it = mSites.find(v);
+		return it != mSites.end() ? it->second : UNKNOWN_SITE;
+	}
+
+	void MemoryGC::TrackAllocationSites(const Engine* engine)
+	{
+		mSiteEngine = engine;
+		mNurserySites.clear();
+		mSites.clear();
+	}
+
+	void MemoryGC::SetHeapWatch(size_t bytes, std::function<void(Engine*)> callback)
+	{
+		mHeapWatchBytes = bytes;
+		mHeapWatch = std::move(callback);
+	}
+
+	Value MemoryGC::NewIntegerValue(int32_t value)
+	{
+		return NewIntegerValue(static_cast<int64_t>(value));
+	}
+	Value MemoryGC::NewIntegerValue(uint32_t value)
+	{
+		return NewIntegerValue(static_cast<int64_t>(value));
+	}
+
+	Value MemoryGC::NewIntegerValue(int64_t value)
+	{
+		return RawMemory().NewValue(value);
+	}
+	Value MemoryGC::NewIntegerValue(uint64_t value)
+	{
+		return NewIntegerValue(static_cast<int64_t>(value));
+	}
+	Value MemoryGC::NewRealValue(float value)
+	{
+		return NewRealValue(static_cast<double>(value));
+	}
+	Value MemoryGC::NewRealValue(double value)
+	{
+		return RawMemory().NewValue(value);
+	}
+	Value MemoryGC::NewStringValue(const std::wstring& value)
+	{
+		return NewStringValue(value.data(), value.length());
+	}
+	Value MemoryGC::NewStringValue(const wchar_t* value, size_t length)
+	{
+		if (value != nullptr && length == static_cast<size_t>(-1))
+			length = std::wcslen(value);
+
+		auto kind = MemoryAllocator::StringKindOf(value, length);
+		auto v = MemoryAllocator::StringValue(GCAllocate(MemoryAllocator::StringSizeOf(length, kind)), value, length, kind);
+		GCTrack(v);
+		return v;
+	}
+	//cursor 之后 length 个字符中最大的字符决定的存储方式
+	static uint16_t CursorKind(StringCursor cursor, size_t length)
+	{
+		size_t width = 1;
+		while (length > 0 && cursor.Fill())
 		{
-			GCGenerationMarkClear(3);
-			GCMarkRoots(engine);
-			GCGenerationClean(3);
+			auto n = std::min(length, cursor.Length());
+			for (size_t i = 0; i < n && cursor.Kind() != HeapValue::STRING_LATIN1; ++i)
+			{
+				width = std::max(width, HeapValue::StringCharWidth(StorageChar(cursor.Data(), cursor.Kind(), i)));
+			}
+			cursor.Skip(n);
+			length -= n;
+		}
+		return HeapValue::StringWidthKind(width);
+	}
+
+	//把 cursor 之后的 length 个字符逐个转换复制到普通字符串 to 中
+	static void CursorCopy(StringCursor& cursor, HeapValue* to, size_t length)
+	{
+		auto kind = to->StringKind();
+		for (size_t i = 0; i < length && cursor.Fill();)
+		{
+			auto n = std::min(length - i, cursor.Length());
+			for (size_t k = 0; k < n; ++k, ++i)
+			{
+				auto c = StorageChar(cursor.Data(), cursor.Kind(), k);
+				switch (kind)
+				{
+				case HeapValue::STRING_LATIN1: const_cast<uint8_t*>(to->Latin1Chars())[i] = static_cast<uint8_t>(c); break;
+				case HeapValue::STRING_UCS2: const_cast<char16_t*>(to->UCS2Chars())[i] = static_cast<char16_t>(c); break;
+				default: const_cast<wchar_t*>(to->WideChars())[i] = static_cast<wchar_t>(c); break;
+				}
+			}
+			cursor.Skip(n);
 		}
-		if (mGenerationFullFlags[2])
+	}
+
+	//按字符（与存储方式无关）计算的 FNV-1a 散列值
+	static uint32_t StringHash(StringCursor cursor)
+	{
+		uint32_t hash = 2166136261u;
+		while (cursor.Fill())
 		{
-			GCGenerationMarkClear(2);
-			GCMarkRoots(engine);
-			GCGenerationClean(2);
+			for (size_t i = 0; i < cursor.Length(); ++i)
+			{
+				hash = (hash ^ StorageChar(cursor.Data(), cursor.Kind(), i)) * 16777619u;
+			}
+			cursor.Skip(cursor.Length());
 		}
-		if (mGenerationFullFlags[1])
+		return hash;
+	}
+
+	Value MemoryGC::NewStringValue(const Value& value, size_t start, size_t length)
+	{
+		StringCursor cursor(value.mValue.hValue);
+		while (start > 0 && cursor.Fill())
 		{
-			GCGenerationMarkClear(1);
-			GCMarkRoots(engine);
-			GCGenerationClean(1);
+			auto n = std::min(start, cursor.Length());
+			cursor.Skip(n);
+			start -= n;
 		}
 
-		GCGenerationMarkClear(0);
-		GCMarkRoots(engine);
-		GCGenerationClean(0);
+		auto kind = CursorKind(cursor, length);
+		auto v = MemoryAllocator::StringValue(GCAllocate(MemoryAllocator::StringSizeOf(length, kind)), nullptr, length, kind);
+		CursorCopy(cursor, v.mValue.hValue, length);
+		GCTrack(v);
+		return v;
 	}
 
-	void MemoryGC::CheckMemoryGC(Engine* engine)
+	Value MemoryGC::InternString(const Value& value)
 	{
-		if (mGeneration->size() > mGeneration->capacity() - 32)
+		if (!value.Is(Value::String))
 		{
-			GC(engine);
+			wchar_t buffer[Value::TEXT_BUFFER_SIZE];
+			return InternString(buffer, value.FormatText(buffer));
 		}
+		auto h = value.mValue.hValue;
+		if (h->IsInterned())
+			return value;
+		StringCursor text(h);
+		auto length = h->mValue.sValue.length;
+		auto hash = StringHash(text);
+		auto found = InternFind(text, length, hash);
+		if (found == nullptr)
+			return InternInsert(text, length, hash);
+		Value v;
+		v.mType = Value::String;
+		v.mValue.hValue = found;
+		return v;
 	}
 
-	Value* MemoryGC::NewIntegerValue(int32_t value)
+	Value MemoryGC::InternString(const wchar_t* value, size_t length)
 	{
-		return NewIntegerValue(static_cast<int64_t>(value));
+		StringCursor text(value, length);
+		auto hash = StringHash(text);
+		auto found = InternFind(text, length, hash);
+		if (found == nullptr)
+			return InternInsert(text, length, hash);
+		Value v;
+		v.mType = Value::String;
+		v.mValue.hValue = found;
+		return v;
 	}
-	Value* MemoryGC::NewIntegerValue(uint32_t value)
+
+	const HeapValue* MemoryGC::FindInternedString(const Value& value) const
 	{
-		return NewIntegerValue(static_cast<int64_t>(value));
+		if (!value.Is(Value::String))
+		{
+			wchar_t buffer[Value::TEXT_BUFFER_SIZE];
+			return FindInternedString(buffer, value.FormatText(buffer));
+		}
+		auto h = value.mValue.hValue;
+		if (h->IsInterned())
+			return h;
+		StringCursor text(h);
+		return InternFind(text, h->mValue.sValue.length, StringHash(text));
 	}
 
-	Value* MemoryGC::NewIntegerValue(int64_t value)
+	const HeapValue* MemoryGC::FindInternedString(const wchar_t* value, size_t length) const
 	{
-		auto v = RawMemory().NewValue(value);
-		mGeneration->push_back(v);
-		return v;
+		StringCursor text(value, length);
+		return InternFind(text, length, StringHash(text));
 	}
-	Value* MemoryGC::NewIntegerValue(uint64_t value)
+
+	void MemoryGC::ClearInterned(void)
 	{
-		return NewIntegerValue(static_cast<int64_t>(value));
+		for (auto& v : mInterned)
+		{
+			RawMemory().FreeValue(v.second);
+		}
+		mInterned.clear();
 	}
-	Value* MemoryGC::NewRealValue(float value)
+
+	HeapValue* MemoryGC::InternFind(const StringCursor& text, size_t length, uint32_t hash) const
 	{
-		return NewRealValue(static_cast<double>(value));
+		auto range = mInterned.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (it->second->mValue.sValue.length != length)
+				continue;
+			StringCursor c0(it->second);
+			StringCursor c1 = text;
+			if (StringEquals(c0, c1))
+				return it->second;
+		}
+		return nullptr;
 	}
-	Value* MemoryGC::NewRealValue(double value)
+
+	Value MemoryGC::InternInsert(const StringCursor& text, size_t length, uint32_t hash)
 	{
-		auto v = RawMemory().NewValue(value);
-		mGeneration->push_back(v);
+		//和常量一样从内存池分配，不被 GC 跟踪
+		auto kind = CursorKind(text, length);
+		auto v = MemoryAllocator::StringValue(RawMemory().AllocMemory(MemoryAllocator::StringSizeOf(length, kind)), nullptr, length, kind);
+		auto h = v.mValue.hValue;
+		StringCursor cursor = text;
+		CursorCopy(cursor, h, length);
+		h->mFlag |= 0x40;
+		h->mSlot = hash;
+		mInterned.insert(std::make_pair(hash, h));
 		return v;
 	}
-	Value* MemoryGC::NewStringValue(const std::wstring& value)
+
+	//较长的结果生成拼接串，在循环中反复拼接时每次只分配一个节点和一小段内容，不再复制已有的内容；
+	//  拼接串的两部分都比它先分配，代号不小于它，不需要写屏障
+	Value MemoryGC::NewStringValue(const Value& left, const Value& right)
 	{
-		auto v = RawMemory().NewValue(value);
-		mGeneration->push_back(v);
+		auto l = left.mValue.hValue;
+		auto r = right.mValue.hValue;
+		auto length = l->mValue.sValue.length + r->mValue.sValue.length;
+		if (r->mValue.sValue.length == 0)
+			return left;
+		if (l->mValue.sValue.length == 0)
+			return right;
+		if (length < ROPE_MIN_LENGTH && !l->IsRope() && !r->IsRope())
+		{
+			//结果的存储宽度取两部分中较宽的一个
+			auto kind = HeapValue::StringWidthKind(std::max(l->StringWidth(), r->StringWidth()));
+			auto v = MemoryAllocator::StringValue(GCAllocate(MemoryAllocator::StringSizeOf(length, kind)), nullptr, length, kind);
+			MemoryAllocator::StringCopy(v.mValue.hValue, 0, l);
+			MemoryAllocator::StringCopy(v.mValue.hValue, l->mValue.sValue.length, r);
+			GCTrack(v);
+			return v;
+		}
+
+		Value parts[2] = { left, right };
+		if (l->IsRope() && !r->IsRope())
+		{
+			auto& tail = l->mValue.rValue.part[1];
+			auto t = tail.mValue.hValue;
+			if (!t->IsRope() && t->mValue.sValue.length + r->mValue.sValue.length < ROPE_MIN_LENGTH)
+			{
+				parts[0] = l->mValue.rValue.part[0];
+				parts[1] = NewStringValue(tail, right);
+			}
+		}
+
+		auto h = reinterpret_cast<HeapValue*>(GCAllocate(MemoryAllocator::RopeSizeOf()));
+		h->mType = Value::String;
+		h->mGeneration = HeapValue::GC_UNTRACKED;
+		h->mFlag = 0x08;
+		h->mSlot = 0;
+		h->mValue.rValue.length = length;
+		h->mValue.rValue.part[0] = parts[0];
+		h->mValue.rValue.part[1] = parts[1];
+
+		Value v;
+		v.mType = Value::String;
+		v.mValue.hValue = h;
+		GCTrack(v);
 		return v;
 	}
-	Value* MemoryGC::NewStringValue(const wchar_t* value, size_t length)
+	Value MemoryGC::NewBooleanValue(bool value)
+	{
+		return RawMemory().BooleanValue(value);
+	}
+	Value MemoryGC::NewArrayValue(size_t row, size_t col, const Value& fill)
 	{
-		auto v = RawMemory().NewValue(value, length);
-		mGeneration->push_back(v);
+		auto v = MemoryAllocator::ArrayValue(GCAllocate(MemoryAllocator::ArraySizeOf(row * col)), row, col, fill);
+		GCTrack(v);
 		return v;
 	}
-	Value* MemoryGC::NewBooleanValue(bool value)
+
+	GCConfig MemoryGC::DefaultConfig(void)
 	{
-		return RawMemory().BooleanValue(value);
+		GCConfig config;
+		config.nurseryBytes = 2 * 1024 * 1024;
+		config.generationLimits[0] = 1024 * 16;
+		config.generationLimits[1] = 1024 * 64;
+		config.generationLimits[2] = 1024 * 128;
+		config.generationLimits[3] = 1024 * 512;
+		config.maxHeapBytes = 0;
+		config.policy = GCGenerational;
+		config.markThreads = std::max(std::thread::hardware_concurrency(), 1u);
+		config.incrementalBudget = 0;
+		config.pauseTargetMicroseconds = 10000;
+		config.gcTimePercent = 5;
+		return config;
 	}
-	Value* MemoryGC::NewArrayValue(size_t row, size_t col, Value* fill)
+
+	void MemoryGC::SetConfig(const GCConfig& config)
 	{
-		auto v = RawMemory().NewValue(row, col, fill);
-		mGeneration->push_back(v);
-		return v;
+		mConfig = config;
+		mIncrementalBudget = mConfig.incrementalBudget;
+		if (mConfig.markThreads == 0)
+			mConfig.markThreads = 1;
+		for (int g = 0; g < 4; ++g)
+		{
+			if (mConfig.generationLimits[g] == 0)
+				mConfig.generationLimits[g] = 1;
+			mGenerationLimits[g] = mConfig.generationLimits[g];
+		}
+	}
+
+	GCStats MemoryGC::Stats(void) const
+	{
+		auto stats = mStats;
+		stats.heapBytes = HeapBytes();
+		stats.peakHeapBytes = std::max(stats.peakHeapBytes, stats.heapBytes);
+		//新生代按 8 字节对齐分配，堆占用可能略多于分配的字节数
+		stats.freedBytes = stats.allocatedBytes > stats.heapBytes ? stats.allocatedBytes - stats.heapBytes : 0;
+		stats.nurseryBytes = static_cast<size_t>(mNurseryTop - mNursery);
+		stats.nurseryCapacity = static_cast<size_t>(mNurseryEnd - mNursery);
+		for (int g = 0; g < 4; ++g)
+		{
+			stats.objects[g] = mGeneration[g].size();
+			for (auto v : mGeneration[g])
+			{
+				auto size = MemoryAllocator::SizeOf(v);
+				size_t bucket = 0;
+				while (bucket + 1 < GC_HISTOGRAM_BUCKETS && size > (static_cast<size_t>(16) << bucket))
+				{
+					++bucket;
+				}
+				stats.bytes[g] += size;
+				++stats.histogramObjects[bucket];
+				stats.histogramBytes[bucket] += size;
+			}
+		}
+		return stats;
 	}
 
 	void MemoryGC::Start(void)
@@ -1101,13 +3504,25 @@ namespace VM
 		mGenerationFullFlags[2] = false;
 		mGenerationFullFlags[3] = false;
 
-		mGeneration->reserve(1024 * 16);
-		(mGeneration + 1)->reserve(1024 * 64);
-		(mGeneration + 2)->reserve(1024 * 128);
-		(mGeneration + 3)->reserve(1024 * 512);
+		for (int g = 0; g < 4; ++g)
+		{
+			mGenerationLimits[g] = mConfig.generationLimits[g];
+			mGeneration[g].reserve(mGenerationLimits[g]);
+		}
+
+		mCollectThreshold = std::max(mConfig.nurseryBytes, NURSERY_LARGE_OBJECT);
+		mCheckpoint = mCollectThreshold;
+		mIncrementalBudget = mConfig.incrementalBudget;
+		mGCTimeShare = 0;
+		mLastCollectEnd = std::chrono::steady_clock::now();
+		mPauseSinceCollect = 0;
+		mNursery = new uint8_t[mCollectThreshold];
+		mNurseryTop = mNursery;
+		mNurseryEnd = mNursery + mCollectThreshold;
 	}
 	void MemoryGC::Clean(void)
 	{
+		GCSweepWait();
 		for (auto& g : mGeneration)
 		{
 			for (auto v : g)
@@ -1117,6 +3532,27 @@ namespace VM
 			g.clear();
 			g.reserve(0);
 		}
+		mOldArrays.clear();
+		mRememberedGlobals.clear();
+		for (auto& marks : mMarkBits)
+		{
+			marks.clear();
+		}
+		mMarkStack.clear();
+		if (mMarkingGen > 0)
+			--sIncrementalMarking;
+		mMarkingGen = 0;
+		mCheckpoint = mCollectThreshold;
+		delete[] mNursery;
+		mNursery = nullptr;
+		mNurseryTop = nullptr;
+		mNurseryEnd = nullptr;
+		mAllocatedBytes = 0;
+		mOldBytes = 0;
+		mSweptBytes.store(0, std::memory_order_relaxed);
+		mStats = GCStats();
+		mNurserySites.clear();
+		mSites.clear();
 
 		mMemoryPool.Clean();
 	}
@@ -1129,384 +3565,617 @@ namespace VM
 
 
 	MemoryAllocator::MemoryAllocator() :
-		mMB0Count(0),
-		mMB1Count(0),
-		mMB2Count(0),
-		mMB3Count(0),
-		mMB4Count(0),
-		mMB5Count(0),
-		mMB0Head(nullptr),
-		mMB1Head(nullptr),
-		mMB2Head(nullptr),
-		mMB3Head(nullptr),
-		mMB4Head(nullptr),
-		mMB5Head(nullptr)
+		mClasses(),
+		mSlabs(nullptr),
+		mLargeLock(),
+		mLargeCache(),
+		mPendingLock(),
+		mPendingAny(false),
+		mPending(),
+		mReclaimed()
 	{
-
+		//每个 2 的幂区间分 4 级，多占用的空间不超过 25%
+		static const size_t sizes[SLAB_CLASS_COUNT] = {
+			16, 32, 48, 64, 80, 96, 112, 128,
+			160, 192, 224, 256, 320, 384, 448, 512,
+			640, 768, 896, 1024, 1280, 1536, 1792, 2048
+		};
+		for (size_t i = 0; i < SLAB_CLASS_COUNT; ++i)
+		{
+			mClasses[i] = { sizes[i], nullptr, 0 };
+		}
 	}
 
 	MemoryAllocator::~MemoryAllocator()
 	{
 		Clean();
+		//仍在使用的对象（例如未释放的常量）所在的 slab 随分配器一起释放
+		while (mSlabs != nullptr)
+		{
+			auto slab = mSlabs;
+			mSlabs = slab->allNext;
+			SlabUnmap(slab);
+		}
+	}
+
+	Value MemoryAllocator::BooleanValue(bool value)
+	{
+		Value v;
+		v.mType = Value::Boolean;
+		v.mValue.bValue = value;
+		return v;
 	}
 
-	Value* MemoryAllocator::mTrue = MemoryAllocator::InitBoolean(true);
-	Value* MemoryAllocator::mFalse = MemoryAllocator::InitBoolean(false);
+	size_t MemoryAllocator::SlabClassOf(size_t size)
+	{
+		if (size <= 128)
+			return size <= 16 ? 0 : (size + 15) / 16 - 1;
+
+		//128 以上按最高位所在的 2 的幂区间分级，每个区间 4 级
+		auto s = size - 1;
+		size_t bit = 7;
+		while ((s >> (bit + 1)) != 0)
+			++bit;
+		return 8 + (bit - 7) * 4 + ((s >> (bit - 2)) - 4);
+	}
 
-	Value* MemoryAllocator::InitBoolean(bool value)
+	void* MemoryAllocator::SlabMap(void)
 	{
-		auto pValue = reinterpret_cast<Value*>(new uint8_t[sizeof(Value)]);
-		pValue->mValue.bValue = value;
-		pValue->mType = Value::Boolean;
-		pValue->mFlag = 0;
-		return pValue;
+#if defined(_WIN32)
+		//VirtualAlloc 的分配粒度为 64KB，返回的地址已按 SLAB_SIZE 对齐
+		void* p = VirtualAlloc(nullptr, SLAB_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (p == nullptr)
+			throw std::bad_alloc();
+		return p;
+#else
+		//多映射一个 slab 的大小，再把对齐地址前后多余的部分还给系统
+		auto raw = mmap(nullptr, SLAB_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED)
+			throw std::bad_alloc();
+		auto begin = reinterpret_cast<uintptr_t>(raw);
+		auto aligned = (begin + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+		if (aligned > begin)
+			munmap(raw, aligned - begin);
+		if (begin + SLAB_SIZE > aligned)
+			munmap(reinterpret_cast<void*>(aligned + SLAB_SIZE), begin + SLAB_SIZE - aligned);
+		return reinterpret_cast<void*>(aligned);
+#endif
 	}
 
-	Value* MemoryAllocator::BooleanValue(bool value)
+	void* MemoryAllocator::PageMap(size_t size)
 	{
-		return value ? mTrue : mFalse;
+#if defined(_WIN32)
+		void* p = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (p == nullptr)
+			throw std::bad_alloc();
+#else
+		void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc();
+#endif
+		return p;
 	}
 
-	void* MemoryAllocator::AllocMemory(size_t size)
+	void MemoryAllocator::PageUnmap(void* p, size_t size)
+	{
+#if defined(_WIN32)
+		VirtualFree(p, 0, MEM_RELEASE);
+#else
+		munmap(p, size);
+#endif
+	}
+
+	void MemoryAllocator::PageDiscard(void* p, size_t size)
+	{
+		//归还物理页，之后再访问得到的是全零的页
+#if defined(_WIN32)
+		VirtualFree(p, size, MEM_DECOMMIT);
+		VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE);
+#else
+		madvise(p, size, MADV_DONTNEED);
+#endif
+	}
+
+	void* MemoryAllocator::LargeAlloc(size_t size)
 	{
-		if (size <= sizeof(MemoryBlock0::data))
+		auto mapped = (size + sizeof(LargeHeader) + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+		LargeHeader* header = nullptr;
 		{
-			MemoryBlock0* mb = mMB0Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock0();
-			else
+			//缓存中大小相近的映射可以直接使用，多出的部分不超过四分之一
+			std::lock_guard<std::mutex> lock(mLargeLock);
+			for (auto it = mLargeCache.begin(); it != mLargeCache.end(); ++it)
 			{
-				mMB0Head = mMB0Head->next;
-				--mMB0Count;
+				if ((*it)->mapped >= mapped && (*it)->mapped - mapped <= mapped / 4)
+				{
+					header = *it;
+					mLargeCache.erase(it);
+					break;
+				}
 			}
-			mb->next = nullptr;
-			return mb->data;
 		}
-		else if (size <= sizeof(MemoryBlock1::data))
+		if (header == nullptr)
 		{
-			MemoryBlock1* mb = mMB1Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock1();
-			else
-			{
-				mMB1Head = mMB1Head->next;
-				--mMB1Count;
-			}
-			mb->next = nullptr;
-			return mb->data;
+			header = reinterpret_cast<LargeHeader*>(PageMap(mapped));
+			header->mapped = mapped;
 		}
-		else if (size <= sizeof(MemoryBlock2::data))
+		return header + 1;
+	}
+
+	void MemoryAllocator::LargeFree(void* p)
+	{
+		auto header = reinterpret_cast<LargeHeader*>(p) - 1;
+		auto mapped = header->mapped;
 		{
-			MemoryBlock2* mb = mMB2Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock2();
-			else
+			std::lock_guard<std::mutex> lock(mLargeLock);
+			if (mLargeCache.size() < LARGE_CACHE_COUNT)
 			{
-				mMB2Head = mMB2Head->next;
-				--mMB2Count;
+				PageDiscard(header, mapped);
+				header->mapped = mapped;
+				mLargeCache.push_back(header);
+				return;
 			}
-			mb->next = nullptr;
-			return mb->data;
 		}
-		else if (size <= sizeof(MemoryBlock3::data))
+		PageUnmap(header, mapped);
+	}
+
+	void MemoryAllocator::SlabUnmap(Slab* slab)
+	{
+#if defined(_WIN32)
+		VirtualFree(slab, 0, MEM_RELEASE);
+#else
+		munmap(slab, SLAB_SIZE);
+#endif
+	}
+
+	void MemoryAllocator::SlabLink(SizeClass& c, Slab* slab)
+	{
+		slab->prev = nullptr;
+		slab->next = c.slabs;
+		if (c.slabs != nullptr)
+			c.slabs->prev = slab;
+		c.slabs = slab;
+		slab->listed = true;
+	}
+
+	void MemoryAllocator::SlabUnlink(SizeClass& c, Slab* slab)
+	{
+		if (slab->prev != nullptr)
+			slab->prev->next = slab->next;
+		else
+			c.slabs = slab->next;
+		if (slab->next != nullptr)
+			slab->next->prev = slab->prev;
+		slab->listed = false;
+	}
+
+	void MemoryAllocator::SlabRelease(Slab* slab)
+	{
+		SlabUnlink(mClasses[slab->sizeClass], slab);
+		if (slab->allPrev != nullptr)
+			slab->allPrev->allNext = slab->allNext;
+		else
+			mSlabs = slab->allNext;
+		if (slab->allNext != nullptr)
+			slab->allNext->allPrev = slab->allPrev;
+		SlabUnmap(slab);
+	}
+
+	void* MemoryAllocator::SlabAllocSlow(size_t sizeClass)
+	{
+		auto& c = mClasses[sizeClass];
+		auto slab = reinterpret_cast<Slab*>(SlabMap());
+		auto header = (sizeof(Slab) + 15) & ~static_cast<size_t>(15);
+		slab->allPrev = nullptr;
+		slab->allNext = mSlabs;
+		if (mSlabs != nullptr)
+			mSlabs->allPrev = slab;
+		mSlabs = slab;
+		slab->free = nullptr;
+		slab->top = reinterpret_cast<uint8_t*>(slab) + header;
+		slab->end = slab->top + (SLAB_SIZE - header) / c.size * c.size;
+		slab->used = 0;
+		slab->sizeClass = sizeClass;
+		SlabLink(c, slab);
+		++c.emptySlabs;
+		return AllocMemory(c.size);
+	}
+
+	void* MemoryAllocator::AllocMemory(size_t size)
+	{
+		if (mPendingAny.load(std::memory_order_acquire))
+			ReclaimPending();
+
+		if (size > SLAB_MAX_OBJECT)
+			return IsLargeObject(size) ? LargeAlloc(size) : new uint8_t[size];
+
+		auto sizeClass = SlabClassOf(size);
+		auto& c = mClasses[sizeClass];
+		auto slab = c.slabs;
+		if (slab == nullptr)
+			return SlabAllocSlow(sizeClass);
+
+		void* p;
+		if (slab->free != nullptr)
 		{
-			MemoryBlock3* mb = mMB3Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock3();
-			else
-			{
-				mMB3Head = mMB3Head->next;
-				--mMB3Count;
-			}
-			mb->next = nullptr;
-			return mb->data;
+			p = slab->free;
+			slab->free = slab->free->next;
 		}
-		else if (size <= sizeof(MemoryBlock4::data))
+		else
 		{
-			MemoryBlock4* mb = mMB4Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock4();
-			else
-			{
-				mMB4Head = mMB4Head->next;
-				--mMB4Count;
-			}
-			mb->next = nullptr;
-			return mb->data;
+			p = slab->top;
+			slab->top += c.size;
 		}
-		else if (size <= sizeof(MemoryBlock5::data))
+		if (slab->used++ == 0)
+			--c.emptySlabs;
+		//用满的 slab 移出链表，有格子释放时再放回
+		if (slab->free == nullptr && slab->top == slab->end)
+			SlabUnlink(c, slab);
+		return p;
+	}
+
+	void MemoryAllocator::SlabFree(Slab* slab, FreeSlot* head, FreeSlot* tail, size_t count)
+	{
+		auto& c = mClasses[slab->sizeClass];
+		tail->next = slab->free;
+		slab->free = head;
+		slab->used -= count;
+		if (!slab->listed)
+			SlabLink(c, slab);
+		if (slab->used == 0)
 		{
-			MemoryBlock5* mb = mMB5Head;
-			if (mb == nullptr)
-				mb = new MemoryBlock5();
+			if (c.emptySlabs >= SLAB_KEEP_EMPTY)
+				SlabRelease(slab);
 			else
-			{
-				mMB5Head = mMB5Head->next;
-				--mMB5Count;
-			}
-			mb->next = nullptr;
-			return mb->data;
+				++c.emptySlabs;
 		}
-		return new uint8_t[size];
 	}
 
 	void MemoryAllocator::FreeMemory(void* p, size_t size)
 	{
-		if (size <= sizeof(MemoryBlock0::data))
-		{
-			MemoryBlock0* mb = reinterpret_cast<MemoryBlock0*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock0*));
-			if (mMB0Count < 32 * 1024)
-			{
-				mb->next = mMB0Head;
-				mMB0Head = mb;
-				++mMB0Count;
-			}
-			else
-			{
-				delete mb;
-			}
-		}
-		else if (size <= sizeof(MemoryBlock1::data))
+		if (IsLargeObject(size))
 		{
-			MemoryBlock1* mb = reinterpret_cast<MemoryBlock1*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock1*));
-			if (mMB1Count < 16 * 1024)
-			{
-				mb->next = mMB1Head;
-				mMB1Head = mb;
-				++mMB1Count;
-			}
-			else
-			{
-				delete mb;
-			}
+			LargeFree(p);
+			return;
 		}
-		else if (size <= sizeof(MemoryBlock2::data))
+		if (size > SLAB_MAX_OBJECT)
 		{
-			MemoryBlock2* mb = reinterpret_cast<MemoryBlock2*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock2*));
-			if (mMB2Count < 8 * 1024)
-			{
-				mb->next = mMB2Head;
-				mMB2Head = mb;
-				++mMB2Count;
-			}
-			else
-			{
-				delete mb;
-			}
+			delete[](reinterpret_cast<uint8_t*>(p));
+			return;
 		}
-		else if (size <= sizeof(MemoryBlock3::data))
+		auto slot = reinterpret_cast<FreeSlot*>(p);
+		SlabFree(SlabOf(p), slot, slot, 1);
+	}
+
+	size_t MemoryAllocator::ReleaseValues(std::vector<HeapValue*>& values)
+	{
+		//按地址排序后同一 slab 中的对象相邻，每个 slab 串成一条链表，最后加锁一次挂到待回收链表；
+		//  大对象直接还给系统
+		std::sort(values.begin(), values.end());
+		std::vector<PendingChain> chains;
+		size_t freed = 0;
+		for (auto v : values)
 		{
-			MemoryBlock3* mb = reinterpret_cast<MemoryBlock3*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock3*));
-			if (mMB3Count < 2 * 1024)
+			auto size = SizeOf(v);
+			freed += size;
+			if (IsLargeObject(size))
 			{
-				mb->next = mMB3Head;
-				mMB3Head = mb;
-				++mMB3Count;
+				LargeFree(v);
+				continue;
 			}
-			else
+			if (size > SLAB_MAX_OBJECT)
 			{
-				delete mb;
+				delete[](reinterpret_cast<uint8_t*>(v));
+				continue;
 			}
-		}
-		else if (size <= sizeof(MemoryBlock4::data))
-		{
-			MemoryBlock4* mb = reinterpret_cast<MemoryBlock4*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock4*));
-			if (mMB4Count < 1024)
+
+			auto slot = reinterpret_cast<FreeSlot*>(v);
+			auto slab = SlabOf(v);
+			if (chains.empty() || chains.back().slab != slab)
 			{
-				mb->next = mMB4Head;
-				mMB4Head = mb;
-				++mMB4Count;
+				chains.push_back({ slab, slot, slot, 1 });
 			}
 			else
 			{
-				delete mb;
+				auto& chain = chains.back();
+				chain.tail->next = slot;
+				chain.tail = slot;
+				++chain.count;
 			}
 		}
-		else if (size <= sizeof(MemoryBlock5::data))
+		if (chains.empty())
+			return freed;
+
+		std::lock_guard<std::mutex> lock(mPendingLock);
+		mPending.insert(mPending.end(), chains.begin(), chains.end());
+		mPendingAny.store(true, std::memory_order_release);
+		return freed;
+	}
+
+	void MemoryAllocator::ReclaimPending(void)
+	{
 		{
-			MemoryBlock5* mb = reinterpret_cast<MemoryBlock5*>(reinterpret_cast<uint8_t*>(p) - sizeof(MemoryBlock5*));
-			if (mMB5Count < 512)
-			{
-				mb->next = mMB5Head;
-				mMB5Head = mb;
-				++mMB5Count;
-			}
-			else
-			{
-				delete mb;
-			}
+			std::lock_guard<std::mutex> lock(mPendingLock);
+			mReclaimed.swap(mPending);
+			mPendingAny.store(false, std::memory_order_relaxed);
 		}
-		else
+		for (auto& chain : mReclaimed)
 		{
-			delete[](reinterpret_cast<uint8_t*>(p));
+			SlabFree(chain.slab, chain.head, chain.tail, chain.count);
 		}
+		mReclaimed.clear();
 	}
 
 	void MemoryAllocator::Clean(void)
 	{
+		ReclaimPending();
+
+		//只释放全空的 slab，常量等仍在使用的对象不受影响
+		auto slab = mSlabs;
+		while (slab != nullptr)
 		{
-			MemoryBlock0* mb = mMB0Head;
-			while (mb != nullptr)
+			auto next = slab->allNext;
+			if (slab->used == 0)
 			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
-				--mMB0Count;
+				--mClasses[slab->sizeClass].emptySlabs;
+				SlabRelease(slab);
 			}
-			mMB0Head = nullptr;
-			mMB0Count = 0;
+			slab = next;
 		}
 
+		std::lock_guard<std::mutex> lock(mLargeLock);
+		for (auto header : mLargeCache)
 		{
-			MemoryBlock1* mb = mMB1Head;
-			while (mb != nullptr)
-			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
-			}
-			mMB1Head = nullptr;
-			mMB1Count = 0;
+			PageUnmap(header, header->mapped);
 		}
+		mLargeCache.clear();
+	}
+
+	Value MemoryAllocator::NewValue(int64_t value)
+	{
+		Value v;
+		v.mType = Value::Integer;
+		v.mValue.iValue = value;
+		return v;
+	}
+	Value MemoryAllocator::NewValue(double value)
+	{
+		Value v;
+		v.mType = Value::Real;
+		v.mValue.dValue = value;
+		return v;
+	}
+	Value MemoryAllocator::NewValue(const std::wstring& value)
+	{
+		return NewValue(value.data(), value.length());
+	}
+	Value MemoryAllocator::NewValue(const wchar_t* value, size_t length)
+	{
+		if (value != nullptr && length == static_cast<size_t>(-1))
+			length = std::wcslen(value);
+
+		auto kind = StringKindOf(value, length);
+		return StringValue(AllocMemory(StringSizeOf(length, kind)), value, length, kind);
+	}
 
+	Value MemoryAllocator::NewUTF8Value(const char* value, size_t size)
+	{
+		//第一遍检查编码并计算长度和存储宽度，第二遍解码；wchar_t 为 2 字节时基本多文种平面以外的字符占两个单元
+		auto p = reinterpret_cast<const uint8_t*>(value);
+		auto end = p + size;
+		size_t length = 0;
+		size_t width = 1;
+		while (p < end)
 		{
-			MemoryBlock2* mb = mMB2Head;
-			while (mb != nullptr)
+			uint32_t c = *p++;
+			size_t extra = c < 0x80 ? 0 : c >= 0xC2 && c < 0xE0 ? 1 : c >= 0xE0 && c < 0xF0 ? 2 : c >= 0xF0 && c < 0xF5 ? 3 : 4;
+			if (extra > 3 || static_cast<size_t>(end - p) < extra)
+				throw Exception(10001, "File is not in the correct format.");
+			c &= extra == 0 ? 0x7F : 0x3F >> extra;
+			for (size_t i = 0; i < extra; ++i, ++p)
 			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
+				if ((*p & 0xC0) != 0x80)
+					throw Exception(10001, "File is not in the correct format.");
+				c = (c << 6) | (*p & 0x3F);
 			}
-			mMB2Head = nullptr;
-			mMB2Count = 0;
+			if (c > 0x10FFFF || (extra == 2 && c < 0x800) || (extra == 3 && c < 0x10000))
+				throw Exception(10001, "File is not in the correct format.");
+			length += sizeof(wchar_t) == 2 && c >= 0x10000 ? 2 : 1;
+			width = std::max(width, HeapValue::StringCharWidth(c));
 		}
 
+		auto kind = HeapValue::StringWidthKind(width);
+		auto v = StringValue(AllocMemory(StringSizeOf(length, kind)), nullptr, length, kind);
+		auto h = v.mValue.hValue;
+		auto latin1 = const_cast<uint8_t*>(h->Latin1Chars());
+		auto ucs2 = const_cast<char16_t*>(h->UCS2Chars());
+		auto wide = h->mValue.sValue.str;
+		size_t i = 0;
+		for (p = reinterpret_cast<const uint8_t*>(value); p < end; ++i)
 		{
-			MemoryBlock3* mb = mMB3Head;
-			while (mb != nullptr)
+			uint32_t c = *p++;
+			size_t extra = c < 0x80 ? 0 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+			c &= extra == 0 ? 0x7F : 0x3F >> extra;
+			for (size_t k = 0; k < extra; ++k, ++p)
 			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
+				c = (c << 6) | (*p & 0x3F);
 			}
-			mMB3Head = nullptr;
-			mMB3Count = 0;
-		}
-
-		{
-			MemoryBlock4* mb = mMB4Head;
-			while (mb != nullptr)
+			switch (kind)
 			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
+			case HeapValue::STRING_LATIN1: latin1[i] = static_cast<uint8_t>(c); break;
+			case HeapValue::STRING_UCS2: ucs2[i] = static_cast<char16_t>(c); break;
+			default:
+				if (sizeof(wchar_t) == 2 && c >= 0x10000)
+				{
+					c -= 0x10000;
+					wide[i++] = static_cast<wchar_t>(0xD800 + (c >> 10));
+					c = 0xDC00 + (c & 0x3FF);
+				}
+				wide[i] = static_cast<wchar_t>(c);
+				break;
 			}
-			mMB4Head = nullptr;
-			mMB4Count = 0;
 		}
+		return v;
+	}
 
+	uint16_t MemoryAllocator::StringKindOf(const wchar_t* value, size_t length)
+	{
+		size_t width = 1;
+		if (value != nullptr)
 		{
-			MemoryBlock5* mb = mMB5Head;
-			while (mb != nullptr)
+			for (size_t i = 0; i < length && width < sizeof(wchar_t); ++i)
 			{
-				auto t = mb->next;
-				delete mb;
-				mb = t;
+				width = std::max(width, HeapValue::StringCharWidth(static_cast<uint32_t>(value[i])));
 			}
-			mMB5Head = nullptr;
-			mMB5Count = 0;
 		}
+		return HeapValue::StringWidthKind(width);
 	}
 
-	Value* MemoryAllocator::NewValue(int64_t value)
+	void MemoryAllocator::StringCopy(HeapValue* to, size_t offset, const HeapValue* from)
 	{
-		auto pValue = reinterpret_cast<Value*>(AllocMemory(sizeof(MemoryBlock0::data)));
-		pValue->mValue.iValue = value;
-		pValue->mType = Value::Integer;
-		pValue->mFlag = 0;
-		return pValue;
+		auto length = from->mValue.sValue.length;
+		if (to->StringKind() == from->StringKind())
+		{
+			auto width = to->StringWidth();
+			memcpy(reinterpret_cast<uint8_t*>(to->mValue.sValue.str) + offset * width, from->mValue.sValue.str, length * width);
+			return;
+		}
+		//只会从较窄的存储复制到较宽的存储
+		switch (to->StringKind())
+		{
+		case HeapValue::STRING_UCS2:
+			std::copy(from->Latin1Chars(), from->Latin1Chars() + length, const_cast<char16_t*>(to->UCS2Chars()) + offset);
+			break;
+		default:
+			if (from->StringKind() == HeapValue::STRING_LATIN1)
+				std::copy(from->Latin1Chars(), from->Latin1Chars() + length, to->mValue.sValue.str + offset);
+			else
+				std::copy(from->UCS2Chars(), from->UCS2Chars() + length, to->mValue.sValue.str + offset);
+			break;
+		}
 	}
-	Value* MemoryAllocator::NewValue(double value)
+
+	Value MemoryAllocator::StringValue(void* memory, const wchar_t* value, size_t length, uint16_t kind)
 	{
-		auto pValue = reinterpret_cast<Value*>(AllocMemory(sizeof(MemoryBlock0::data)));
-		pValue->mValue.dValue = value;
-		pValue->mType = Value::Real;
-		pValue->mFlag = 0;
-		return pValue;
+		auto pValue = reinterpret_cast<HeapValue*>(memory);
+		pValue->mValue.sValue.length = length;
+		pValue->mType = Value::String;
+		pValue->mGeneration = HeapValue::GC_UNTRACKED;
+		pValue->mFlag = kind;
+		pValue->mSlot = 0;
+		auto width = HeapValue::StringKindWidth(kind);
+		auto chars = reinterpret_cast<uint8_t*>(pValue->mValue.sValue.str);
+		if (value == nullptr)
+		{
+			memset(chars, 0, (length + 1) * width);
+		}
+		else
+		{
+			switch (kind)
+			{
+			case HeapValue::STRING_LATIN1: std::copy(value, value + length, chars); break;
+			case HeapValue::STRING_UCS2: std::copy(value, value + length, reinterpret_cast<char16_t*>(chars)); break;
+			default: memcpy(chars, value, length * sizeof(wchar_t)); break;
+			}
+			memset(chars + length * width, 0, width);
+		}
+
+		Value v;
+		v.mType = Value::String;
+		v.mValue.hValue = pValue;
+		return v;
 	}
-	Value* MemoryAllocator::NewValue(const std::wstring& value)
+
+	Value MemoryAllocator::ConcatValue(const Value& left, const Value& right)
 	{
-		return NewValue(value.data(), value.length());
+		auto l = left.mValue.hValue;
+		auto r = right.mValue.hValue;
+		auto length = l->mValue.sValue.length + r->mValue.sValue.length;
+		auto kind = HeapValue::StringWidthKind(std::max(l->StringWidth(), r->StringWidth()));
+		auto v = StringValue(AllocMemory(StringSizeOf(length, kind)), nullptr, length, kind);
+		StringCopy(v.mValue.hValue, 0, l);
+		StringCopy(v.mValue.hValue, l->mValue.sValue.length, r);
+		return v;
 	}
-	Value* MemoryAllocator::NewValue(const wchar_t* value, size_t length)
-	{
-		if (value != nullptr && length == static_cast<size_t>(-1))
-			length = std::wcslen(value);
 
-		size_t baselen = ((size_t) &((Value *)0)->mValue.sValue.str);
-		size_t datalen = (length + 1) * sizeof(wchar_t);
-		auto pValue = reinterpret_cast<Value*>(AllocMemory(baselen + datalen));
-		pValue->mValue.sValue.length = length;
-		if (value != nullptr && length > 0)
-			memcpy(pValue->mValue.sValue.str, value, length * sizeof(wchar_t));
-		pValue->mType = Value::String;
-		pValue->mFlag = 0;
-		return pValue;
+	Value MemoryAllocator::NewValue(size_t row, size_t col, const Value& fill)
+	{
+		return ArrayValue(AllocMemory(ArraySizeOf(row * col)), row, col, fill);
 	}
 
-	Value* MemoryAllocator::NewValue(size_t row, size_t col, Value* fill)
+	Value MemoryAllocator::ArrayValue(void* memory, size_t row, size_t col, const Value& fill)
 	{
 		size_t count = row * col;
-		const size_t baselen = ((size_t) &((Value *)0)->mValue.aValue.data);
-		size_t datalen = (count) * sizeof(Value*);
-		auto pValue = reinterpret_cast<Value*>(AllocMemory(baselen + datalen));
+		auto pValue = reinterpret_cast<HeapValue*>(memory);
 		pValue->mValue.aValue.row = row;
 		pValue->mValue.aValue.col = col;
-		if (fill == nullptr)
-		{
-			fill = BooleanValue(false);
-		}
 
-		for (size_t i = 0; i < count; ++i)
+		//大阵列的内存直接映射自系统，全为零：卡片不用清零，填充逻辑假时元素也不用写入，
+		//  没有写入过的页不占用物理内存
+		bool zeroed = IsLargeObject(ArraySizeOf(count));
+		if (!zeroed)
+			memset(pValue->GCCards(), 0, HeapValue::GCCardCount(count));
+		if (!zeroed || !fill.Is(Value::Boolean) || fill.mValue.bValue)
 		{
-			pValue->mValue.aValue.data[i] = fill;
+			for (size_t i = 0; i < count; ++i)
+			{
+				pValue->mValue.aValue.data[i] = fill;
+			}
 		}
 		pValue->mType = Value::Array;
+		pValue->mGeneration = HeapValue::GC_UNTRACKED;
 		pValue->mFlag = 0;
-		return pValue;
+		pValue->mSlot = 0;
+
+		Value v;
+		v.mType = Value::Array;
+		v.mValue.hValue = pValue;
+		return v;
 	}
 
-	void MemoryAllocator::FreeValue(Value* value)
+	void MemoryAllocator::FreeValue(const Value& value)
+	{
+		if (value.IsHeapValue())
+			FreeValue(value.mValue.hValue);
+	}
+
+	void MemoryAllocator::FreeValue(HeapValue* value)
+	{
+		FreeMemory(value, SizeOf(value));
+	}
+
+	size_t MemoryAllocator::SizeOf(const HeapValue* value)
 	{
-		if (value == mTrue || value == mFalse)
-			return;
 		size_t size=0;
 		switch (value->GetType())
 		{
-		case Value::Integer:
-		case Value::Real:
-		case Value::Boolean:
-			size = sizeof(MemoryBlock0::data);
-			break;
 		case Value::String:
-		{
-			const size_t baselen = ((size_t) &((Value *)0)->mValue.sValue.str);
-			size_t datalen = (value->mValue.sValue.length + 1) * sizeof(wchar_t);
-			size = baselen + datalen;
-		}
-		break;
+			size = value->IsRope() ? RopeSizeOf() : StringSizeOf(value->mValue.sValue.length, value->StringKind());
+			break;
 		case Value::Array:
-		{
-			size_t count = value->mValue.aValue.row * value->mValue.aValue.col;
-			size_t baselen = ((size_t) &((Value *)0)->mValue.aValue.data);
-			size_t datalen = (count) * sizeof(Value*);
-			size = baselen + datalen;
-		}
-		break;
+			size = ArraySizeOf(value->mValue.aValue.row * value->mValue.aValue.col);
+			break;
 		default:
 			assert(true);
 			break;
 		}
-		FreeMemory(value, size);
+		return size;
+	}
+
+	size_t MemoryAllocator::StringSizeOf(size_t length, uint16_t kind)
+	{
+		const size_t baselen = ((size_t) &((HeapValue *)0)->mValue.sValue.str);
+		return baselen + (length + 1) * HeapValue::StringKindWidth(kind);
+	}
+
+	size_t MemoryAllocator::RopeSizeOf(void)
+	{
+		const size_t baselen = ((size_t) &((HeapValue *)0)->mValue.rValue.part);
+		return baselen + 2 * sizeof(Value);
+	}
+
+	size_t MemoryAllocator::ArraySizeOf(size_t count)
+	{
+		const size_t baselen = ((size_t) &((HeapValue *)0)->mValue.aValue.data);
+		return baselen + count * sizeof(Value) + HeapValue::GCCardCount(count);
 	}
 }
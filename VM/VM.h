@@ -3,14 +3,41 @@
 #include <fstream>
 #include <vector>
 #include <list>
+#include <deque>
 #include <string>
 #include <cstdint>
 #include <exception>
 #include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+// 指令分派方式：
+//   BYTE_CODE_VM_CALL_DISPATCH   每条指令通过成员函数指针调用（原实现，保留用于对比）
+//   BYTE_CODE_VM_SWITCH_DISPATCH 线索化解释器，使用 switch 分派
+//   默认                         GCC/Clang 上使用计算跳转(computed goto)，其它编译器退化为 switch
+#if !defined(BYTE_CODE_VM_CALL_DISPATCH) && !defined(BYTE_CODE_VM_SWITCH_DISPATCH)
+#if defined(__GNUC__) || defined(__clang__)
+#define BYTE_CODE_VM_COMPUTED_GOTO
+#else
+#define BYTE_CODE_VM_SWITCH_DISPATCH
+#endif
+#endif
+
+// 基线 JIT：x86-64 上默认启用，定义 BYTE_CODE_VM_NO_JIT 可在编译期关闭；
+// 逐条调用分派方式没有可供 JIT 挂接的分派循环，不启用
+#if !defined(BYTE_CODE_VM_NO_JIT) && !defined(BYTE_CODE_VM_CALL_DISPATCH) && (defined(__x86_64__) || defined(_M_X64))
+#define BYTE_CODE_VM_JIT
+#endif
 
 namespace VM
 {
 	class Engine;
+	class JIT;
+	class AOT;
 
 	enum class InstructionID : uint16_t
 	{
@@ -41,12 +68,57 @@ namespace VM
 		PUSH,
 		RET,
 		SUB,
-		SD
+		SD,
+		//以下指令仅在虚拟机内部使用，不会出现在字节码文件中
+		HALT,
+		//类型特化指令，由通用指令在运行时改写而来
+		ADD_II,
+		ADD_RR,
+		ADD_SS,
+		SUB_II,
+		SUB_RR,
+		MUL_II,
+		MUL_RR,
+		DIV_II,
+		DIV_RR,
+		LT_II,
+		LT_RR,
+		GT_II,
+		GT_RR,
+		EQ_II,
+		EQ_RR,
+		//opcode 统计模式下替换每一条指令，记录后再转到原指令
+		PROFILE,
+		//超级指令，由加载时的融合过程生成，融合规则见 FUSION_RULES
+		LD_LC_ADD_SD,
+		LD_LD_ADD_SD,
+		LD_LC_SUB_SD,
+		LD_LD_LT_JMPN,
+		LD_LC_LT_JMPN,
+		LD_LD_GT_JMPN,
+		LD_LC_GT_JMPN,
+		//全局变量读写：加载时把以字符串常量为变量名的 "LC 变量名; CALLSYS 读/写全局变量" 改写而来，
+		//  按加载时解析好的槽位直接读写
+		LDG,
+		STG,
+		INSTRUCTION_COUNT
 	};
 
+	const char* GetInstructionName(InstructionID id);
+
+	struct HeapValue;
+	class StringCursor;
+
+	//值对象：整数、实数、逻辑量直接保存在值内，只有字符串和阵列引用堆上的 HeapValue
 	struct Value
 	{
 		friend class MemoryAllocator;
+		friend class MemoryGC;
+		friend class Engine;
+		friend class JIT;
+		friend class AOT;
+		friend class HeapSnapshot;
+		friend class StringCursor;
 	public:
 		typedef enum : uint8_t
 		{
@@ -57,16 +129,20 @@ namespace VM
 			Array
 		}Type;
 	public:
-		Value(void) = delete;
-		Value(const Value&) = delete;
+		Value(void) :
+			mType(Boolean),
+			mValue()
+		{
+		}
 	public:
 		Type GetType(void) const { return mType; }
 		bool Is(Type type) const { return mType == type; }
-		bool VEquals(const Value* value)const;
+		bool IsHeapValue(void) const { return mType == String || mType == Array; }
+		bool VEquals(const Value& value)const;
 
 		bool AsBoolean(void) const;
 		void AsString(std::wstring& s) const;
-		std::wstring AsString(void)
+		std::wstring AsString(void) const
 		{
 			std::wstring s;
 			AsString(s);
@@ -74,233 +150,723 @@ namespace VM
 		}
 		double AsReal(void) const;
 		int64_t AsInteger(void) const;
+		//按顺序以 (字符指针, 长度) 调用 visit 访问字符串内容：拼接串逐段访问，不展开为连续的存储；
+		//  其它类型先转换为字符串
+		template<typename Visitor>
+		void VisitString(Visitor visit) const;
+		//按存储方式逐段访问字符串内容，不转换为 wchar_t：visit 须接受 (const uint8_t*, size_t)（Latin-1）、
+		//  (const char16_t*, size_t) 和 (const wchar_t*, size_t) 三种调用；只能用于字符串
+		template<typename Visitor>
+		void VisitStringStorage(Visitor& visit) const;
+		//转换为 UTF-8，字符串直接从存储编码，不经过 std::wstring
+		void AsUTF8(std::string& s) const;
+		//非字符串的值转换为字符串时最多需要的字符数（含结尾的 0）
+		static const size_t TEXT_BUFFER_SIZE = 512;
+		//把非字符串的值按 AsString 的格式写到 buffer（至少 TEXT_BUFFER_SIZE 个字符），返回字符数，不分配内存
+		size_t FormatText(wchar_t* buffer) const;
+		//转换为字符串后的长度，不生成字符串
+		size_t StringLength(void) const;
 	public:
 		size_t GetRow(void)const;
 		size_t GetCol(void)const;
-		Value* GetValue(size_t r, size_t c) const;
-		void SetValue(size_t r, size_t c, Value* v);
-	public:
-		void GCMarkSet(void)
-		{
-			mFlag |= 0x01;
-
-			if (Is(Array))
-			{
-				if ((mFlag & 0x80) != 0)
-					return;
-
-				auto d = mValue.aValue.data;
-				auto e = d+(mValue.aValue.row * mValue.aValue.col);
-				mFlag |= 0x80;
-				while (d < e)
-				{
-					(*d)->GCMarkSet();
-					++d;
-				}
-				mFlag &= 0x7F;
-			}
-		}
-		void GCMarkClear(void)
+		Value GetValue(size_t r, size_t c) const;
+		void SetValue(size_t r, size_t c, const Value& v);
+	private:
+		//大阵列中从未写入的元素是全零的内存，类型字节为 0，读取时当作逻辑假
+		static Value Element(const Value& slot) { return slot.mType != 0 ? slot : Value(); }
+	private:
+		Type mType;
+		union
 		{
-			mFlag &= 0xFE;
-		}
-		bool IsGCMarked(void) const { return (mFlag & 0x01) != 0; }
-		bool IsGCMarkFreed(void) const { return (mFlag & 0x01) == 0; }
+			int64_t iValue;
+			double dValue;
+			bool bValue;
+			HeapValue* hValue;
+		} mValue;
+	};
 
-		int GCMarkAddCount(void)
+	struct HeapValue
+	{
+		friend struct Value;
+		friend class MemoryAllocator;
+		friend class MemoryGC;
+		friend class JIT;
+		friend class AOT;
+		friend class HeapSnapshot;
+		friend class StringCursor;
+	public:
+		HeapValue(void) = delete;
+		HeapValue(const HeapValue&) = delete;
+	public:
+		Value::Type GetType(void) const { return mType; }
+		bool Is(Value::Type type) const { return mType == type; }
+		//拼接串：字符串拼接时不复制内容，只记录左右两部分（都是字符串），需要连续的内容时再按顺序读出
+		bool IsRope(void) const { return (mFlag & 0x08) != 0; }
+	public:
+		//字符串按内容中最大的字符决定每个字符占用的字节数，同样的内容总是同样的存储方式：
+		//  Latin-1 一个字节；wchar_t 为 4 字节时，基本多文种平面内的内容两个字节；其余使用 wchar_t
+		static const uint16_t STRING_LATIN1 = 0x10;
+		static const uint16_t STRING_UCS2 = 0x20;
+		static const uint16_t STRING_KIND_MASK = 0x30;
+		uint16_t StringKind(void) const { return mFlag & STRING_KIND_MASK; }
+		size_t StringWidth(void) const { return StringKindWidth(StringKind()); }
+		static size_t StringKindWidth(uint16_t kind) { return kind == STRING_LATIN1 ? 1 : kind == STRING_UCS2 ? 2 : sizeof(wchar_t); }
+		static uint16_t StringWidthKind(size_t width) { return width == 1 ? STRING_LATIN1 : width == 2 && sizeof(wchar_t) > 2 ? STRING_UCS2 : 0; }
+		//能容纳字符 c 的最小宽度
+		static size_t StringCharWidth(uint32_t c) { return c < 0x100 ? 1 : c < 0x10000 ? 2 : sizeof(wchar_t); }
+		const uint8_t* Latin1Chars(void) const { return reinterpret_cast<const uint8_t*>(mValue.sValue.str); }
+		const char16_t* UCS2Chars(void) const { return reinterpret_cast<const char16_t*>(mValue.sValue.str); }
+		const wchar_t* WideChars(void) const { return mValue.sValue.str; }
+		//驻留字符串：由 MemoryGC 统一保存、内容互不相同的普通字符串，不被 GC 跟踪，mSlot 保存内容的散列值
+		bool IsInterned(void) const { return (mFlag & 0x40) != 0; }
+		uint32_t InternedHash(void) const { return mSlot; }
+	public:
+		//未被 GC 跟踪的对象（常量等）的代号
+		static const uint8_t GC_UNTRACKED = 0xFF;
+		//每张卡片覆盖的阵列元素个数（2 的幂）
+		static const size_t GC_CARD_SHIFT = 6;
+		static size_t GCCardCount(size_t count) { return (count + (static_cast<size_t>(1) << GC_CARD_SHIFT) - 1) >> GC_CARD_SHIFT; }
+	public:
+		uint8_t GCGeneration(void) const { return mGeneration; }
+		//卡片表紧跟在阵列元素之后，每张卡片一个字节
+		uint8_t* GCCards(void) { return reinterpret_cast<uint8_t*>(mValue.aValue.data + mValue.aValue.row * mValue.aValue.col); }
+		void GCCardMark(size_t index)
 		{
-			int r;
-			mFlag &= 0xC0;
-			r = ((mFlag >> 6) + 1);
-			mFlag |= static_cast<uint16_t>(r << 6);
-			return r;
+			GCCards()[index >> GC_CARD_SHIFT] = 1;
+			mFlag |= 0x02;
 		}
-
-		void GCMarkClearCount(void)
+		void GCCardClear(void) { mFlag &= 0xFD; }
+		bool IsGCCardDirty(void) const { return (mFlag & 0x02) != 0; }
+		//新生代对象被复制出去后，原位置记录新地址
+		void GCForward(HeapValue* to)
 		{
-			mFlag &= 0xC0;
+			*reinterpret_cast<HeapValue**>(&mValue) = to;
+			mFlag |= 0x04;
 		}
+		bool IsGCForwarded(void) const { return (mFlag & 0x04) != 0; }
+		HeapValue* GCForwardAddress(void) const { return *reinterpret_cast<HeapValue* const*>(&mValue); }
+		//对象中引用其它对象的部分：阵列的元素、拼接串的左右两部分，普通字符串没有
+		bool GCHasChildren(void) const { return mType == Value::Array || IsRope(); }
+		Value* GCChildrenBegin(void) { return mType == Value::Array ? mValue.aValue.data : mValue.rValue.part; }
+		Value* GCChildrenEnd(void) { return mType == Value::Array ? mValue.aValue.data + mValue.aValue.row * mValue.aValue.col : mValue.rValue.part + 2; }
 	private:
-		Type mType;
-		uint8_t mReserved;
+		Value::Type mType;
+		uint8_t mGeneration;
 		uint16_t mFlag;
+		//对象在所属代跟踪表中的位置，也是它在该代标记位图中的位置
+		uint32_t mSlot;
 		union
 		{
-			int64_t iValue;
-			double dValue;
-			bool bValue;
-
 			struct
 			{
 				size_t length;
 				wchar_t str[2];
 			}sValue;
 
+			//length 与 sValue.length 位置相同
+			struct
+			{
+				size_t length;
+				Value part[2];
+			}rValue;
+
 			struct
 			{
 				size_t row;
 				size_t col;
-				Value* data[1];
+				Value data[1];
 			}aValue;
 		} mValue;
 	};
 
+	//按顺序逐段读取字符串的存储：Fill 取得当前段（没有更多内容时返回 false），Skip 向后移动；
+	//  普通字符串和栈上的缓冲区不分配内存，拼接串只为还没读到的右半部分分配栈
+	class StringCursor
+	{
+	public:
+		explicit StringCursor(const HeapValue* value) :
+			mNext(value),
+			mData(nullptr),
+			mKind(0),
+			mLength(0)
+		{
+		}
+		StringCursor(const wchar_t* value, size_t length) :
+			mNext(nullptr),
+			mData(value),
+			mKind(0),
+			mLength(length)
+		{
+		}
+	public:
+		bool Fill(void)
+		{
+			while (mLength == 0)
+			{
+				auto h = mNext;
+				if (h == nullptr)
+				{
+					if (mPending.empty())
+						return false;
+					h = mPending.back();
+					mPending.pop_back();
+				}
+				mNext = nullptr;
+				//反复在末尾拼接得到的拼接串很深，用显式的栈保存还没访问的右半部分
+				while (h->IsRope())
+				{
+					mPending.push_back(h->mValue.rValue.part[1].mValue.hValue);
+					h = h->mValue.rValue.part[0].mValue.hValue;
+				}
+				mData = h->mValue.sValue.str;
+				mKind = h->StringKind();
+				mLength = h->mValue.sValue.length;
+			}
+			return true;
+		}
+		void Skip(size_t count)
+		{
+			mData = static_cast<const uint8_t*>(mData) + count * HeapValue::StringKindWidth(mKind);
+			mLength -= count;
+		}
+		//当前段：存储方式、剩余的字符数和内容
+		uint16_t Kind(void) const { return mKind; }
+		size_t Length(void) const { return mLength; }
+		const void* Data(void) const { return mData; }
+	private:
+		const HeapValue* mNext;
+		std::vector<const HeapValue*> mPending;
+		const void* mData;
+		uint16_t mKind;
+		size_t mLength;
+	};
+
+	template<typename Visitor>
+	void Value::VisitStringStorage(Visitor& visit) const
+	{
+		StringCursor cursor(mValue.hValue);
+		while (cursor.Fill())
+		{
+			switch (cursor.Kind())
+			{
+			case HeapValue::STRING_LATIN1: visit(static_cast<const uint8_t*>(cursor.Data()), cursor.Length()); break;
+			case HeapValue::STRING_UCS2: visit(static_cast<const char16_t*>(cursor.Data()), cursor.Length()); break;
+			default: visit(static_cast<const wchar_t*>(cursor.Data()), cursor.Length()); break;
+			}
+			cursor.Skip(cursor.Length());
+		}
+	}
+
+	//把窄存储的内容分批转换到栈上的缓冲区，再交给只接受 wchar_t 的访问函数
+	template<typename Visitor>
+	struct WideStringVisitor
+	{
+		Visitor& visit;
+		void operator()(const wchar_t* s, size_t length) { visit(s, length); }
+		template<typename Char>
+		void operator()(const Char* s, size_t length)
+		{
+			wchar_t buffer[256];
+			while (length > 0)
+			{
+				auto n = length < 256 ? length : 256;
+				for (size_t i = 0; i < n; ++i)
+				{
+					buffer[i] = static_cast<wchar_t>(s[i]);
+				}
+				visit(static_cast<const wchar_t*>(buffer), n);
+				s += n;
+				length -= n;
+			}
+		}
+	};
+
+	template<typename Visitor>
+	void Value::VisitString(Visitor visit) const
+	{
+		if (!Is(String))
+		{
+			wchar_t buffer[TEXT_BUFFER_SIZE];
+			auto length = FormatText(buffer);
+			visit(static_cast<const wchar_t*>(buffer), length);
+			return;
+		}
+		WideStringVisitor<Visitor> wide = { visit };
+		VisitStringStorage(wide);
+	}
+
 	class MemoryAllocator
 	{
+		friend class MemoryGC;
 	public:
 		MemoryAllocator() ;
 		~MemoryAllocator();
 	public:
-		Value* NewValue(int64_t value);
-		Value* NewValue(double value);
-		Value* NewValue(const std::wstring& value);
-		Value* NewValue(const wchar_t* value, size_t length);
-		Value* NewValue(size_t row, size_t col, Value* fill = nullptr);
-		void FreeValue(Value* value);
+		Value NewValue(int64_t value);
+		Value NewValue(double value);
+		Value NewValue(const std::wstring& value);
+		Value NewValue(const wchar_t* value, size_t length);
+		//直接从 UTF-8 解码到字符串的存储，内容不是有效的 UTF-8 时抛出异常
+		Value NewUTF8Value(const char* value, size_t size);
+		Value NewValue(size_t row, size_t col, const Value& fill = Value());
+		Value ConcatValue(const Value& left, const Value& right);
+		void FreeValue(const Value& value);
+		void FreeValue(HeapValue* value);
+		//可在其它线程调用：释放的内存先挂到待回收链表，由分配线程在下次分配时取回；会打乱 values 的顺序，
+		//  返回释放的字节数
+		size_t ReleaseValues(std::vector<HeapValue*>& values);
 	public:
 		void Clean(void);
 	public:
-		static Value* BooleanValue(bool value);
+		static Value BooleanValue(bool value);
+		static size_t SizeOf(const HeapValue* value);
+		static size_t StringSizeOf(size_t length, uint16_t kind);
+		static uint16_t StringKindOf(const wchar_t* value, size_t length);
+		static size_t RopeSizeOf(void);
+		static size_t ArraySizeOf(size_t count);
 	private:
-		static Value* InitBoolean(bool value);
-	private:
-		static Value* mTrue;
-		static Value* mFalse;
+		//在已分配的内存上构造字符串、阵列；value 为空时字符串内容全为 0
+		static Value StringValue(void* memory, const wchar_t* value, size_t length, uint16_t kind);
+		static Value ArrayValue(void* memory, size_t row, size_t col, const Value& fill);
+		//把普通字符串 from 的内容复制到 to 的第 offset 个字符处，to 的存储不比 from 窄
+		static void StringCopy(HeapValue* to, size_t offset, const HeapValue* from);
 	private:
 		void* AllocMemory(size_t size);
 		void FreeMemory(void*p, size_t size);
+		void ReclaimPending(void);
 	private:
-		struct MemoryBlock0
+		//小对象按大小分级，从按 SLAB_SIZE 对齐的整页（slab）中分配，对象前没有额外的头部；
+		//  空闲格子的开头存放下一个空闲格子的地址，整页都空闲时还给系统
+		static const size_t SLAB_SIZE = 64 * 1024;
+		static const size_t SLAB_MAX_OBJECT = 2048;
+		static const size_t SLAB_CLASS_COUNT = 24;
+		//每个大小级别最多保留几个全空的 slab，避免反复向系统申请
+		static const size_t SLAB_KEEP_EMPTY = 1;
+		struct FreeSlot
 		{
-			MemoryBlock0* next;
-			uint8_t data[((size_t) &((Value *)0)->mValue.dValue)+sizeof(double)];
+			FreeSlot* next;
 		};
-
-		struct MemoryBlock1
+		struct Slab
 		{
-			MemoryBlock1* next;
-			uint8_t data[sizeof(Value)];
+			Slab* prev;			//所属大小级别中还有空闲格子的 slab 链表
+			Slab* next;
+			Slab* allPrev;		//全部 slab 链表
+			Slab* allNext;
+			FreeSlot* free;
+			uint8_t* top;		//从未分配过的空间从这里开始
+			uint8_t* end;
+			size_t used;
+			size_t sizeClass;
+			bool listed;
 		};
-
-		struct MemoryBlock2
+		typedef struct
 		{
-			MemoryBlock2* next;
-			uint8_t data[sizeof(Value) + 32];
-		};
+			size_t size;
+			Slab* slabs;
+			size_t emptySlabs;
+		}SizeClass;
+		static size_t SlabClassOf(size_t size);
+		static Slab* SlabOf(const void* p) { return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(p) & ~(SLAB_SIZE - 1)); }
+		static void* SlabMap(void);
+		static void SlabUnmap(Slab* slab);
+		void* SlabAllocSlow(size_t sizeClass);
+		void SlabFree(Slab* slab, FreeSlot* head, FreeSlot* tail, size_t count);
+		void SlabLink(SizeClass& c, Slab* slab);
+		void SlabUnlink(SizeClass& c, Slab* slab);
+		void SlabRelease(Slab* slab);
 
-		struct MemoryBlock3
-		{
-			MemoryBlock3* next;
-			uint8_t data[sizeof(Value) + 128];
-		};
+		SizeClass mClasses[SLAB_CLASS_COUNT];
+		Slab* mSlabs;
 
-		struct MemoryBlock4
+		//超过该大小的对象直接向系统映射内存，新映射的页全为零，不访问就不占用物理内存；
+		//  释放时把物理页还给系统，映射留作缓存，再次使用时仍是全零的页
+		static const size_t LARGE_OBJECT_SIZE = 256 * 1024;
+		static const size_t LARGE_PAGE_SIZE = 4096;
+		static const size_t LARGE_CACHE_COUNT = 4;
+		typedef struct
 		{
-			MemoryBlock4* next;
-			uint8_t data[sizeof(Value) + 256];
-		};
+			size_t mapped;
+			size_t reserved;	//保持对象按 16 字节对齐
+		}LargeHeader;
+		static bool IsLargeObject(size_t size) { return size > LARGE_OBJECT_SIZE; }
+		static void* PageMap(size_t size);
+		static void PageUnmap(void* p, size_t size);
+		static void PageDiscard(void* p, size_t size);
+		void* LargeAlloc(size_t size);
+		void LargeFree(void* p);
+		std::mutex mLargeLock;
+		std::vector<LargeHeader*> mLargeCache;
 
-		struct MemoryBlock5
+		//其它线程释放的对象按所在 slab 串成链表，由分配线程在下次分配时取回
+		typedef struct
 		{
-			MemoryBlock5* next;
-			uint8_t data[sizeof(Value) + 512];
-		};
-
-		size_t mMB0Count;
-		size_t mMB1Count;
-		size_t mMB2Count;
-		size_t mMB3Count;
-		size_t mMB4Count;
-		size_t mMB5Count;
-		MemoryBlock0* mMB0Head;
-		MemoryBlock1* mMB1Head;
-		MemoryBlock2* mMB2Head;
-		MemoryBlock3* mMB3Head;
-		MemoryBlock4* mMB4Head;
-		MemoryBlock5* mMB5Head;
+			Slab* slab;
+			FreeSlot* head;
+			FreeSlot* tail;
+			size_t count;
+		}PendingChain;
+		std::mutex mPendingLock;
+		std::atomic<bool> mPendingAny;
+		std::vector<PendingChain> mPending;
+		std::vector<PendingChain> mReclaimed;
 	};
 
+	typedef enum : uint8_t
+	{
+		GCGenerational,		//只回收已满的最老一代及比它年轻的各代（默认）
+		GCFull				//每次回收都回收全部老年代，堆占用最小，停顿最长
+	}GCPolicy;
+
+	typedef struct
+	{
+		size_t nurseryBytes;			//新生代的初始大小，也是两次回收之间允许分配的字节数，在 Start 时生效
+		size_t generationLimits[4];		//1~3 代的对象数达到该值时回收该代，存活对象晋升到下一代；0 代每次都回收，[0] 只用于预留跟踪表容量
+		size_t maxHeapBytes;			//堆占用上限，回收全部老年代后仍超过时报错；为 0 时不限制
+		GCPolicy policy;
+		size_t markThreads;				//老年代标记使用的线程数，为 1 时只在当前线程标记
+		size_t incrementalBudget;		//老年代增量标记每段的最长耗时（微秒），为 0 时老年代回收一次完成
+		//自适应调节：按测得的停顿、回收耗时占比和存活率调整新生代大小与各代触发回收的对象数；
+		//  老年代回收的停顿超过目标且未设置增量标记时自动改用增量标记。目标停顿为 0 时不调节
+		size_t pauseTargetMicroseconds;
+		size_t gcTimePercent;			//回收耗时占总运行时间的目标百分比
+	}GCConfig;
+
+	//存活对象按大小分级：第 i 级为不超过 (16 << i) 字节的对象，最后一级包含所有更大的对象
+	static const size_t GC_HISTOGRAM_BUCKETS = 20;
+	typedef struct
+	{
+		uint64_t collections[4];		//各代被回收的次数
+		uint64_t incrementalSlices;
+		uint64_t allocatedBytes;		//Start 以来分配的字节数
+		uint64_t freedBytes;			//Start 以来已释放的字节数
+		uint64_t pauses;				//回收和增量标记造成的停顿
+		uint64_t totalPauseMicroseconds;
+		uint64_t maxPauseMicroseconds;
+		size_t heapBytes;				//当前堆占用，含新生代和待清扫的对象
+		size_t peakHeapBytes;
+		size_t nurseryBytes;			//新生代已使用的字节数，其中的对象不计入下面的统计
+		size_t nurseryCapacity;			//自适应调节后的新生代大小
+		size_t objects[4];				//各代跟踪的对象数及字节数
+		size_t bytes[4];
+		size_t histogramObjects[GC_HISTOGRAM_BUCKETS];
+		size_t histogramBytes[GC_HISTOGRAM_BUCKETS];
+	}GCStats;
+
+	//全局变量槽：remembered 表示自上次 0 代回收以来该变量已记录在写屏障的记忆集中
+	typedef struct
+	{
+		Value value;
+		bool remembered;
+	}GlobalSlot;
+
 	class MemoryGC
 	{
+		friend class HeapSnapshot;
 	public:
 		MemoryGC(const MemoryGC&) = delete;
 		MemoryGC(void);
 		~MemoryGC(void);
 	public:
 		void GC(Engine* engine);
-		void CheckMemoryGC(Engine* engine);
-		Value* NewIntegerValue(int32_t value);
-		Value* NewIntegerValue(uint32_t value);
-		Value* NewIntegerValue(int64_t value);
-		Value* NewIntegerValue(uint64_t value);
-		Value* NewRealValue(float value);
-		Value* NewRealValue(double value);
-		Value* NewStringValue(const std::wstring& value);
-		Value* NewStringValue(const wchar_t* value, size_t length);
-		Value* NewBooleanValue(bool value);
-		Value* NewArrayValue(size_t row, size_t col, Value* fill = nullptr);
+		//GC 安全点：只在分配数据已全部入栈后调用，新分配字节数超过阈值时才回收，增量标记期间还会执行一段标记
+		void CheckMemoryGC(Engine* engine)
+		{
+			if (mAllocatedBytes >= mCheckpoint)
+				GCStep(engine);
+		}
+		Value NewIntegerValue(int32_t value);
+		Value NewIntegerValue(uint32_t value);
+		Value NewIntegerValue(int64_t value);
+		Value NewIntegerValue(uint64_t value);
+		Value NewRealValue(float value);
+		Value NewRealValue(double value);
+		Value NewStringValue(const std::wstring& value);
+		Value NewStringValue(const wchar_t* value, size_t length);
+		Value NewBooleanValue(bool value);
+		Value NewStringValue(const Value& left, const Value& right);
+		//截取字符串 value 从 start 开始的 length 个字符，按截取的内容重新决定存储宽度
+		Value NewStringValue(const Value& value, size_t start, size_t length);
+		Value NewArrayValue(size_t row, size_t col, const Value& fill = Value());
+		//驻留字符串：内容相同时返回同一个对象，比较地址即可判断内容是否相同；Start、Clean 不释放它们，
+		//  由 ClearInterned 统一释放。value 不是字符串时先转换为字符串
+		Value InternString(const Value& value);
+		Value InternString(const wchar_t* value, size_t length);
+		//只查找不创建，没有时返回 nullptr
+		const HeapValue* FindInternedString(const Value& value) const;
+		const HeapValue* FindInternedString(const wchar_t* value, size_t length) const;
+		void ClearInterned(void);
 
+		//默认配置：新生代 2MB，1~3 代分别在 64K、128K、512K 个对象时回收，标记线程数为 CPU 核数，
+		//  目标停顿 10ms，回收耗时占比 5%
+		static GCConfig DefaultConfig(void);
+		void SetConfig(const GCConfig& config);
+		const GCConfig& GetConfig(void) const { return mConfig; }
+		void SetMarkThreads(size_t count) { mConfig.markThreads = count > 0 ? count : 1; }
+		size_t GetMarkThreads(void) const { return mConfig.markThreads; }
+		void SetIncrementalBudget(size_t microseconds) { mConfig.incrementalBudget = mIncrementalBudget = microseconds; }
+		size_t GetIncrementalBudget(void) const { return mConfig.incrementalBudget; }
+		//统计信息；直方图需要遍历所有跟踪的对象，只在需要时调用
+		GCStats Stats(void) const;
+		size_t HeapBytes(void) const
+		{
+			return mOldBytes - mSweptBytes.load(std::memory_order_relaxed) + static_cast<size_t>(mNurseryTop - mNursery);
+		}
+		//当前线程上是否有进行中的增量标记，写屏障据此记录老年代阵列的所有写入
+		static bool IsIncrementalMarking(void) { return sIncrementalMarking != 0; }
+		//分配位置：分配对象的指令序号，未开启跟踪或不在指令中分配时为 UNKNOWN_SITE；新生代对象需要顺序查找
+		static const uint32_t UNKNOWN_SITE = 0xFFFFFFFF;
+		uint32_t AllocationSite(const HeapValue* v) const;
+		//由 Engine 在加载程序后调用，engine 为空时不跟踪
+		void TrackAllocationSites(const Engine* engine);
+		//堆占用首次达到 bytes 时在安全点调用一次 callback，可用于在运行中途写入堆快照
+		void SetHeapWatch(size_t bytes, std::function<void(Engine*)> callback);
 	public:
 		void Start(void);
 		void Clean(void);
+		//写屏障：全局变量表写入新生代对象时记录该变量，0 代回收只需扫描这些变量；
+		//  每个变量在两次 0 代回收之间只记录一次，反复写入不会使记忆集增长
+		void GCRememberGlobal(GlobalSlot& slot)
+		{
+			if (!slot.remembered && slot.value.IsHeapValue() && slot.value.mValue.hValue->GCGeneration() == 0)
+			{
+				slot.remembered = true;
+				mRememberedGlobals.push_back(&slot);
+			}
+		}
 	private:
-		void GCMarkRoots(Engine* engine);
-		void GCGenerationMarkClear(int gen);
+		//新生代：连续内存上按指针递增分配，回收时把存活对象复制到老年代
+		static const size_t NURSERY_LARGE_OBJECT = 32 * 1024;
+		//自适应调节时新生代大小的范围
+		static const size_t NURSERY_MIN_BYTES = 256 * 1024;
+		static const size_t NURSERY_MAX_BYTES = 16 * 1024 * 1024;
+		//拼接结果短于该长度时直接复制为普通字符串；拼接串右半部分较短时与新内容合并，避免产生大量很短的片段
+		static const size_t ROPE_MIN_LENGTH = 64;
+		bool IsNursery(const HeapValue* v) const
+		{
+			auto p = reinterpret_cast<const uint8_t*>(v);
+			return p >= mNursery && p < mNurseryEnd;
+		}
+		void* GCAllocate(size_t size);
+		void GCEvacuate(Value& v);
+		void GCEvacuateCards(HeapValue* array);
+		void GCScavenge(Engine* engine);
+		//待扫描的阵列元素或拼接串左右两部分的区间，大阵列拆成多段以便多个线程分担
+		typedef struct
+		{
+			Value* begin;
+			Value* end;
+		}MarkRange;
+		static const size_t MARK_RANGE_SIZE = 1024;
+		//扫描阵列元素时提前预取其后第几个元素指向的对象头
+		static const size_t MARK_PREFETCH_DISTANCE = 8;
+		//标记位不写入对象头部：每一代按对象在跟踪表中的位置保存一张位图，清除标记只需清零位图
+		typedef size_t MarkWord;
+		static const size_t MARK_WORD_BITS = sizeof(MarkWord) * 8;
+		static bool GCBitTest(const std::vector<MarkWord>& bits, size_t index)
+		{
+			return ((bits[index / MARK_WORD_BITS] >> (index % MARK_WORD_BITS)) & 1) != 0;
+		}
+		bool GCIsMarked(const HeapValue* v) const { return GCBitTest(mMarkBits[v->mGeneration], v->mSlot); }
+		bool GCTryMark(const HeapValue* v);
+		//并行标记时多个线程可能同时标记同一对象，返回是否由本次调用完成标记
+		bool GCTryMarkAtomic(const HeapValue* v);
+		void GCAppend(int gen, HeapValue* v);
+		//被回收各代的对象数达到该值时才启用并行标记
+		static const size_t PARALLEL_MARK_MIN_OBJECTS = 64 * 1024;
+		static void GCMarkPushChildren(HeapValue* value, std::vector<MarkRange>& stack);
+		void GCMark(const Value& v, int gen);
+		void GCMarkRange(const MarkRange& r, int gen);
+		void GCMarkDrain(int gen);
+		void GCMarkParallel(int gen);
+		void GCMarkCards(HeapValue* array, int gen);
+		void GCCardRefresh(HeapValue* array);
+		//不可达对象交给后台清扫线程释放
+		void GCSweep(std::vector<HeapValue*>& dead);
+		void GCSweepWait(void);
+		void GCSweeperMain(void);
+		void GCMarkRoots(Engine* engine, int gen);
+		void GCMarkFinish(int gen);
+		//增量标记：每分配 INCREMENTAL_STEP_DIVISOR 分之一阈值的内存执行一段，回收新生代时若已标记完则结束本轮
+		static const size_t INCREMENTAL_STEP_DIVISOR = 16;
+		//增量标记跨越的新生代回收次数达到该值时，剩余的标记一次完成，避免老年代无限增长
+		static const size_t INCREMENTAL_MAX_SCAVENGES = 8;
+		void GCStep(Engine* engine);
+		void GCMarkSlice(void);
+		void GCMarkAbort(void);
+		void GCEnforceLimit(Engine* engine);
+		//pause 为本次停顿，gcTime 为上次回收以来的全部停顿（含增量标记），elapsed 为上次回收以来经过的时间
+		void GCAdapt(uint64_t pause, uint64_t gcTime, uint64_t elapsed);
+		void GCResizeNursery(size_t size);
+		void GCCollect(int gen);
 		void GCGenerationClean(int gen);
+		void GCTrack(const Value& v);
+		//新生代对象的分配位置按分配顺序记录，回收时转给复制出去的对象；老年代对象的分配位置保存在散列表中
+		void GCTrackSite(HeapValue* v);
+		void GCScavengeSites(void);
+		HeapValue* InternFind(const StringCursor& text, size_t length, uint32_t hash) const;
+		Value InternInsert(const StringCursor& text, size_t length, uint32_t hash);
 	public:
 		MemoryAllocator& RawMemory(void) { return mMemoryPool; }
 	private:
 		MemoryAllocator mMemoryPool;
+		GCConfig mConfig;
 		bool mGenerationFullFlags[4];
-		std::vector<Value*> mGeneration[4];
+		//各代触发回收的对象数，3 代在回收后按存活对象数调高
+		size_t mGenerationLimits[4];
+		bool mForceFull;
+		std::vector<HeapValue*> mGeneration[4];
+		std::vector<MarkWord> mMarkBits[4];
+		//1 代及更老的阵列，回收年轻代时从中查找有脏卡片的阵列
+		std::vector<HeapValue*> mOldArrays;
+		std::vector<GlobalSlot*> mRememberedGlobals;
+		//驻留字符串按内容的散列值保存
+		std::unordered_multimap<uint32_t, HeapValue*> mInterned;
+		std::vector<HeapValue*> mScanQueue;
+		std::vector<MarkRange> mMarkStack;
+		//实际使用的增量标记预算，自适应调节可能在未配置时启用
+		size_t mIncrementalBudget;
+		//正在增量标记的最老代号，为 0 时没有进行中的增量标记
+		int mMarkingGen;
+		size_t mMarkingScavenges;
+		static thread_local size_t sIncrementalMarking;
+		std::vector<HeapValue*> mDead;
+		std::thread mSweeper;
+		std::mutex mSweepLock;
+		std::condition_variable mSweepSignal;
+		std::vector<HeapValue*> mSweepQueue;
+		bool mSweepBusy;
+		bool mSweepStop;
+		uint8_t* mNursery;
+		uint8_t* mNurseryTop;
+		uint8_t* mNurseryEnd;
+		size_t mAllocatedBytes;
+		size_t mCollectThreshold;
+		size_t mCheckpoint;
+		//老年代（含未放入新生代的对象）分配的字节数，清扫线程释放的字节数
+		size_t mOldBytes;
+		std::atomic<size_t> mSweptBytes;
+		GCStats mStats;
+		//最近一次 GC 回收到的最老代号（只回收新生代时为 0），上次回收结束的时间及此后的停顿，回收耗时占比的滑动平均
+		int mLastCollectedGen;
+		std::chrono::steady_clock::time_point mLastCollectEnd;
+		uint64_t mPauseSinceCollect;
+		double mGCTimeShare;
+		const Engine* mSiteEngine;
+		std::vector<std::pair<HeapValue*, uint32_t>> mNurserySites;
+		std::unordered_map<const HeapValue*, uint32_t> mSites;
+		size_t mHeapWatchBytes;
+		std::function<void(Engine*)> mHeapWatch;
 	};
 
-	typedef Value* (*PFN_HOST_CALL)(Engine* context, size_t argc, Value** argv);
+	typedef Value (*PFN_HOST_CALL)(Engine* context, size_t argc, Value* argv);
+	//AOT 翻译器为每个字节码函数生成的本机函数，见 AOT.h
+	typedef void (*PFN_NATIVE_FUNCTION)(Engine* context);
+	typedef struct
+	{
+		const uint8_t* constants;		//常量区，格式与字节码文件中的常量区相同
+		size_t constantsSize;
+		uint32_t constantCount;
+		PFN_NATIVE_FUNCTION entry;
+	}NativeProgram;
+
 	class Engine
 	{
 		friend class MemoryGC;
+		friend class JIT;
+		friend class AOT;
+		friend class HeapSnapshot;
 	private:
-		typedef void (Engine::*InstructionFunc)(size_t tag);
+#if defined(BYTE_CODE_VM_CALL_DISPATCH)
+		typedef void (Engine::*InstructionHandler)(size_t tag);
+#elif defined(BYTE_CODE_VM_COMPUTED_GOTO)
+		typedef const void* InstructionHandler;
+#else
+		typedef size_t InstructionHandler;
+#endif
 		typedef struct
 		{
-			InstructionFunc func;
+			InstructionHandler handler;
 			size_t tag;
 		}Instruction;
 		typedef struct
 		{
 			const Instruction* ip;
-			std::vector<Value*>* datastack;
+			size_t base;
 		}CallNode;
 	public:
 		Engine();
 		~Engine();
 	public:
 		void LoadProgram(std::fstream& in);
+		//加载 AOT 翻译生成的本机程序，Run 时直接调用入口函数
+		void LoadProgram(const NativeProgram& program);
 		int Run(void);
 	public:
 		MemoryGC& GC(void) { return mGC; }
 	public:
-		void SetGlobalVariable(const std::wstring& name, Value* value);
-		Value* GetGlobalVariable(const std::wstring& name);
+		//全局变量按驻留后的变量名查找；变量名不是字符串时先转换为字符串
+		void SetGlobalVariable(const std::wstring& name, const Value& value);
+		Value GetGlobalVariable(const std::wstring& name);
+		void SetGlobalVariable(const Value& name, const Value& value);
+		Value GetGlobalVariable(const Value& name);
 
 		size_t AppendHostCall(PFN_HOST_CALL);
+		//指定读、写全局变量的宿主函数序号（参数依次为变量名，或变量名和值，写入后返回该值），须在加载程序前调用；
+		//  加载时其中以字符串常量为变量名的调用改写为 LDG/STG
+		void SetGlobalVariableHostCalls(size_t read, size_t write);
+	public:
+		typedef struct
+		{
+			size_t index;
+			InstructionID generic;
+			InstructionID current;
+			uint32_t quickened;
+			uint32_t deoptimized;
+		}QuickeningSite;
+		//返回所有执行过类型特化或退回通用实现的指令位置
+		std::vector<QuickeningSite> GetQuickeningStats(void) const;
+
+		static const size_t OPCODE_NGRAM_MAX = 4;
+		typedef struct
+		{
+			InstructionID ops[OPCODE_NGRAM_MAX];
+			size_t length;
+			uint64_t count;
+		}OpcodeNGram;
+		//开启后加载的程序不做融合与类型特化，运行时统计顺序执行的 2~4 条指令组合，须在 LoadProgram 之前设置
+		void SetProfiling(bool enable) { mProfiling = enable; }
+		//按出现次数从多到少返回统计结果
+		std::vector<OpcodeNGram> GetOpcodeNGrams(void) const;
+
+		//是否对热点函数和循环启用 JIT（默认启用，不支持的平台上无效），须在 LoadProgram 之前设置
+		void SetJIT(bool enable) { mJITEnabled = enable; }
+		//开启后记录每个堆对象由哪条指令分配（见 MemoryGC::AllocationSite），此时不使用 JIT，须在 LoadProgram 之前设置
+		void SetAllocationSites(bool enable) { mAllocationSites = enable; }
 	private:
 		void ClearProgram(void);
-		InstructionID ReadIID(std::fstream& in);
+		InstructionID ReadIID(std::istream& in);
 		template<class TNumber>
-		TNumber ReadNumber(std::fstream& in);
-		uint64_t Read7BitInt(std::fstream& in);
-		void ReadString(std::fstream& in, std::wstring& value);
-		bool ReadBoolean(std::fstream& in);
-		void ReadBytes(std::fstream& in, void* buffer,size_t size);
-		Value* ReadValue(std::fstream& in);
-		void ReadInstruction(std::fstream& in, Instruction* instruction);
+		TNumber ReadNumber(std::istream& in);
+		uint64_t Read7BitInt(std::istream& in);
+		Value ReadString(std::istream& in);
+		bool ReadBoolean(std::istream& in);
+		void ReadBytes(std::istream& in, void* buffer,size_t size);
+		Value ReadValue(std::istream& in);
+		InstructionID ReadInstruction(std::istream& in, Instruction* instruction);
+		void VerifyFrames(void);
+		void FuseInstructions(void);
+	private:
+		void InitDispatchTable(void);
+#if !defined(BYTE_CODE_VM_CALL_DISPATCH)
+		void Execute(bool exportDispatchTable);
+#endif
 	private:
 		void DATAStackAlloc(size_t size);
-		Value* DATAStackGet(size_t index);
-		void DATAStackPut(size_t index, Value* value);
-		Value* CALCStackPop(void);
-		void CALCStackPush(Value* value);
+		const Value& DATAStackGet(size_t index);
+		void DATAStackPut(size_t index, const Value& value);
+		Value CALCStackPop(void);
+		void CALCStackPush(const Value& value);
+		void CALCStackGrow(void);
 	private:
 		void InstructionNOOP(size_t tag) {}
 		void InstructionAND(size_t tag);
@@ -331,16 +897,81 @@ namespace VM
 		void InstructionSUB(size_t tag);
 		void InstructionSD(size_t tag);
 	private:
+		void Quicken(InstructionID generic, const Value& a, const Value& b);
+		void Deoptimize(InstructionID generic);
+		void InstructionADD_II(size_t tag);
+		void InstructionADD_RR(size_t tag);
+		void InstructionADD_SS(size_t tag);
+		void InstructionSUB_II(size_t tag);
+		void InstructionSUB_RR(size_t tag);
+		void InstructionMUL_II(size_t tag);
+		void InstructionMUL_RR(size_t tag);
+		void InstructionDIV_II(size_t tag);
+		void InstructionDIV_RR(size_t tag);
+		void InstructionLT_II(size_t tag);
+		void InstructionLT_RR(size_t tag);
+		void InstructionGT_II(size_t tag);
+		void InstructionGT_RR(size_t tag);
+		void InstructionEQ_II(size_t tag);
+		void InstructionEQ_RR(size_t tag);
+	private:
+		void ProfileInstruction(void);
+#if defined(BYTE_CODE_VM_CALL_DISPATCH)
+		void InstructionPROFILE(size_t tag);
+#endif
+		void StepGeneric(size_t length);
+		void ExecuteGeneric(InstructionID id, size_t tag);
+		void InstructionLD_LC_ADD_SD(size_t tag);
+		void InstructionLD_LD_ADD_SD(size_t tag);
+		void InstructionLD_LC_SUB_SD(size_t tag);
+		void InstructionLD_LD_LT_JMPN(size_t tag);
+		void InstructionLD_LC_LT_JMPN(size_t tag);
+		void InstructionLD_LD_GT_JMPN(size_t tag);
+		void InstructionLD_LC_GT_JMPN(size_t tag);
+		//变量名对应的全局变量，不存在时创建
+		GlobalSlot& GlobalVariable(const HeapValue* name);
+		//第 index 条指令开始的 "LC 变量名; CALLSYS" 可改写时返回 LDG 或 STG，否则返回 NOOP
+		InstructionID GlobalVariableSite(size_t index) const;
+		void BindGlobalVariables(void);
+		void InstructionLDG(size_t tag);
+		void InstructionSTG(size_t tag);
+	private:
+		const InstructionHandler* mDispatchTable;
 		std::vector<PFN_HOST_CALL> mHostCalls;
-		std::vector<Value*> mConstants;
+		std::vector<Value> mConstants;
+		//常量区中的全部阵列（包括嵌套的），GC 把它们的元素作为根逐个扫描
+		std::vector<HeapValue*> mConstantArrays;
 		size_t mInstructionCount;
 		Instruction* mInstructions;
+		std::vector<InstructionID> mOpcodes;
 		const Instruction* mIP;
-		std::vector<Value*> mCallParameters;
+		std::vector<Value> mCallParameters;
 		std::vector<CallNode> mCallStack;
-		std::vector<Value*> mCALCStack;
-		std::vector<Value*>* mDATAStack;
-		std::unordered_map<std::wstring, Value*> mGlobalVariableTable;
+		std::vector<Value> mCALCStack;
+		Value* mCALCTop;
+		Value* mCALCLimit;
+		std::vector<Value> mDATAStack;
+		size_t mDATABase;
+		//数据栈水位线：自上次 0 代回收以来只有它以上的部分被写入过，函数返回到更低的栈帧时随之降低
+		size_t mDATAWatermark;
+		//全局变量按槽位连续保存，deque 追加时不移动已有的元素，写屏障记录的地址和 LDG/STG 使用的地址保持有效；
+		//  变量名表以驻留字符串为键，给出变量所在的槽位
+		std::deque<GlobalSlot> mGlobalVariables;
+		std::unordered_map<const HeapValue*, size_t> mGlobalVariableTable;
+		//作为全局变量名的常量对应的变量，其它常量为空
+		std::vector<GlobalSlot*> mConstantGlobals;
+		size_t mReadGlobalHostCall;
+		size_t mWriteGlobalHostCall;
+		std::vector<QuickeningSite> mQuickeningSites;
+		bool mProfiling;
+		const Instruction* mProfileLast;
+		InstructionID mProfileHistory[OPCODE_NGRAM_MAX];
+		size_t mProfileHistoryLength;
+		std::unordered_map<uint64_t, uint64_t> mOpcodeNGrams;
+		bool mJITEnabled;
+		bool mAllocationSites;
+		JIT* mJIT;
+		PFN_NATIVE_FUNCTION mNativeEntry;
 		MemoryGC mGC;
 	};
 
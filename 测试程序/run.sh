@@ -0,0 +1,216 @@
+#!/usr/bin/env bash
+# 回归测试：把本目录下的 .程序 编译为字节码，用多种构建（分派方式、优化级别）和运行配置（GC 参数等）执行，
+# 每次的输出都与同名 .输出 文件逐字节比较。.输出 由原始实现生成（见 CNPL_TEST_REFERENCE），
+# 因此任何一种配置的结果与基线不同都会报告。
+#
+# 用法（Linux，可在任意目录执行）：
+#   CNPL_COMPILER="mono bin/Release/cnpl.exe" 测试程序/run.sh [程序名...]
+# 环境变量：
+#   CNPL_COMPILER        运行 cnpl 编译器的命令，必须设置
+#   CXX / CXXFLAGS       编译虚拟机使用的编译器与选项，默认 g++ / -O2，例如 CXXFLAGS="-O1 -g -fsanitize=address"
+#   CNPL_TEST_REFERENCE  设置为基线虚拟机（字节码宿主）的路径时，不运行测试，而是用它重新生成 .输出；
+#                        检验原始实现没有的行为（如堆上限）的程序改用当前构建生成，并逐项核对
+#   CNPL_TEST_AOT        为 0 时不测试 AOT（默认把每个程序翻译为 C++ 并编译成本机程序，按 README 中的步骤）
+# 每个程序可以有：
+#   名称.输入            作为标准输入，没有时标准输入为空
+#   名称.配置            每行一组环境变量，替换下面 CONFIGS 中的配置（用于只在特定配置下才有意义的程序）
+#   名称.内存            运行时的虚拟内存上限（KB），用于检验内存占用不随循环次数增长；AddressSanitizer 下不限制
+
+set -u
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TESTS="$ROOT/测试程序"
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--O2}
+export LC_ALL=C.UTF-8
+
+if [ -z "${CNPL_COMPILER:-}" ]; then
+	echo "CNPL_COMPILER is not set." >&2
+	exit 2
+fi
+
+case $(uname -m) in
+	x86_64) ARCH=x86_64 ;;
+	aarch64) ARCH=arm64 ;;
+	arm*) ARCH=arm32 ;;
+	*) ARCH=x86 ;;
+esac
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+#构建名|额外的编译选项，第一个为默认构建
+BUILDS=(
+	"default|"
+	"debug|-O0 -g"
+	"switch|-DBYTE_CODE_VM_SWITCH_DISPATCH"
+	"call|-DBYTE_CODE_VM_CALL_DISPATCH"
+)
+
+#默认构建上逐一运行的配置，其它构建只运行前两个
+CONFIGS=(
+	""
+	"CNPL_NO_JIT=1"
+	#新生代很小，分配时的安全点频繁触发回收
+	"CNPL_GC_NURSERY_KB=16"
+	"CNPL_GC_NURSERY_KB=16 CNPL_NO_JIT=1"
+	#对象很快晋升，老年代也频繁回收，老对象引用新对象的情况只能靠写屏障和卡表发现
+	"CNPL_GC_NURSERY_KB=16 CNPL_GC_GENERATION_LIMITS=256,512,1024"
+	#老年代增量标记：每段只有 1 微秒时标记跨越大量分配和写入，50 微秒时每段能完成较多工作
+	"CNPL_GC_SLICE_US=1 CNPL_GC_NURSERY_KB=16"
+	"CNPL_GC_SLICE_US=50"
+	#每次回收都回收全部老年代
+	"CNPL_GC_POLICY=full"
+	#停顿目标很小、回收耗时占比很低时，自适应调节会反复调整新生代大小，老年代回收改为增量标记
+	"CNPL_GC_PAUSE_TARGET_US=50 CNPL_GC_TIME_PERCENT=1"
+)
+
+PROGRAMS=()
+if [ $# -gt 0 ]; then
+	PROGRAMS=("$@")
+else
+	for f in "$TESTS"/*.程序; do
+		name=$(basename "$f")
+		PROGRAMS+=("${name%.程序}")
+	done
+fi
+
+#run 可执行文件 配置 输出文件 程序名 [字节码]
+run() {
+	local input=/dev/null
+	local limit=
+	[ -f "$TESTS/$4.输入" ] && input="$TESTS/$4.输入"
+	[ -f "$TESTS/$4.内存" ] && [[ "$CXXFLAGS" != *-fsanitize* ]] && limit=$(cat "$TESTS/$4.内存")
+	(cd "$WORK" && { [ -z "$limit" ] || ulimit -v "$limit"; } && env $2 "$1" ${5:+"$5"} < "$input" > "$3" 2>&1; echo "[退出码 $?]" >> "$3")
+}
+
+#configs 程序名 是否默认构建：输出该程序要运行的配置，每行一个
+configs() {
+	if [ -f "$TESTS/$1.配置" ]; then
+		cat "$TESTS/$1.配置"
+	elif [ "$2" = 1 ]; then
+		printf '%s\n' "${CONFIGS[@]}"
+	else
+		printf '%s\n' "${CONFIGS[@]:0:2}"
+	fi
+}
+
+FAILED=0
+fail() {
+	echo "FAIL $1"
+	diff "$2" "$3" | head -n 20
+	FAILED=$((FAILED + 1))
+}
+
+#编译器把以 / 开头的参数当作选项，相对的输出路径又以源文件所在目录为准，所以复制到工作目录后用相对路径编译；
+#编译出错时编译器只打印错误，以是否生成字节码为准
+for p in "${PROGRAMS[@]}"; do
+	cp "$TESTS/$p.程序" "$WORK/"
+	(cd "$WORK" && $CNPL_COMPILER -S "$p.程序" -T BIN -OS linux -ARCH $ARCH -O "$p.bin" > "$p.compile" 2>&1)
+	if [ ! -f "$WORK/$p.bin" ]; then
+		echo "FAIL $p: compile error"
+		cat "$WORK/$p.compile"
+		FAILED=$((FAILED + 1))
+	fi
+done
+
+if [ -n "${CNPL_TEST_REFERENCE:-}" ]; then
+	for p in "${PROGRAMS[@]}"; do
+		[ -f "$WORK/$p.bin" ] || continue
+		run "$CNPL_TEST_REFERENCE" "$(configs "$p" 1 | head -n 1)" "$TESTS/$p.输出" "$p" "$WORK/$p.bin"
+		echo "generated $p.输出"
+	done
+	exit $FAILED
+fi
+
+for b in "${BUILDS[@]}"; do
+	(
+		$CXX -std=c++11 $CXXFLAGS ${b#*|} -pthread -o "$WORK/cnpl.${b%%|*}" \
+			"$ROOT"/VM/*.cpp "$ROOT/Loader.Linux/main.cpp" > "$WORK/build.${b%%|*}.log" 2>&1 || echo "FAIL build ${b%%|*}"
+	) &
+done
+wait
+for b in "${BUILDS[@]}"; do
+	if [ ! -x "$WORK/cnpl.${b%%|*}" ]; then
+		echo "FAIL build ${b%%|*}"
+		cat "$WORK/build.${b%%|*}.log"
+		exit 1
+	fi
+done
+
+AOT=${CNPL_TEST_AOT:-1}
+if [ "$AOT" != 0 ]; then
+	mkdir -p "$WORK/native"
+	for f in "$ROOT"/VM/*.cpp "$ROOT/Loader.Linux/main.cpp"; do
+		name=$(basename "$f")
+		if ! $CXX -std=c++11 $CXXFLAGS -DBYTE_CODE_VM_NATIVE -pthread -c "$f" -o "$WORK/native/${name%.cpp}.o" > "$WORK/build.native.log" 2>&1; then
+			echo "FAIL build native"
+			cat "$WORK/build.native.log"
+			exit 1
+		fi
+	done
+fi
+
+for p in "${PROGRAMS[@]}"; do
+	[ -f "$WORK/$p.bin" ] || continue
+	n=0
+	for b in "${BUILDS[@]}"; do
+		build=${b%%|*}
+		[ "$build" = "${BUILDS[0]%%|*}" ] && first=1 || first=0
+		unset outputs
+		declare -A outputs
+		while IFS= read -r config; do
+			out="$WORK/out.$build.$n"
+			run "$WORK/cnpl.$build" "$config" "$out" "$p" "$WORK/$p.bin"
+			cmp -s "$out" "$TESTS/$p.输出" || fail "$p [$build] $config" "$TESTS/$p.输出" "$out"
+			#JIT 与解释器差分：关闭 JIT 的配置还要与同一构建下开启 JIT 的同一配置逐字节一致
+			outputs["k$config"]=$out
+			if [[ "$config" == *CNPL_NO_JIT=1* ]]; then
+				jit=$(echo ${config/CNPL_NO_JIT=1/})
+				if [ -n "${outputs["k$jit"]:-}" ] && ! cmp -s "${outputs["k$jit"]}" "$out"; then
+					fail "$p [$build] $config: JIT and interpreter differ" "${outputs["k$jit"]}" "$out"
+				fi
+			fi
+			n=$((n + 1))
+		done < <(configs "$p" $first)
+	done
+	#堆快照与分配位置记录不能改变程序的输出，写出的快照要能被汇总；CNPL_HEAP_SNAPSHOT_MB 使快照在运行中途写出
+	base=$(configs "$p" 1 | head -n 1)
+	for snapshot in "" "CNPL_HEAP_SNAPSHOT_MB=1"; do
+		rm -f "$WORK/heap.snapshot"
+		run "$WORK/cnpl.${BUILDS[0]%%|*}" "$base CNPL_HEAP_SNAPSHOT=heap.snapshot CNPL_ALLOCATION_SITES=1 $snapshot" "$WORK/out" "$p" "$WORK/$p.bin"
+		cmp -s "$WORK/out" "$TESTS/$p.输出" || fail "$p [snapshot] $snapshot" "$TESTS/$p.输出" "$WORK/out"
+		if [ -f "$WORK/heap.snapshot" ]; then
+			if ! (cd "$WORK" && CNPL_HEAP_SUMMARY=heap.snapshot "$WORK/cnpl.${BUILDS[0]%%|*}" > summary 2>&1); then
+				echo "FAIL $p [snapshot] $snapshot: summary error"
+				head -n 20 "$WORK/summary"
+				FAILED=$((FAILED + 1))
+			fi
+		elif [ -z "$snapshot" ] && [ "$(tail -n 1 "$TESTS/$p.输出")" = "[退出码 0]" ]; then
+			echo "FAIL $p [snapshot]: no snapshot written"
+			FAILED=$((FAILED + 1))
+		fi
+		n=$((n + 1))
+	done
+	#生成的源文件以 "../VM/AOT.h" 引用运行时，与放在加载器目录下编译时相同
+	if [ "$AOT" != 0 ]; then
+		if CNPL_AOT_OUTPUT="$WORK/$p.cpp" "$WORK/cnpl.${BUILDS[0]%%|*}" "$WORK/$p.bin" > "$WORK/aot.log" 2>&1 &&
+			$CXX -std=c++11 $CXXFLAGS -I "$ROOT/Loader.Linux" -pthread -o "$WORK/$p.native" "$WORK/$p.cpp" "$WORK"/native/*.o >> "$WORK/aot.log" 2>&1; then
+			while IFS= read -r config; do
+				run "$WORK/$p.native" "$config" "$WORK/out" "$p"
+				cmp -s "$WORK/out" "$TESTS/$p.输出" || fail "$p [aot] $config" "$TESTS/$p.输出" "$WORK/out"
+				n=$((n + 1))
+			done < <(configs "$p" 1 | grep -v CNPL_NO_JIT)
+		else
+			echo "FAIL $p [aot]: translate or compile error"
+			head -n 20 "$WORK/aot.log"
+			FAILED=$((FAILED + 1))
+		fi
+	fi
+	echo "$p: $n runs"
+done
+
+if [ $FAILED -ne 0 ]; then
+	echo "$FAILED failed"
+	exit 1
+fi
+echo "all passed"